@@ -12,6 +12,7 @@ BuildRequires: gcc
 BuildRequires: pkgconfig(librp-utils)
 BuildRequires: pkgconfig(libpcsclite)
 BuildRequires: pkgconfig(json-c)
+BuildRequires: pkgconfig(libcrypto)
 BuildRequires: uthash-devel
 
 %description
@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2015-2022 IoT.bzh Company
+ * Author: Fulup Ar Foll <fulup@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Build time ATR database generator. Reads a pcsc-tools smartcard_list.txt
+ * style file and writes a C header with card models and a byte trie
+ * (sorted exact edges + one '..' wildcard edge per node) used by
+ * pcscAtrLookup. Nibble masks ('3.', '.F') are expanded into exact edges.
+ * Usage: atr-gen smartcard_list.txt pcsc-atr-db.h
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ATR_GEN_MAX_LEN 33 // ISO7816-3 maximum ATR size
+#define ATR_GEN_EXPAND_MAX 256 // max exact ATRs generated from nibble masks
+
+typedef struct {
+  int byte;
+  int child;
+} genEdgeT;
+
+typedef struct {
+  genEdgeT *edges;
+  int count;
+  int any;   // wildcard child or -1
+  int model; // model index when an ATR ends here or -1
+} genNodeT;
+
+typedef struct {
+  char *label;
+  char *info;
+  char *family;
+  char *caps;
+  int sectors, blocks, blklen, size;
+} genModelT;
+
+typedef struct {
+  genNodeT *nodes;
+  int nodeCount;
+  genModelT *models;
+  int modelCount;
+  int edgeCount;
+} genDbT;
+
+static int genNewNode(genDbT *db) {
+  db->nodes = realloc(db->nodes, (db->nodeCount + 1) * sizeof(genNodeT));
+  db->nodes[db->nodeCount] = (genNodeT){.edges = NULL, .any = -1, .model = -1};
+  return db->nodeCount++;
+}
+
+// return child for byte (-1 = wildcard), create it when missing
+static int genChild(genDbT *db, int node, int byte) {
+  int child;
+
+  if (byte < 0) {
+    if (db->nodes[node].any < 0) {
+      child = genNewNode(db);
+      db->nodes[node].any = child;
+    }
+    return db->nodes[node].any;
+  }
+
+  genNodeT *current = &db->nodes[node];
+  int idx;
+  for (idx = 0; idx < current->count && current->edges[idx].byte < byte; idx++)
+    ;
+  if (idx < current->count && current->edges[idx].byte == byte)
+    return current->edges[idx].child;
+
+  // keep edges sorted for binary search at lookup time
+  child = genNewNode(db);
+  current = &db->nodes[node];
+  current->edges =
+      realloc(current->edges, (current->count + 1) * sizeof(genEdgeT));
+  memmove(&current->edges[idx + 1], &current->edges[idx],
+          (current->count - idx) * sizeof(genEdgeT));
+  current->edges[idx] = (genEdgeT){.byte = byte, .child = child};
+  current->count++;
+  db->edgeCount++;
+  return child;
+}
+
+static int genNibble(char digit, int *value) {
+  if (digit == '.')
+    return 0;
+  if (!isxdigit((unsigned char)digit))
+    return -1;
+  *value = isdigit((unsigned char)digit)
+               ? digit - '0'
+               : tolower((unsigned char)digit) - 'a' + 10;
+  return 0xF;
+}
+
+// parse one ATR pattern line into byte values and masks ('..' mask=0x00, '3.'
+// mask=0xF0), return pattern length or -1 when unsupported
+static int genParsePattern(const char *line, int *pattern, int *mask) {
+  int count = 0, expand = 1;
+
+  while (*line) {
+    if (isspace((unsigned char)*line)) {
+      line++;
+      continue;
+    }
+    if (count == ATR_GEN_MAX_LEN || !line[1])
+      return -1;
+
+    int high = 0, low = 0;
+    int highMask = genNibble(line[0], &high);
+    int lowMask = genNibble(line[1], &low);
+    if (highMask < 0 || lowMask < 0)
+      return -1; // regex classes are not supported
+    pattern[count] = high << 4 | low;
+    mask[count] = highMask << 4 | lowMask;
+
+    // half masked bytes become 16 exact edges each
+    if (mask[count] == 0xF0 || mask[count] == 0x0F)
+      expand *= 16;
+    if (expand > ATR_GEN_EXPAND_MAX)
+      return -1;
+    count++;
+
+    line += 2;
+    if (*line && !isspace((unsigned char)*line))
+      return -1;
+  }
+  return count;
+}
+
+// insert pattern below node, return count of end nodes stored within ends[]
+static int genInsert(genDbT *db, int node, const int *pattern, const int *mask,
+                     int plen, int *ends, int count) {
+  if (!plen) {
+    ends[count] = node;
+    return count + 1;
+  }
+  if (!mask[0] || mask[0] == 0xFF)
+    return genInsert(db, genChild(db, node, mask[0] ? pattern[0] : -1),
+                     pattern + 1, mask + 1, plen - 1, ends, count);
+
+  for (int byte = 0; byte < 256; byte++) {
+    if ((byte & mask[0]) != pattern[0])
+      continue;
+    count = genInsert(db, genChild(db, node, byte), pattern + 1, mask + 1,
+                      plen - 1, ends, count);
+  }
+  return count;
+}
+
+// model line: '@ label family=xxx sectors=n blocks=n blklen=n size=n caps=a,b'
+static int genParseModel(char *line, genModelT *model) {
+  char *token, *save;
+
+  token = strtok_r(line, " \t\n", &save);
+  if (!token)
+    return -1;
+  model->label = strdup(token);
+
+  while ((token = strtok_r(NULL, " \t\n", &save))) {
+    char *value = strchr(token, '=');
+    if (!value)
+      return -1;
+    *value++ = '\0';
+    if (!strcmp(token, "family"))
+      model->family = strdup(value);
+    else if (!strcmp(token, "caps"))
+      model->caps = strdup(value);
+    else if (!strcmp(token, "sectors"))
+      model->sectors = atoi(value);
+    else if (!strcmp(token, "blocks"))
+      model->blocks = atoi(value);
+    else if (!strcmp(token, "blklen"))
+      model->blklen = atoi(value);
+    else if (!strcmp(token, "size"))
+      model->size = atoi(value);
+    else
+      return -1;
+  }
+  return 0;
+}
+
+static void genPrintString(FILE *out, const char *value) {
+  fputc('"', out);
+  for (; value && *value; value++) {
+    if (*value == '"' || *value == '\\')
+      fputc('\\', out);
+    fputc(*value, out);
+  }
+  fputc('"', out);
+}
+
+static void genPrintCaps(FILE *out, const char *caps) {
+  char *list = strdup(caps ? caps : ""), *save;
+  int count = 0;
+
+  for (char *cap = strtok_r(list, ",", &save); cap;
+       cap = strtok_r(NULL, ",", &save)) {
+    fprintf(out, "%sPCSC_CAP_", count++ ? "|" : "");
+    for (; *cap; cap++)
+      fputc(toupper((unsigned char)*cap), out);
+  }
+  if (!count)
+    fprintf(out, "0");
+  free(list);
+}
+
+static int genWrite(genDbT *db, const char *input, FILE *out) {
+  fprintf(out, "// generated by atr-gen from %s, do not edit\n\n", input);
+
+  fprintf(out, "static const pcscCardModelT pcscAtrModels[] = {\n");
+  for (int idx = 0; idx < db->modelCount; idx++) {
+    genModelT *model = &db->models[idx];
+    fprintf(out, "    {.label=");
+    genPrintString(out, model->label ? model->label : "unknown");
+    fprintf(out, ", .info=");
+    genPrintString(out, model->info);
+    fprintf(out,
+            ", .cardId=ATR_%s, .sectors=%d, .blocks=%d, .blkLen=%d, "
+            ".size=%d, .caps=",
+            model->family ? model->family : "UNKNOWN", model->sectors,
+            model->blocks, model->blklen, model->size);
+    genPrintCaps(out, model->caps);
+    fprintf(out, "},\n");
+  }
+  fprintf(out, "    {.label=NULL} // trailer\n};\n\n");
+
+  // nodes are numbered at creation, edges are flattened per node
+  int first = 0;
+  fprintf(out, "static const pcscAtrNodeT pcscAtrNodes[] = {\n");
+  for (int idx = 0; idx < db->nodeCount; idx++) {
+    genNodeT *node = &db->nodes[idx];
+    fprintf(out, "    {.first=%d, .count=%d, .any=%d, .model=%d},\n", first,
+            node->count, node->any, node->model);
+    first += node->count;
+  }
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "static const pcscAtrEdgeT pcscAtrEdges[] = {\n");
+  for (int idx = 0; idx < db->nodeCount; idx++) {
+    genNodeT *node = &db->nodes[idx];
+    for (int jdx = 0; jdx < node->count; jdx++) {
+      fprintf(out, "    {.byte=0x%02X, .child=%d},\n", node->edges[jdx].byte,
+              node->edges[jdx].child);
+    }
+  }
+  fprintf(out, "    {.byte=0, .child=0} // trailer\n};\n");
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  genDbT db = {0};
+  int pattern[ATR_GEN_MAX_LEN], mask[ATR_GEN_MAX_LEN];
+  int ends[ATR_GEN_EXPAND_MAX];
+  int plen = -1, current = -1, lineno = 0, skipped = 0;
+  char *line = NULL;
+  size_t size = 0;
+  FILE *in, *out;
+
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s smartcard_list.txt output.h\n", argv[0]);
+    return 1;
+  }
+  in = fopen(argv[1], "r");
+  if (!in) {
+    fprintf(stderr, "atr-gen: fail to open %s\n", argv[1]);
+    return 1;
+  }
+  genNewNode(&db); // root
+
+  while (getline(&line, &size, in) >= 0) {
+    lineno++;
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (line[0] == '#' || line[0] == '\0')
+      continue;
+
+    if (line[0] != '\t') {
+      // new ATR entry, model is created with its first description line
+      plen = genParsePattern(line, pattern, mask);
+      current = -1;
+      if (plen <= 0) {
+        skipped++;
+        plen = -1;
+      }
+      continue;
+    }
+    if (plen < 0)
+      continue;
+
+    char *text = line + strspn(line, "\t ");
+
+    // first description creates model, duplicated patterns keep first one
+    if (current < 0) {
+      int count = genInsert(&db, 0, pattern, mask, plen, ends, 0);
+      for (int idx = 0; idx < count; idx++) {
+        if (db.nodes[ends[idx]].model >= 0)
+          continue;
+        if (current < 0) {
+          db.models =
+              realloc(db.models, (db.modelCount + 1) * sizeof(genModelT));
+          db.models[db.modelCount] = (genModelT){.info = NULL};
+          current = db.modelCount++;
+        }
+        db.nodes[ends[idx]].model = current;
+      }
+      if (current < 0)
+        current = db.nodes[ends[0]].model;
+    }
+
+    // only first description line is kept
+    genModelT *model = &db.models[current];
+    if (text[0] == '@') {
+      if (model->label)
+        continue; // duplicated pattern
+      if (genParseModel(text + 1, model)) {
+        fprintf(stderr, "atr-gen: %s:%d invalid model line\n", argv[1],
+                lineno);
+        return 1;
+      }
+    } else if (!model->info) {
+      model->info = strdup(text);
+    }
+  }
+  fclose(in);
+  free(line);
+
+  out = fopen(argv[2], "w");
+  if (!out) {
+    fprintf(stderr, "atr-gen: fail to create %s\n", argv[2]);
+    return 1;
+  }
+  genWrite(&db, argv[1], out);
+  fclose(out);
+
+  fprintf(stderr,
+          "atr-gen: %d models %d nodes %d edges (%d unsupported patterns)\n",
+          db.modelCount, db.nodeCount, db.edgeCount, skipped);
+  return 0;
+}
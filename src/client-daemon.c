@@ -0,0 +1,788 @@
+/*
+ * Copyright (C) 2015-2022 IoT.bzh Company
+ * Author: Fulup Ar Foll <fulup@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Daemon mode: pcscd-client owns every reader matching config and serves
+ * batched requests (group, command, uuid, event subscription) over a unix
+ * socket (check client-daemon.h). Services share one pcscd context, one card
+ * session and the library caches (learned keys, diversified keys) instead of
+ * connecting and authenticating on their own for each tap. Each client is
+ * served by its own thread, card access goes through the library reader
+ * scheduler: requests are queued by message priority class and deadline, bulk
+ * groups yield to interactive requests between commands. Message deadline is
+ * the request whole budget, what queueing left is checked before each command
+ * sent to card. Between two requests of a client, sectors queued by read-ahead
+ * are prefetched as bulk work until the client sends its next request.
+ */
+
+#define _GNU_SOURCE
+
+#include "client-daemon.h"
+#include "client-pcsc.h"
+#include "client-provision.h"
+#include "pcsc-glue.h"
+
+#include <errno.h>
+#include <grp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pcsclite.h>
+
+#define DMN_CLIENT_MAX 32
+#define DMN_SEND_TIMEOUT 1 // seconds, slower clients are dropped
+#define DMN_READAHEAD_WAIT 5 // ms, read-ahead is skipped when reader stays busy
+
+typedef struct {
+  pcscHandleT *handle;
+  ulong tid;
+  int present;
+  u_int64_t uuid;
+} dmnReaderT;
+
+typedef struct {
+  int fd;
+  int subscribed;
+  int dead; // connection lost, thread is joined by main loop
+  pthread_t tid;
+  pthread_mutex_t sendLock; // replies and events are not interleaved
+  int pushing;              // events being sent outside daemon lock
+  pcscTokenT *token;        // aborts in-flight request when client is closed
+  int reader;               // last reader of card requests +1 (0=none)
+  struct dmnS *daemon;
+  u_int8_t buffer[DMN_MSG_MAX]; // current request message
+} dmnClientT;
+
+typedef struct {
+  u_int8_t *buffer;
+  size_t used;
+  u_int16_t count;
+} dmnReplyT;
+
+typedef struct dmnS {
+  const daemonOptsT *opts;
+  pcscConfigT *config;
+  pthread_mutex_t lock; // readers state, clients and counters
+  pthread_cond_t pushed; // an event push released its clients
+  dmnReaderT readers[PCSC_MAX_DEV];
+  int rcount;
+  dmnClientT *clients[DMN_CLIENT_MAX];
+  int listenFd;
+  gid_t gid; // --daemon-group members may connect, (gid_t)-1 owner only
+  ulong batches;
+  ulong requests;
+} dmnT;
+
+static volatile sig_atomic_t dmnStopped;
+
+static void dmnSigCB(int sig) { dmnStopped = 1; }
+
+static u_int64_t dmnNowMs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (u_int64_t)now.tv_sec * 1000 + (u_int64_t)now.tv_nsec / 1000000;
+}
+
+// caller holds client sendLock
+static int dmnSend(dmnClientT *client, const void *buffer, size_t len) {
+  const u_int8_t *ptr = buffer;
+
+  while (len) {
+    ssize_t count = send(client->fd, ptr, len, MSG_NOSIGNAL);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0) {
+      shutdown(client->fd, SHUT_RDWR); // wakes up client thread
+      return -1;
+    }
+    ptr += count;
+    len -= (size_t)count;
+  }
+  return 0;
+}
+
+static int dmnRecv(dmnClientT *client, void *buffer, size_t len) {
+  u_int8_t *ptr = buffer;
+
+  while (len) {
+    ssize_t count = recv(client->fd, ptr, len, 0);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return -1;
+    ptr += count;
+    len -= (size_t)count;
+  }
+  return 0;
+}
+
+// append one result/event item, return payload pointer or NULL when full
+static u_int8_t *dmnReplyItem(dmnReplyT *reply, u_int8_t op, u_int8_t reader,
+                              u_int32_t id, size_t len) {
+  size_t size = sizeof(dmnItemT) + len;
+
+  if (reply->used + size > DMN_MSG_MAX)
+    return NULL;
+  dmnItemT *item = (dmnItemT *)&reply->buffer[reply->used];
+  *item = (dmnItemT){.op = op, .reader = reader, .len = (u_int16_t)len,
+                     .id = id};
+  reply->used += size;
+  reply->count++;
+  return (u_int8_t *)(item + 1);
+}
+
+static void dmnReplyStatus(dmnReplyT *reply, const dmnItemT *req,
+                           int32_t status, const void *data, size_t len) {
+  u_int8_t *payload = dmnReplyItem(reply, DMN_OP_RESULT | req->op,
+                                   req->reader, req->id, sizeof(status) + len);
+  if (!payload) {
+    // reply full, keep a bare error status for this request
+    status = -1;
+    len = 0;
+    payload = dmnReplyItem(reply, DMN_OP_RESULT | req->op, req->reader,
+                           req->id, sizeof(status));
+    if (!payload)
+      return;
+  }
+  memcpy(payload, &status, sizeof(status));
+  if (len)
+    memcpy(payload + sizeof(status), data, len);
+}
+
+static void dmnReplyError(dmnReplyT *reply, const dmnItemT *req,
+                          const char *error) {
+  dmnReplyStatus(reply, req, -1, error, strlen(error));
+}
+
+// push card event to subscribers. Event and subscriber list are taken under
+// daemon lock, sends happen after it: a stalled subscriber only delays events
+static void dmnBroadcast(dmnT *daemon, int index, ulong state,
+                         u_int64_t uuid) {
+  u_int8_t buffer[sizeof(dmnMsgT) + sizeof(dmnItemT) + 12];
+  dmnMsgT *msg = (dmnMsgT *)buffer;
+  dmnItemT *item = (dmnItemT *)(msg + 1);
+  u_int32_t state32 = (u_int32_t)state;
+  dmnClientT *clients[DMN_CLIENT_MAX];
+  int count = 0;
+
+  *msg = (dmnMsgT){.len = sizeof(buffer) - sizeof(dmnMsgT), .count = 1};
+  *item = (dmnItemT){.op = DMN_OP_EVENT, .reader = (u_int8_t)index,
+                     .len = 12};
+  memcpy(item + 1, &state32, sizeof(state32));
+  memcpy((u_int8_t *)(item + 1) + sizeof(state32), &uuid, sizeof(uuid));
+
+  // pushing keeps client allocated until dmnClientClose sees it released
+  pthread_mutex_lock(&daemon->lock);
+  for (int idx = 0; idx < DMN_CLIENT_MAX; idx++) {
+    dmnClientT *client = daemon->clients[idx];
+    if (!client || !client->subscribed || client->dead)
+      continue;
+    client->pushing++;
+    clients[count++] = client;
+  }
+  pthread_mutex_unlock(&daemon->lock);
+
+  for (int idx = 0; idx < count; idx++) {
+    pthread_mutex_lock(&clients[idx]->sendLock);
+    dmnSend(clients[idx], buffer, sizeof(buffer));
+    pthread_mutex_unlock(&clients[idx]->sendLock);
+  }
+
+  pthread_mutex_lock(&daemon->lock);
+  for (int idx = 0; idx < count; idx++)
+    clients[idx]->pushing--;
+  pthread_cond_broadcast(&daemon->pushed);
+  pthread_mutex_unlock(&daemon->lock);
+}
+
+static int dmnMonitorCB(pcscHandleT *handle, ulong state, void *ctx) {
+  dmnT *daemon = (dmnT *)ctx;
+  u_int64_t uuid = 0;
+  int index;
+
+  for (index = 0; index < daemon->rcount; index++) {
+    if (daemon->readers[index].handle == handle)
+      break;
+  }
+  if (index == daemon->rcount)
+    return 0;
+
+  // uuid read is a card exchange, queued ahead of pending requests
+  if (state & SCARD_STATE_PRESENT) {
+    pcscSchedAcquire(handle, PCSC_PRIO_INTERACTIVE, 0);
+    uuid = pcscGetCardUuid(handle);
+    pcscSchedRelease(handle);
+  }
+
+  pthread_mutex_lock(&daemon->lock);
+  dmnReaderT *reader = &daemon->readers[index];
+  reader->present = (state & SCARD_STATE_PRESENT) != 0;
+  reader->uuid = uuid;
+  if (daemon->opts->verbose)
+    fprintf(stderr, " -- daemon: reader=%s card=%lX %s\n",
+            pcscReaderName(handle), (ulong)reader->uuid,
+            reader->present ? "inserted" : "removed");
+  pthread_mutex_unlock(&daemon->lock);
+
+  dmnBroadcast(daemon, index, state, uuid);
+  return 0;
+}
+
+// return reader index holding a card or -1
+static int dmnSelectReader(dmnT *daemon, u_int8_t index, u_int64_t *uuid) {
+  int found = -1;
+
+  pthread_mutex_lock(&daemon->lock);
+  if (index != DMN_READER_ANY) {
+    if (index < daemon->rcount && daemon->readers[index].present)
+      found = index;
+  } else {
+    for (int idx = 0; idx < daemon->rcount && found < 0; idx++) {
+      if (daemon->readers[idx].present)
+        found = idx;
+    }
+  }
+  if (found >= 0)
+    *uuid = daemon->readers[found].uuid;
+  pthread_mutex_unlock(&daemon->lock);
+  return found;
+}
+
+static u_int64_t dmnReaderUuid(dmnT *daemon, int index) {
+  pthread_mutex_lock(&daemon->lock);
+  u_int64_t uuid = daemon->readers[index].uuid;
+  pthread_mutex_unlock(&daemon->lock);
+  return uuid;
+}
+
+// execute one command, return data length sent back (0 for write)
+static long dmnExecCmd(pcscHandleT *handle, const pcscCmdT *cmd,
+                       u_int8_t *data) {
+  if (cmd->action == PCSC_ACTION_WRITE || !cmd->dlen)
+    return pcscExecOneCmd(handle, cmd, NULL) ? -1 : 0;
+  if (pcscExecOneCmd(handle, cmd, data))
+    return -1;
+  return (long)cmd->dlen;
+}
+
+// reader is held by caller, it is yielded between commands to higher classes
+// (a mifare command stays within one sector)
+static void dmnExecGroup(dmnT *daemon, int index, u_int64_t uuid,
+                         const dmnItemT *req, int32_t group,
+                         dmnReplyT *reply) {
+  pcscHandleT *handle = daemon->readers[index].handle;
+  pcscConfigT *config = daemon->config;
+  size_t size = 0;
+  int32_t status = 0;
+
+  // one result holds every command entry
+  u_int8_t *entries = malloc(DMN_MSG_MAX);
+  if (!entries) {
+    dmnReplyError(reply, req, "out of memory");
+    return;
+  }
+  for (int idx = 0; config->cmds[idx].uid; idx++) {
+    const pcscCmdT *cmd = &config->cmds[idx];
+    if (!(group <= cmd->group * -1 || group == cmd->group))
+      continue;
+
+    // card may have been swapped while reader was yielded
+    if (pcscSchedYield(handle) && dmnReaderUuid(daemon, index) != uuid) {
+      status = -1;
+      break;
+    }
+
+    u_int8_t data[cmd->dlen + 1];
+    long dlen = dmnExecCmd(handle, cmd, data);
+    dmnEntryT entry = {.status = dlen < 0 ? -1 : 0,
+                       .dlen = dlen < 0 ? 0 : (u_int16_t)dlen};
+    if (size + sizeof(entry) + entry.dlen > DMN_MSG_MAX / 2) {
+      status = -1;
+      break;
+    }
+    memcpy(&entries[size], &entry, sizeof(entry));
+    memcpy(&entries[size + sizeof(entry)], data, entry.dlen);
+    size += sizeof(entry) + entry.dlen;
+    if (dlen < 0) {
+      status = -1;
+      if (pcscErrorClass(handle) == PCSC_ERR_CARD_GONE ||
+          pcscErrorClass(handle) == PCSC_ERR_ABORTED)
+        break;
+    }
+  }
+  dmnReplyStatus(reply, req, status, entries, size);
+  free(entries);
+}
+
+static void dmnExecItem(dmnClientT *client, const dmnMsgT *msg,
+                        const dmnItemT *req, const u_int8_t *payload,
+                        dmnReplyT *reply) {
+  dmnT *daemon = client->daemon;
+  u_int64_t start = dmnNowMs();
+  u_int64_t uuid = 0;
+  int index;
+
+  switch (req->op) {
+  case DMN_OP_SUBSCRIBE:
+    client->subscribed = 1;
+    dmnReplyStatus(reply, req, 0, NULL, 0);
+    return;
+
+  case DMN_OP_SCHED: {
+    pcscSchedStatsT stats;
+    index = req->reader == DMN_READER_ANY ? 0 : req->reader;
+    if (index >= daemon->rcount) {
+      dmnReplyError(reply, req, "unknown reader");
+      return;
+    }
+    pcscSchedStats(daemon->readers[index].handle, &stats);
+    dmnReplyStatus(reply, req, 0, &stats, sizeof(stats));
+    return;
+  }
+
+  case DMN_OP_UUID:
+  case DMN_OP_GROUP:
+  case DMN_OP_CMD:
+    break;
+
+  default:
+    dmnReplyError(reply, req, "unknown request");
+    return;
+  }
+
+  index = dmnSelectReader(daemon, req->reader, &uuid);
+  if (index < 0) {
+    dmnReplyError(reply, req, "no card");
+    return;
+  }
+  if (req->op == DMN_OP_UUID) {
+    dmnReplyStatus(reply, req, 0, &uuid, sizeof(uuid));
+    return;
+  }
+
+  pcscHandleT *handle = daemon->readers[index].handle;
+  if (pcscSchedAcquire(handle, (pcscPrioE)msg->prio, msg->deadline)) {
+    dmnReplyError(reply, req, pcscErrorMsg(handle));
+    return;
+  }
+  // execution gets what queueing left from request budget
+  if (msg->deadline) {
+    u_int64_t spent = dmnNowMs() - start;
+    pcscSetDeadline(handle, PCSC_DEADLINE_GROUP,
+                    spent < msg->deadline ? msg->deadline - spent : 1);
+  }
+  pcscSetToken(handle, client->token);
+  client->reader = index + 1;
+
+  if (req->op == DMN_OP_GROUP) {
+    int32_t group;
+    if (req->len != sizeof(group)) {
+      dmnReplyError(reply, req, "invalid group payload");
+    } else {
+      memcpy(&group, payload, sizeof(group));
+      dmnExecGroup(daemon, index, uuid, req, group, reply);
+    }
+  } else {
+    char uid[req->len + 1];
+    memcpy(uid, payload, req->len);
+    uid[req->len] = '\0';
+    const pcscCmdT *cmd = pcscCmdByUid(daemon->config, uid);
+    if (!cmd) {
+      dmnReplyError(reply, req, "unknown command");
+    } else {
+      u_int8_t data[cmd->dlen + 1];
+      long dlen = dmnExecCmd(handle, cmd, data);
+      if (dlen < 0)
+        dmnReplyError(reply, req, pcscErrorMsg(handle));
+      else
+        dmnReplyStatus(reply, req, 0, data, (size_t)dlen);
+    }
+  }
+  pcscSchedRelease(handle);
+}
+
+// prefetch read-ahead sectors while client decides, sector by sector, until
+// client sends a new request or another class waits for the reader
+static void dmnReadAhead(dmnClientT *client, int index) {
+  pcscHandleT *handle = client->daemon->readers[index].handle;
+  struct pollfd pfd = {.fd = client->fd, .events = POLLIN};
+
+  // queue and card handle belong to scheduler holder, probe them once granted
+  if (pcscSchedAcquire(handle, PCSC_PRIO_BULK, DMN_READAHEAD_WAIT))
+    return;
+  if (pcscReadAhead(handle, "readahead", 0) <= 0) {
+    pcscSchedRelease(handle);
+    return;
+  }
+  pcscSetToken(handle, client->token);
+  while (poll(&pfd, 1, 0) == 0 &&
+         pcscReadAhead(handle, "readahead", 1) > 0) {
+    if (pcscSchedYield(handle))
+      break;
+  }
+  pcscSchedRelease(handle);
+}
+
+// execute a complete request message, reply with one message
+static int dmnExecMsg(dmnClientT *client, size_t len) {
+  const dmnMsgT *msg = (const dmnMsgT *)client->buffer;
+  dmnReplyT reply = {.used = sizeof(dmnMsgT)};
+  size_t offset = sizeof(dmnMsgT);
+  int idx, err;
+
+  reply.buffer = malloc(DMN_MSG_MAX);
+  if (!reply.buffer)
+    return -1;
+
+  for (idx = 0; idx < msg->count; idx++) {
+    const dmnItemT *req = (const dmnItemT *)&client->buffer[offset];
+    if (offset + sizeof(dmnItemT) > len ||
+        offset + sizeof(dmnItemT) + req->len > len)
+      break; // truncated item, client gets fewer results than requests
+    dmnExecItem(client, msg, req, (const u_int8_t *)(req + 1), &reply);
+    offset += sizeof(dmnItemT) + req->len;
+  }
+
+  pthread_mutex_lock(&client->daemon->lock);
+  client->daemon->batches++;
+  client->daemon->requests += (ulong)idx;
+  pthread_mutex_unlock(&client->daemon->lock);
+
+  *(dmnMsgT *)reply.buffer = (dmnMsgT){
+      .len = (u_int32_t)(reply.used - sizeof(dmnMsgT)), .count = reply.count};
+  pthread_mutex_lock(&client->sendLock);
+  err = dmnSend(client, reply.buffer, reply.used);
+  pthread_mutex_unlock(&client->sendLock);
+  free(reply.buffer);
+
+  if (!err && client->reader)
+    dmnReadAhead(client, client->reader - 1);
+  return err;
+}
+
+static void *dmnClientThread(void *ctx) {
+  dmnClientT *client = (dmnClientT *)ctx;
+  dmnMsgT *msg = (dmnMsgT *)client->buffer;
+
+  while (!dmnRecv(client, msg, sizeof(dmnMsgT))) {
+    if (msg->len > DMN_MSG_MAX - sizeof(dmnMsgT))
+      break; // oversized message, protocol error
+    if (dmnRecv(client, msg + 1, msg->len) ||
+        dmnExecMsg(client, sizeof(dmnMsgT) + msg->len))
+      break;
+  }
+
+  pthread_mutex_lock(&client->daemon->lock);
+  client->dead = 1;
+  pthread_mutex_unlock(&client->daemon->lock);
+  return NULL;
+}
+
+// join client thread and free its slot
+static void dmnClientClose(dmnT *daemon, int slot) {
+  pthread_mutex_lock(&daemon->lock);
+  dmnClientT *client = daemon->clients[slot];
+  daemon->clients[slot] = NULL;
+  pthread_mutex_unlock(&daemon->lock);
+
+  pcscTokenCancel(client->token);
+  shutdown(client->fd, SHUT_RDWR);
+
+  // shutdown fails an event push in progress, wait for it to release client
+  pthread_mutex_lock(&daemon->lock);
+  while (client->pushing)
+    pthread_cond_wait(&daemon->pushed, &daemon->lock);
+  pthread_mutex_unlock(&daemon->lock);
+
+  pthread_join(client->tid, NULL);
+  close(client->fd);
+  pthread_mutex_destroy(&client->sendLock);
+  pcscTokenFree(client->token);
+  free(client);
+}
+
+// peer runs as daemon user or belongs to --daemon-group
+static int dmnPeerAllowed(dmnT *daemon, int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+    return 0;
+  if (cred.uid == getuid())
+    return 1;
+  if (daemon->gid == (gid_t)-1)
+    return 0;
+  if (cred.gid == daemon->gid)
+    return 1;
+
+  // supplementary membership, socket file mode already allows it
+  struct group *grp = getgrgid(daemon->gid);
+  struct passwd *pwd = getpwuid(cred.uid);
+  if (!grp || !pwd)
+    return 0;
+  for (char **member = grp->gr_mem; *member; member++) {
+    if (!strcmp(*member, pwd->pw_name))
+      return 1;
+  }
+  return 0;
+}
+
+static void dmnAccept(dmnT *daemon) {
+  struct timeval timeout = {.tv_sec = DMN_SEND_TIMEOUT};
+  dmnClientT *client;
+  int slot;
+
+  int fd = accept4(daemon->listenFd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+  if (!dmnPeerAllowed(daemon, fd)) {
+    if (daemon->opts->verbose)
+      fprintf(stderr, " -- daemon: client refused (uid/gid not allowed)\n");
+    goto OnErrorExit;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  // only main loop fills slots
+  pthread_mutex_lock(&daemon->lock);
+  for (slot = 0; slot < DMN_CLIENT_MAX && daemon->clients[slot]; slot++)
+    ;
+  pthread_mutex_unlock(&daemon->lock);
+  if (slot == DMN_CLIENT_MAX) {
+    fprintf(stderr, " -- daemon: too many clients (max=%d)\n", DMN_CLIENT_MAX);
+    goto OnErrorExit;
+  }
+
+  client = calloc(1, sizeof(dmnClientT));
+  if (!client)
+    goto OnErrorExit;
+  client->fd = fd;
+  client->daemon = daemon;
+  client->token = pcscTokenCreate();
+  if (!client->token) {
+    free(client);
+    goto OnErrorExit;
+  }
+  pthread_mutex_init(&client->sendLock, NULL);
+  if (pthread_create(&client->tid, NULL, dmnClientThread, client)) {
+    pthread_mutex_destroy(&client->sendLock);
+    pcscTokenFree(client->token);
+    free(client);
+    goto OnErrorExit;
+  }
+
+  pthread_mutex_lock(&daemon->lock);
+  daemon->clients[slot] = client;
+  pthread_mutex_unlock(&daemon->lock);
+  return;
+
+OnErrorExit:
+  close(fd);
+}
+
+static int dmnListen(dmnT *daemon) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  struct stat st;
+  mode_t umaskOld;
+  int err;
+
+  if (strlen(daemon->opts->path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, " -- daemon: socket path too long %s\n",
+            daemon->opts->path);
+    return -1;
+  }
+  strcpy(addr.sun_path, daemon->opts->path);
+
+  daemon->gid = (gid_t)-1;
+  if (daemon->opts->group) {
+    struct group *grp = getgrnam(daemon->opts->group);
+    if (!grp) {
+      fprintf(stderr, " -- daemon: unknown group %s\n", daemon->opts->group);
+      return -1;
+    }
+    daemon->gid = grp->gr_gid;
+  }
+
+  // only replace a stale socket, never an unrelated file
+  if (!lstat(addr.sun_path, &st)) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, " -- daemon: %s exists and is not a socket\n",
+              daemon->opts->path);
+      return -1;
+    }
+    unlink(addr.sun_path);
+  }
+
+  daemon->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (daemon->listenFd < 0)
+    goto OnErrorExit;
+
+  // socket is created owner only, then opened to --daemon-group
+  umaskOld = umask(0177);
+  err = bind(daemon->listenFd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(umaskOld);
+  if (err)
+    goto OnErrorExit;
+  if (daemon->gid != (gid_t)-1 &&
+      (chown(addr.sun_path, (uid_t)-1, daemon->gid) ||
+       chmod(addr.sun_path, 0660)))
+    goto OnErrorExit;
+  if (listen(daemon->listenFd, DMN_CLIENT_MAX))
+    goto OnErrorExit;
+  return 0;
+
+OnErrorExit:
+  fprintf(stderr, " -- daemon: fail to listen on %s error=%s\n",
+          daemon->opts->path, strerror(errno));
+  return -1;
+}
+
+// accept clients and reap dead ones until SIGINT/SIGTERM
+static void dmnLoop(dmnT *daemon) {
+  struct pollfd pfd = {.fd = daemon->listenFd, .events = POLLIN};
+
+  while (!dmnStopped) {
+    if (poll(&pfd, 1, 500) > 0 && (pfd.revents & POLLIN))
+      dmnAccept(daemon);
+
+    for (int idx = 0; idx < DMN_CLIENT_MAX; idx++) {
+      pthread_mutex_lock(&daemon->lock);
+      int dead = daemon->clients[idx] && daemon->clients[idx]->dead;
+      pthread_mutex_unlock(&daemon->lock);
+      if (dead)
+        dmnClientClose(daemon, idx);
+    }
+  }
+}
+
+// queue time per scheduler class
+static void dmnPrintSched(pcscHandleT *handle) {
+  pcscSchedStatsT stats;
+
+  pcscSchedStats(handle, &stats);
+  fprintf(stderr, "    %-12s %8s %8s %9s %9s %9s %9s\n", "class", "granted",
+          "expired", "preempted", "depth-max", "avg(us)", "max(us)");
+  for (int idx = 0; idx < PCSC_PRIO_COUNT; idx++) {
+    const pcscSchedClassT *prio = &stats.classes[idx];
+    if (!prio->granted && !prio->expired)
+      continue;
+    fprintf(stderr, "    %-12s %8ld %8ld %9ld %9ld %9ld %9ld\n",
+            pcscPrioLabel(idx), prio->granted, prio->expired,
+            prio->preempted, prio->depthMax,
+            prio->granted ? prio->waitUsec / prio->granted : 0,
+            prio->waitMax);
+  }
+}
+
+int daemonRun(pcscConfigT *config, const daemonOptsT *opts) {
+  dmnT daemon = {.opts = opts, .config = config, .listenFd = -1};
+  const char *readerList[PCSC_MAX_DEV];
+  ulong readerCount = PCSC_MAX_DEV;
+  pcscHandleT *list; // pcscd context and reader names, kept until exit
+
+  pthread_mutex_init(&daemon.lock, NULL);
+  pthread_cond_init(&daemon.pushed, NULL);
+  list = pcscList(readerList, &readerCount);
+  if (!list) {
+    fprintf(stderr, " -- daemon: fail to connect to pcscd\n");
+    goto OnErrorExit;
+  }
+  if (dmnListen(&daemon))
+    goto OnErrorExit;
+
+  // readers are registered before monitors start, callbacks search them
+  for (ulong idx = 0; idx < readerCount && daemon.rcount < config->maxdev;
+       idx++) {
+    if (config->reader && !strcasestr(readerList[idx], config->reader))
+      continue;
+
+    pcscHandleT *handle = pcscConnect(config->uid, readerList[idx]);
+    if (!handle)
+      continue;
+    pcscSetOpt(handle, PCSC_OPT_VERBOSE, config->verbose);
+    pcscSetOpt(handle, PCSC_OPT_TIMEOUT, config->timeout);
+    pcscSetOpt(handle, PCSC_OPT_BITRATE, (ulong)config->bitrate);
+    if (config->retry >= 0)
+      pcscSetOpt(handle, PCSC_OPT_RETRY, (ulong)config->retry);
+    pcscSetOpt(handle, PCSC_OPT_DEBOUNCE, (ulong)config->debounce);
+    pcscSetOpt(handle, PCSC_OPT_DUPTAP, (ulong)config->duptap);
+    pcscSetOpt(handle, PCSC_OPT_READAHEAD, (ulong)config->readahead);
+    if (config->ccount &&
+        pcscReaderSetup(handle, config->ctrls, config->ccount))
+      fprintf(stderr, " -- Warning: reader=%s control profile partially "
+                      "applied (%s)\n",
+              pcscReaderName(handle), pcscErrorMsg(handle));
+    daemon.readers[daemon.rcount].handle = handle;
+    fprintf(stderr, " -- daemon: reader[%d]=%s\n", daemon.rcount,
+            readerList[idx]);
+    daemon.rcount++;
+  }
+  if (!daemon.rcount) {
+    fprintf(stderr, " -- daemon: no reader matching=%s\n", config->reader);
+    goto OnErrorExit;
+  }
+  for (int idx = 0; idx < daemon.rcount; idx++) {
+    daemon.readers[idx].tid =
+        pcscMonitorReader(daemon.readers[idx].handle, dmnMonitorCB, &daemon);
+  }
+
+  signal(SIGINT, dmnSigCB);
+  signal(SIGTERM, dmnSigCB);
+  fprintf(stderr, " -- daemon: listening on %s (ctrl-C to quit)\n",
+          opts->path);
+  dmnLoop(&daemon);
+
+  fprintf(stderr, "\n ** daemon: stopped batches=%ld requests=%ld\n",
+          daemon.batches, daemon.requests);
+  for (int idx = 0; idx < DMN_CLIENT_MAX; idx++) {
+    if (daemon.clients[idx])
+      dmnClientClose(&daemon, idx);
+  }
+  for (int idx = 0; idx < daemon.rcount; idx++) {
+    pcscHandleT *handle = daemon.readers[idx].handle;
+    if (daemon.readers[idx].tid)
+      pcscMonitorWait(handle, PCSC_MONITOR_CANCEL, daemon.readers[idx].tid);
+    if (opts->stats) {
+      clientPrintStats(handle);
+      dmnPrintSched(handle);
+    }
+    pcscDisconnect(handle);
+  }
+  pcscDisconnect(list);
+  close(daemon.listenFd);
+  unlink(opts->path);
+  return 0;
+
+OnErrorExit:
+  for (int idx = 0; idx < daemon.rcount; idx++)
+    pcscDisconnect(daemon.readers[idx].handle);
+  if (list)
+    pcscDisconnect(list);
+  if (daemon.listenFd >= 0) {
+    close(daemon.listenFd);
+    unlink(opts->path);
+  }
+  return -1;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2015-2022 IoT.bzh Company
+ * Author: Fulup Ar Foll <fulup@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "pcsc-config.h"
+
+// wire protocol, host byte order (unix socket only). A message holds a batch
+// of items, every request item gets one result item within a single reply
+// message, in request order.
+#define DMN_MSG_MAX 65536   // max message size, header included
+#define DMN_READER_ANY 0xFF // first reader holding a card
+
+typedef enum {
+  DMN_OP_GROUP = 1,     // payload: int32 group, result: dmnEntryT per command
+  DMN_OP_CMD,           // payload: command uid, result: command data
+  DMN_OP_UUID,          // result: u64 card uuid
+  DMN_OP_SUBSCRIBE,     // card events are pushed as DMN_OP_EVENT items
+  DMN_OP_SCHED,         // result: pcscSchedStatsT of reader scheduler
+  DMN_OP_EVENT = 0x40,  // payload: u32 reader state, u64 card uuid
+  DMN_OP_RESULT = 0x80, // or'ed with request op, payload: int32 status + data
+} dmnOpE;
+
+typedef struct {
+  u_int32_t len;      // bytes following message header
+  u_int16_t count;    // items within message
+  u_int8_t prio;      // pcscPrioE scheduler class of card requests
+  u_int8_t flags;     // reserved
+  u_int32_t deadline; // per request budget in ms, queue + execution (0=none)
+} dmnMsgT;
+
+typedef struct {
+  u_int8_t op;     // dmnOpE
+  u_int8_t reader; // reader index (daemon startup order) or DMN_READER_ANY
+  u_int16_t len;   // payload bytes following item header
+  u_int32_t id;    // request id, copied into result/event
+} dmnItemT;
+
+// group result: one entry per executed command followed by dlen data bytes
+typedef struct {
+  int16_t status; // 0 ok, -1 command failed
+  u_int16_t dlen;
+} dmnEntryT;
+
+typedef struct {
+  const char *path; // unix socket path
+  const char *group; // group allowed to connect (NULL: daemon user only)
+  int verbose;
+  int stats; // print per reader transmit statistics at exit
+} daemonOptsT;
+
+int daemonRun(pcscConfigT *config, const daemonOptsT *opts);
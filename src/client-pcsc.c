@@ -17,6 +17,9 @@
 
 #define _GNU_SOURCE
 
+#include "client-daemon.h"
+#include "client-pcsc.h"
+#include "client-provision.h"
 #include "pcsc-config.h"
 #include "pcsc-glue.h"
 
@@ -29,11 +32,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
-#include <linux/usbdevice_fs.h>
 
 
 #include <pcsclite.h>
@@ -49,6 +53,21 @@ static struct option options[] = {
     {"list", optional_argument, 0, 'l'},
     {"help", optional_argument, 0, 'h'},
     {"reset", optional_argument, 0, 'r'},
+    {"bench", optional_argument, 0, 'b'},
+    {"provision", required_argument, 0, 'p'},
+    {"journal", required_argument, 0, 'j'},
+    {"watchdog-test", required_argument, 0, 'w'},
+    {"stats", no_argument, 0, 's'},
+    {"trace", required_argument, 0, 't'},
+    {"decode-trace", required_argument, 0, 'd'},
+    {"record", required_argument, 0, 'R'},
+    {"replay", required_argument, 0, 'P'},
+    {"fast", no_argument, 0, 'F'},
+    {"daemon", required_argument, 0, 'D'},
+    {"daemon-group", required_argument, 0, 'G'},
+    {"dump", required_argument, 0, 'm'},
+    {"restore", required_argument, 0, 'M'},
+    {"selftest", no_argument, 0, 'S'},
     {0, 0, 0, 0} // trailer
 };
 
@@ -60,30 +79,45 @@ typedef struct {
   int forced;
   int async;
   int list;
+  int bench;
+  const char *records;
+  const char *journal;
+  int wdgTest; // simulated reader failure recovered at given watchdog step
+  int stats;
+  const char *trace; // binary trace file, saved on error and at exit
+  const char *record; // pcsc-lite session recorded to file
+  const char *replay; // session replayed instead of reader
+  int fast;           // replay without recorded delays
+  const char *daemon; // unix socket served in daemon mode
+  const char *daemonGroup; // group allowed on daemon socket
+  const char *dump;    // card image written to file (per card with --async)
+  const char *restore; // card image written back to card
+  const pcscKeyT *ring; // dump/restore sector keys
   pcscConfigT *config;
 } pcscParamsT;
 
-void usb_reset(char *usbdev) {
-  int fd;
-  int rc;
-
-  fd = open(usbdev, O_WRONLY);
-  if (fd < 0) {
-    perror("Error opening output file");
-    goto OnErrorExit;
-  }
+// AN10922 AES-128 diversification test vector: uid 04782E21801D80, AID 3042F5
+// and system identifier 4E585020416275. Input 01|uid|AID|sysid maps onto
+// 01|uid|sector|sysid with AID first byte as sector.
+static int clientSelfTest(void) {
+  u_int8_t master[] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+                       0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+  u_int8_t sysid[] = {0x42, 0xF5, 0x4E, 0x58, 0x50, 0x20, 0x41, 0x62, 0x75};
+  const u_int8_t uid[] = {0x04, 0x78, 0x2E, 0x21, 0x80, 0x1D, 0x80};
+  const u_int8_t expected[] = {0xA8, 0xDD, 0x63, 0xA3, 0xB8, 0x9D, 0x54, 0xB3,
+                               0x7C, 0xA8, 0x02, 0x47, 0x3F, 0xDA, 0x91, 0x75};
+  pcscKeyT key = {.uid = "an10922", .master = master, .sysid = sysid,
+                  .slen = sizeof(sysid)};
+  u_int8_t kval[sizeof(expected)];
+  int err;
 
-  printf("USB-Reset start device %s\n", usbdev);
-  rc = ioctl(fd, USBDEVFS_RESET, 0);
-  if (rc < 0) {
-    perror("Fail to Reset");
-    goto OnErrorExit;
+  err = pcscKeyDiversify(&key, uid, sizeof(uid), 0x30, kval, sizeof(kval));
+  if (err || memcmp(kval, expected, sizeof(expected))) {
+    fprintf(stderr, " -- selftest: AN10922 AES-128 diversification [fail]\n");
+    return -1;
   }
-  printf("USB-Reset done dev:%s\n", usbdev);
-  return;
-
-OnErrorExit:
-    exit (1);
+  fprintf(stderr, " -- selftest: AN10922 AES-128 diversification [ok]\n");
+  return 0;
 }
 
 pcscParamsT *parseArgs(int argc, char *argv[]) {
@@ -132,11 +166,82 @@ pcscParamsT *parseArgs(int argc, char *argv[]) {
         params->async = atoi(optarg);
       break;
 
+    case 'b':
+      params->bench++;
+      if (optarg)
+        params->bench = atoi(optarg);
+      break;
+
+    case 'p':
+      params->records = optarg;
+      break;
+
+    case 'j':
+      params->journal = optarg;
+      break;
+
     case 'r':
-      if (!optarg) goto OnErrorExit;
-      usb_reset(optarg);
+      if (!optarg)
+        goto OnErrorExit;
+      printf("USB-Reset start device %s\n", optarg);
+      if (pcscUsbReset(optarg))
+        exit(1);
+      printf("USB-Reset done dev:%s\n", optarg);
+      exit(0);
+
+    case 's':
+      params->stats = 1;
+      break;
+
+    case 't':
+      params->trace = optarg;
+      break;
+
+    case 'R':
+      params->record = optarg;
+      break;
+
+    case 'P':
+      params->replay = optarg;
+      break;
+
+    case 'F':
+      params->fast = 1;
+      break;
+
+    case 'D':
+      params->daemon = optarg;
+      break;
+
+    case 'G':
+      params->daemonGroup = optarg;
+      break;
+
+    case 'm':
+      params->dump = optarg;
+      break;
+
+    case 'M':
+      params->restore = optarg;
+      break;
+
+    case 'd':
+      // offline decoder, no reader needed
+      if (pcscTraceDecode(optarg, stdout) < 0)
+        exit(1);
       exit(0);
 
+    case 'S':
+      // offline checks, no reader needed
+      exit(clientSelfTest() ? 1 : 0);
+
+    case 'w':
+      params->wdgTest = atoi(optarg);
+      if (params->wdgTest < PCSC_WDG_RECONNECT ||
+          params->wdgTest > PCSC_WDG_USBRESET)
+        goto OnErrorExit;
+      break;
+
     case 'h':
     default:
       goto OnErrorExit;
@@ -145,38 +250,122 @@ pcscParamsT *parseArgs(int argc, char *argv[]) {
 
   if (!params->cnfpath && !params->list)
     goto OnErrorExit;
+  if (params->dump && params->restore)
+    goto OnErrorExit;
 
   return params;
 
 OnErrorExit:
   fprintf(stderr, "usage: pcsc-client --config=/xxx/my-config.json [--async] "
                   "[--group=-+0-9] [--verbose] [--force] [--list] "
-                  "[--reset=/dev/bus/usb/bus-xxx/dev-xxx]\n");
+                  "[--reset=/dev/bus/usb/bus-xxx/dev-xxx] [--bench=loops] "
+                  "[--provision=records.csv|jsonl [--journal=out.jsonl]] "
+                  "[--watchdog-test=1-3] [--stats] [--trace=file.trc] "
+                  "[--decode-trace=file.trc] [--record=file.ses] "
+                  "[--replay=file.ses [--fast]] "
+                  "[--daemon=/path/socket [--daemon-group=name]] "
+                  "[--dump=file.dmp|--restore=file.dmp] [--selftest]\n");
   exit(0);
 }
 
+// per action transmit statistics, latency percentiles are histogram bucket
+// upper bounds
+void clientPrintStats(pcscHandleT *handle) {
+  pcscStatsT stats;
+
+  pcscGetStats(handle, &stats);
+  fprintf(stderr,
+          " -- stats: reader=%s\n"
+          "    %-8s %8s %6s %9s %9s %8s %8s %8s %8s %8s\n",
+          pcscReaderName(handle), "action", "count", "errors", "bytes-out",
+          "bytes-in", "avg(us)", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+  for (int idx = 0; idx < PCSC_STAT_COUNT; idx++) {
+    const pcscActionStatsT *action = &stats.actions[idx];
+    if (!action->count)
+      continue;
+    fprintf(stderr, "    %-8s %8ld %6ld %9ld %9ld %8ld %8ld %8ld %8ld %8ld\n",
+            pcscStatLabel(idx), action->count, action->errors,
+            action->bytesOut, action->bytesIn,
+            action->usecTotal / action->count,
+            pcscStatsPercentile(action, 50), pcscStatsPercentile(action, 90),
+            pcscStatsPercentile(action, 99), action->usecMax);
+  }
+
+  pcscMonitorStatsT monitor;
+  pcscMonitorStats(handle, &monitor);
+  if (monitor.events)
+    fprintf(stderr,
+            "    monitor: events=%ld coalesced=%ld delivered=%ld "
+            "suppressed=%ld\n",
+            monitor.events, monitor.coalesced, monitor.delivered,
+            monitor.suppressed);
+
+  pcscReadAheadStatsT ahead;
+  pcscReadAheadStats(handle, &ahead);
+  if (ahead.queued || ahead.hits)
+    fprintf(stderr,
+            "    readahead: prefetched=%ld apdus=%ld hits=%ld misses=%ld "
+            "hit-rate=%.0f%% wasted=%ld\n",
+            ahead.prefetched, ahead.apdus, ahead.hits, ahead.misses,
+            ahead.hits + ahead.misses
+                ? 100.0 * ahead.hits / (ahead.hits + ahead.misses)
+                : 0.0,
+            ahead.wasted);
+
+  pcscStoreStatsT store;
+  pcscStoreStats(handle, &store);
+  if (store.loads || store.writes)
+    fprintf(stderr,
+            "    store: loads=%ld reads=%ld hits=%ld writes=%ld "
+            "unchanged=%ld\n",
+            store.loads, store.reads, store.hits, store.writes,
+            store.unchanged);
+}
+
+// stop session record/replay, replay reports skipped records
+static void clientSessionClose(pcscParamsT *params) {
+  ulong records;
+  long diverged;
+
+  if (!params || (!params->record && !params->replay))
+    return;
+  diverged = pcscSessionClose(&records);
+  fprintf(stderr, " -- session: %s records=%ld diverged=%ld\n",
+          params->record ? "recorded" : "replayed", records, diverged);
+}
+
 // execute commands from requested group
 static int execGroupCmd(pcscHandleT *handle, pcscParamsT *params) {
   pcscConfigT *config = params->config;
   int jump = 0;
   int err;
 
+  // group deadline covers every command, expiry aborts the group
+  if (config->deadline)
+    pcscSetDeadline(handle, PCSC_DEADLINE_GROUP, (ulong)config->deadline);
+
   // loop on defined commands
   for (int idx = 0; config->cmds[idx].uid; idx++) {
     const pcscCmdT *cmd = &config->cmds[idx];
 
     if (params->group <= cmd->group * -1 || params->group == cmd->group) {
       jump = 1;
-      if (cmd->action == PCSC_ACTION_READ) {
+      if (cmd->action != PCSC_ACTION_WRITE && cmd->dlen) {
         u_int8_t data[cmd->dlen];
         err = pcscExecOneCmd(handle, cmd, data);
+        if (!err && params->verbose && cmd->action == PCSC_ACTION_STORE &&
+            cmd->sop == PCSC_STORE_GET)
+          fprintf(stderr, " -- store: field=%s value=%s\n", cmd->field, data);
       } else {
         err = pcscExecOneCmd(handle, cmd, NULL);
       }
       if (err) {
-        fprintf(stderr, " -- Fail Executing command uid=%s error=%s\n",
-                cmd->uid, pcscErrorMsg(handle));
-        if (!params->forced)
+        fprintf(stderr, " -- Fail Executing command uid=%s class=%s error=%s\n",
+                cmd->uid, pcscErrorClassLabel(pcscErrorClass(handle)),
+                pcscErrorMsg(handle));
+        // --force does not help once card left the field or group aborted
+        if (!params->forced || pcscErrorClass(handle) == PCSC_ERR_CARD_GONE ||
+            pcscErrorClass(handle) == PCSC_ERR_ABORTED)
           goto OnErrorExit;
       }
     } else {
@@ -189,11 +378,163 @@ static int execGroupCmd(pcscHandleT *handle, pcscParamsT *params) {
       }
     }
   }
+  pcscSetDeadline(handle, PCSC_DEADLINE_GROUP, 0);
   fprintf(stderr, "\n ** OK: Cmds/group=%d [done]\n", params->group);
+  if (pcscBitrate(handle))
+    fprintf(stderr, " -- bitrate=%dkbit/s\n", pcscBitrate(handle));
+  pcscAuthStatsT auth;
+  pcscAuthStats(handle, &auth);
+  if (auth.saved || auth.failures)
+    fprintf(stderr, " -- auth: attempts=%ld failures=%ld saved=%ld\n",
+            auth.attempts, auth.failures, auth.saved);
+  pcscRetryStatsT retry;
+  pcscRetryStats(handle, &retry);
+  if (retry.retries)
+    fprintf(stderr,
+            " -- retry: retries=%ld recovered=%ld reauths=%ld exhausted=%ld\n",
+            retry.retries, retry.recovered, retry.reauths, retry.exhausted);
+  if (params->stats)
+    clientPrintStats(handle);
+  if (params->verbose)
+    pcscTracePrint(handle, stdout);
   if (params->async)
     fprintf(stderr, " ?? Insert new scard/token ??\n");
   return 0;
 
+OnErrorExit:
+  pcscSetDeadline(handle, PCSC_DEADLINE_GROUP, 0);
+  return -1;
+}
+
+// dump/restore key ring: config Mifare keys in config order, then transport key
+static const pcscKeyT *clientDumpRing(pcscConfigT *config) {
+  static u_int8_t transport[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+  const pcscKeyT *keys[PCSC_KEY_RING_MAX];
+  int count = 0;
+
+  for (int idx = 0; config->keys && config->keys[idx].uid &&
+                    count < PCSC_KEY_RING_MAX - 1;
+       idx++) {
+    if (config->keys[idx].klen == PCSC_MIFARE_KEY_LEN)
+      keys[count++] = &config->keys[idx];
+  }
+  keys[count++] = pcscNewKey("transport", transport, sizeof(transport));
+  return pcscNewKeyRing("dump", keys, count);
+}
+
+// dump card image to file or restore it, dump time is reported per card
+static int clientDumpCard(pcscHandleT *handle, pcscParamsT *params) {
+  const char *path = params->dump ? params->dump : params->restore;
+  char *cardPath = NULL;
+  pcscDumpStatsT stats;
+  int count;
+
+  // monitor mode dumps one file per card
+  if (params->dump && params->async) {
+    if (asprintf(&cardPath, "%s.%016lx", path, pcscGetCardUuid(handle)) < 0)
+      return -1;
+    path = cardPath;
+  }
+  if (!params->ring)
+    params->ring = clientDumpRing(params->config);
+
+  if (params->dump)
+    count = pcscDumpCard(handle, "dump", params->ring, path, &stats);
+  else
+    count = pcscRestoreCard(handle, "restore", params->ring, path, &stats);
+  if (count < 0) {
+    fprintf(stderr, " -- Fail %s file=%s error=%s\n",
+            params->dump ? "dump" : "restore", path, pcscErrorMsg(handle));
+  } else if (params->dump) {
+    fprintf(stderr,
+            " -- dump: file=%s sectors=%ld readable=%ld refused=%ld "
+            "failed=%ld bytes=%ld auths=%ld apdus=%ld time=%.1fms\n",
+            path, stats.sectors, stats.readable, stats.refused, stats.failed,
+            stats.bytes, stats.auths, stats.apdus, stats.usec / 1000.0);
+  } else {
+    fprintf(stderr,
+            " -- restore: file=%s sectors=%ld restored=%ld refused=%ld "
+            "failed=%ld writes=%ld unchanged=%ld auths=%ld apdus=%ld "
+            "time=%.1fms\n",
+            path, stats.sectors, stats.readable, stats.refused, stats.failed,
+            stats.writes, stats.unchanged, stats.auths, stats.apdus,
+            stats.usec / 1000.0);
+  }
+  if (params->stats)
+    clientPrintStats(handle);
+  free(cardPath);
+  return count < 0 ? -1 : 0;
+}
+
+// load config with requested parser and return command count
+static long benchLoadConfig(const char *cnfpath, int streaming) {
+  pcscConfigT *config;
+  long count = 0;
+
+  if (streaming) {
+    config = pcscParseConfigFile(cnfpath, 0);
+  } else {
+    json_object *configJ = json_object_from_file(cnfpath);
+    if (!configJ)
+      return -1;
+    config = pcscParseConfig(configJ, 0);
+    json_object_put(configJ); // config keeps its own reference
+  }
+  if (!config)
+    return -1;
+
+  for (int idx = 0; config->cmds && config->cmds[idx].uid; idx++)
+    count++;
+
+  // release every loop, peak-rss should reflect one config only
+  pcscFreeConfig(config);
+  return count;
+}
+
+// compare dom and streaming config loaders, each one run within a private
+// process to get a meaningful peak RSS
+static int benchConfigLoader(pcscParamsT *params) {
+  static const char *loaders[] = {"dom", "stream"};
+
+  for (int streaming = 0; streaming < 2; streaming++) {
+    pid_t pid = fork();
+    if (pid < 0)
+      goto OnErrorExit;
+
+    if (pid == 0) {
+      struct timespec start, stop;
+      struct rusage usage;
+      long count = 0;
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (int loop = 0; loop < params->bench; loop++) {
+        count = benchLoadConfig(params->cnfpath, streaming);
+        if (count < 0)
+          exit(1);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &stop);
+      getrusage(RUSAGE_SELF, &usage);
+
+      double elapsed = (double)(stop.tv_sec - start.tv_sec) +
+                       (double)(stop.tv_nsec - start.tv_nsec) / 1e9;
+      fprintf(stderr,
+              " -- bench: loader=%-6s cmds=%ld loops=%d time=%.3fs "
+              "rate=%.0f cmds/s peak-rss=%ldKB\n",
+              loaders[streaming], count, params->bench, elapsed,
+              (double)count * params->bench / elapsed, usage.ru_maxrss);
+      exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, " -- bench: loader=%s fail to parse %s\n",
+              loaders[streaming], params->cnfpath);
+      goto OnErrorExit;
+    }
+  }
+  return 0;
+
 OnErrorExit:
   return -1;
 }
@@ -206,6 +547,10 @@ static int readerMonitorCB(pcscHandleT *handle, ulong state, void *ctx) {
   if (state & SCARD_STATE_PRESENT) {
     fprintf(stderr, " -- event: reader=%s card=0x%lx inserted\n",
             pcscReaderName(handle), pcscGetCardUuid(handle));
+    if (params->dump || params->restore) {
+      clientDumpCard(handle, params);
+      return 0;
+    }
     err = execGroupCmd(handle, params);
     if (!params->verbose)
       fprintf(stderr, " -- exec : 'group=%d' done (--verbose for detail)\n",
@@ -242,7 +587,6 @@ static void sigHandlerCB(int sig) {
 
 int main(int argc, char *argv[]) {
   int err;
-  json_object *configJ = NULL;
   pcscHandleT *handle;
   pcscParamsT *params = parseArgs(argc, argv);
   if (!params)
@@ -254,17 +598,22 @@ int main(int argc, char *argv[]) {
   if (setjmp(JumpBuffer) != 0)
     goto OnSignalExit;
 
-  if (params->cnfpath) {
-    // err= json_locator_from_file (&configJ, params->cnfpath);
-    configJ = json_object_from_file(params->cnfpath);
-    // json_object *configJ= json_tokener_parse(buffer);
-    if (!configJ) {
-      fprintf(stderr, "Fail to parse params.json (try jq < %s\n",
-              params->cnfpath);
+  // compare config loaders and exit
+  if (params->bench) {
+    if (!params->cnfpath)
       goto OnErrorExit;
-    }
+    err = benchConfigLoader(params);
+    if (err)
+      goto OnErrorExit;
+    exit(0);
   }
 
+  // record or replay pcsc-lite exchanges, backend is switched before any handle
+  if (params->record && pcscSessionRecord(params->record))
+    goto OnErrorExit;
+  if (params->replay && pcscSessionReplay(params->replay, params->fast))
+    goto OnErrorExit;
+
   // list connected readers to pcscd
   if (params->list) {
     ulong readerCount = 16;
@@ -281,13 +630,54 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  if (configJ) {
-    // parse json config and store with params for asynchronous callback
-    pcscConfigT *config = pcscParseConfig(configJ, params->verbose);
-    if (!config)
+  if (params->cnfpath) {
+    // stream json config and store with params for asynchronous callback
+    pcscConfigT *config = pcscParseConfigFile(params->cnfpath, params->verbose);
+    if (!config) {
+      fprintf(stderr, "Fail to parse params.json (try jq < %s\n",
+              params->cnfpath);
       goto OnErrorExit;
+    }
     params->config = config;
 
+    // stream per card records on every matching reader
+    if (params->records) {
+      provisionOptsT opts = {
+          .records = params->records,
+          .journal = params->journal,
+          .group = params->group,
+          .verbose = params->verbose,
+          .stats = params->stats,
+      };
+      char *journal = NULL;
+      if (!opts.journal) {
+        if (asprintf(&journal, "%s.journal", params->records) < 0)
+          goto OnErrorExit;
+        opts.journal = journal;
+      }
+      err = provisionRun(config, &opts);
+      free(journal);
+      if (err)
+        goto OnErrorExit;
+      clientSessionClose(params);
+      exit(0);
+    }
+
+    // own readers and serve socket clients until SIGINT/SIGTERM
+    if (params->daemon) {
+      daemonOptsT opts = {
+          .path = params->daemon,
+          .group = params->daemonGroup,
+          .verbose = params->verbose,
+          .stats = params->stats,
+      };
+      err = daemonRun(config, &opts);
+      if (err)
+        goto OnErrorExit;
+      clientSessionClose(params);
+      exit(0);
+    }
+
     // create pcsc handle and set options
     handle = pcscConnect(config->uid, config->reader);
     if (!handle) {
@@ -298,6 +688,34 @@ int main(int argc, char *argv[]) {
     // set options
     pcscSetOpt(handle, PCSC_OPT_VERBOSE, config->verbose);
     pcscSetOpt(handle, PCSC_OPT_TIMEOUT, config->timeout);
+    pcscSetOpt(handle, PCSC_OPT_BITRATE, (ulong)config->bitrate);
+    if (config->retry >= 0)
+      pcscSetOpt(handle, PCSC_OPT_RETRY, (ulong)config->retry);
+    pcscSetOpt(handle, PCSC_OPT_DEBOUNCE, (ulong)config->debounce);
+    pcscSetOpt(handle, PCSC_OPT_DUPTAP, (ulong)config->duptap);
+    pcscSetOpt(handle, PCSC_OPT_READAHEAD, (ulong)config->readahead);
+    if (params->trace)
+      pcscTraceFile(handle, params->trace);
+    if (config->ccount &&
+        pcscReaderSetup(handle, config->ctrls, config->ccount))
+      fprintf(stderr,
+              " -- Warning: reader=%s control profile partially applied (%s)\n",
+              pcscReaderName(handle), pcscErrorMsg(handle));
+
+    // simulated reader failure: every watchdog step below requested one fails
+    if (params->wdgTest) {
+      if (pcscSetOpt(handle, PCSC_OPT_WATCHDOG_SIM, (ulong)params->wdgTest)) {
+        fprintf(stderr, " -- watchdog-test: requires a pcscd-glue built with "
+                        "-DPCSC_WATCHDOG_SIM=ON\n");
+        exit(1);
+      }
+      err = pcscWatchdogRecover(handle);
+      fprintf(stderr, " -- watchdog-test: reader=%s recovered at step=%d %s\n",
+              pcscReaderName(handle), err,
+              err == params->wdgTest ? "[ok]" : "[unexpected]");
+      pcscDisconnect(handle);
+      exit(err == params->wdgTest ? 0 : 1);
+    }
 
     // check async handling
     if (params->async) {
@@ -337,7 +755,12 @@ int main(int argc, char *argv[]) {
         goto OnErrorExit;
       }
       fprintf(stderr, " -- Reader=%s smart uuid=%ld\n", config->reader, uuid);
-      err = execGroupCmd(handle, params); // synchronous command exec
+      if (params->dump || params->restore)
+        err = clientDumpCard(handle, params);
+      else
+        err = execGroupCmd(handle, params); // synchronous command exec
+      if (params->trace)
+        pcscTraceSave(handle, params->trace);
       if (err)
         goto OnErrorExit;
     }
@@ -346,12 +769,14 @@ int main(int argc, char *argv[]) {
   err = pcscDisconnect(handle);
   if (err)
     goto OnErrorExit;
+  clientSessionClose(params);
 
   if (params->verbose)
     fprintf(stderr, "OK: Success Exit\n\n");
   exit(0);
 
 OnErrorExit:
+  clientSessionClose(params);
   fprintf(stderr, "FX: Error Exit\n\n");
   exit(1);
 
@@ -0,0 +1,591 @@
+/*
+ * Copyright (C) 2015-2022 IoT.bzh Company
+ * Author: Fulup Ar Foll <fulup@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Bulk provisioning: stream per card records (csv or jsonl) through config
+ * write templates. Each record is assigned to next card presented on any
+ * reader, written, verified and logged into a jsonl journal. Journal is
+ * fsync per card and reloaded at startup to resume an interrupted job.
+ */
+
+#define _GNU_SOURCE
+
+#include "client-pcsc.h"
+#include "client-provision.h"
+#include "pcsc-glue.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pcsclite.h>
+
+#include <rp-utils/rp-jsonc.h>
+
+typedef struct {
+  u_int64_t uuid;
+  UT_hash_handle hh;
+} provDoneT;
+
+typedef struct provRecordS {
+  ulong index;       // record index within input file (header excluded)
+  char *line;        // csv line, fields point inside
+  json_object *recJ; // jsonl record, fields point inside
+  pcscFieldT *fields;
+  struct provRecordS *next;
+} provRecordT;
+
+typedef struct {
+  const provisionOptsT *opts;
+  pcscConfigT *config;
+  pthread_mutex_t lock;
+  FILE *input;
+  FILE *journal;
+  int jsonl;
+  char **labels; // csv header
+  int lcount;
+  ulong nextIndex;
+  u_int8_t *done; // record already provisioned (index)
+  ulong dmax;
+  provDoneT *uuids;    // cards already provisioned
+  provRecordT *ahead;  // next fresh record (NULL when input is exhausted)
+  provRecordT *retry;  // records to re-assign after a failed card
+  int inflight;
+  int stopped;
+  ulong okCount;
+  ulong failCount;
+  ulong skipCount;
+  double start;
+  pcscHandleT *list; // pcscd context and reader names, kept until exit
+  pcscHandleT *handles[PCSC_MAX_DEV];
+  int hcount;
+} provJobT;
+
+static double provNowMs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec * 1e3 + (double)now.tv_nsec / 1e6;
+}
+
+static int provIsDone(provJobT *job, ulong index) {
+  return index < job->dmax && job->done[index];
+}
+
+static void provSetDone(provJobT *job, ulong index, u_int64_t uuid) {
+  provDoneT *item;
+
+  if (index >= job->dmax) {
+    ulong dmax = job->dmax ? job->dmax : 1024;
+    while (index >= dmax)
+      dmax *= 2;
+    job->done = realloc(job->done, dmax);
+    memset(&job->done[job->dmax], 0, dmax - job->dmax);
+    job->dmax = dmax;
+  }
+  job->done[index] = 1;
+
+  HASH_FIND(hh, job->uuids, &uuid, sizeof(uuid), item);
+  if (!item) {
+    item = calloc(1, sizeof(provDoneT));
+    item->uuid = uuid;
+    HASH_ADD(hh, job->uuids, uuid, sizeof(item->uuid), item);
+  }
+}
+
+// split a csv line in place, quoted values support "" escape
+static int provCsvSplit(char *line, char **values, int vmax) {
+  char *ptr = line;
+  int count = 0;
+
+  while (count < vmax) {
+    char *start, *out, sep;
+
+    if (*ptr == '"') {
+      start = out = ++ptr;
+      while (*ptr) {
+        if (ptr[0] == '"' && ptr[1] == '"') {
+          *out++ = '"';
+          ptr += 2;
+        } else if (ptr[0] == '"') {
+          ptr++;
+          break;
+        } else {
+          *out++ = *ptr++;
+        }
+      }
+      while (*ptr && *ptr != ',')
+        ptr++;
+    } else {
+      start = ptr;
+      while (*ptr && *ptr != ',')
+        ptr++;
+      out = ptr;
+    }
+    sep = *ptr;
+    *out = '\0';
+    values[count++] = start;
+    if (sep != ',')
+      break;
+    ptr++;
+  }
+  return count;
+}
+
+static void provFreeRecord(provRecordT *rec) {
+  if (rec->recJ)
+    json_object_put(rec->recJ);
+  free(rec->line);
+  free(rec->fields);
+  free(rec);
+}
+
+// read next record not yet provisioned from input file
+static provRecordT *provReadRecord(provJobT *job) {
+  char *line = NULL;
+  size_t lsize = 0;
+  ssize_t len;
+
+  while ((len = getline(&line, &lsize, job->input)) >= 0) {
+    while (len > 0 && isspace(line[len - 1]))
+      line[--len] = '\0';
+    if (!len)
+      continue;
+
+    ulong index = job->nextIndex++;
+    if (provIsDone(job, index))
+      continue;
+
+    provRecordT *rec = calloc(1, sizeof(provRecordT));
+    rec->index = index;
+
+    if (job->jsonl) {
+      rec->recJ = json_tokener_parse(line);
+      if (!rec->recJ || !json_object_is_type(rec->recJ, json_type_object)) {
+        fprintf(stderr, " -- provision: record=%ld invalid json (ignored)\n",
+                index);
+        provFreeRecord(rec);
+        continue;
+      }
+      int idx = 0;
+      rec->fields = calloc(json_object_object_length(rec->recJ) + 1,
+                           sizeof(pcscFieldT));
+      json_object_object_foreach(rec->recJ, label, valueJ) {
+        rec->fields[idx].label = label;
+        rec->fields[idx].value = json_object_get_string(valueJ);
+        idx++;
+      }
+    } else {
+      char *values[job->lcount];
+      rec->line = line;
+      line = NULL;
+      lsize = 0;
+      int count = provCsvSplit(rec->line, values, job->lcount);
+      rec->fields = calloc(count + 1, sizeof(pcscFieldT));
+      for (int idx = 0; idx < count; idx++) {
+        rec->fields[idx].label = job->labels[idx];
+        rec->fields[idx].value = values[idx];
+      }
+    }
+    free(line);
+    return rec;
+  }
+
+  free(line);
+  return NULL;
+}
+
+// failed records are re-assigned before fresh ones
+static provRecordT *provNextRecord(provJobT *job) {
+  provRecordT *rec = job->retry;
+
+  if (rec) {
+    job->retry = rec->next;
+    rec->next = NULL;
+  } else {
+    rec = job->ahead;
+    if (rec)
+      job->ahead = provReadRecord(job);
+  }
+  return rec;
+}
+
+// reload previous journal, every 'ok' record/card is skipped on resume
+static int provLoadJournal(provJobT *job) {
+  FILE *file = fopen(job->opts->journal, "r");
+  char *line = NULL;
+  size_t lsize = 0;
+  ulong count = 0;
+
+  if (!file)
+    return 0;
+
+  while (getline(&line, &lsize, file) >= 0) {
+    json_object *entryJ = json_tokener_parse(line);
+    json_object *statusJ, *recordJ, *uuidJ;
+    if (!entryJ)
+      continue; // last line may be truncated by a crash
+
+    if (json_object_object_get_ex(entryJ, "status", &statusJ) &&
+        json_object_object_get_ex(entryJ, "record", &recordJ) &&
+        json_object_object_get_ex(entryJ, "uuid", &uuidJ) &&
+        !strcmp(json_object_get_string(statusJ), "ok")) {
+      u_int64_t uuid = strtoull(json_object_get_string(uuidJ), NULL, 16);
+      provSetDone(job, (ulong)json_object_get_int64(recordJ), uuid);
+      count++;
+    }
+    json_object_put(entryJ);
+  }
+  free(line);
+  fclose(file);
+
+  if (count)
+    fprintf(stderr, " -- provision: resume journal=%s done=%ld record(s)\n",
+            job->opts->journal, count);
+  return 0;
+}
+
+static void provJournal(provJobT *job, pcscHandleT *handle, ulong index,
+                        u_int64_t uuid, const char *status, double execMs,
+                        double verifyMs) {
+  fprintf(job->journal,
+          "{\"record\":%ld,\"uuid\":\"%lX\",\"reader\":\"%s\","
+          "\"status\":\"%s\",\"exec-ms\":%.1f,\"verify-ms\":%.1f,"
+          "\"time\":%ld}\n",
+          index, (ulong)uuid, pcscReaderName(handle), status, execMs, verifyMs,
+          (long)time(NULL));
+  fflush(job->journal);
+  fdatasync(fileno(job->journal));
+}
+
+// execute group commands for one record, written data is read back
+static int provExecRecord(provJobT *job, pcscHandleT *handle,
+                          provRecordT *rec, double *execMs, double *verifyMs) {
+  pcscConfigT *config = job->config;
+  pcscRecordT record = {.fields = rec->fields, .counter = rec->index + 1};
+  int group = job->opts->group;
+  double tick;
+  int err;
+
+  for (int idx = 0; config->cmds[idx].uid; idx++) {
+    const pcscCmdT *cmd = &config->cmds[idx];
+
+    if (!(group <= cmd->group * -1 || group == cmd->group))
+      continue;
+
+    if (cmd->action != PCSC_ACTION_WRITE) {
+      // trailer commands have no data
+      u_int8_t data[cmd->dlen ? cmd->dlen : 1];
+      tick = provNowMs();
+      err = pcscExecRecordCmd(handle, cmd, &record, cmd->dlen ? data : NULL);
+      *execMs += provNowMs() - tick;
+      if (err)
+        goto OnErrorExit;
+      continue;
+    }
+
+    if ((!cmd->tpl && !cmd->data) || !cmd->dlen) {
+      fprintf(stderr,
+              " -- provision: cmd=%s action=write data:mandatory "
+              "(data or template)\n",
+              cmd->uid);
+      return -2;
+    }
+
+    // render once, write then read back to verify
+    u_int8_t data[cmd->dlen];
+    if (cmd->tpl) {
+      if (pcscTplRender(handle, cmd, &record, data, cmd->dlen) < 0)
+        goto OnRecordExit;
+    } else {
+      memcpy(data, cmd->data, cmd->dlen);
+    }
+
+    tick = provNowMs();
+    err = pcscExecRecordCmd(handle, cmd, &record, data);
+    *execMs += provNowMs() - tick;
+    if (err)
+      goto OnErrorExit;
+
+    u_int8_t check[cmd->dlen + PCSC_MIFARE_STATUS_LEN];
+    tick = provNowMs();
+    err = pcscReadBackCmd(handle, cmd, check);
+    *verifyMs += provNowMs() - tick;
+    if (err)
+      goto OnErrorExit;
+    if (memcmp(check, data, cmd->dlen)) {
+      fprintf(stderr, " -- provision: record=%ld cmd=%s verify mismatch\n",
+              rec->index, cmd->uid);
+      goto OnErrorExit;
+    }
+  }
+  return 0;
+
+OnErrorExit:
+  fprintf(stderr, " -- provision: record=%ld fail error=%s\n", rec->index,
+          pcscErrorMsg(handle));
+  return -1;
+
+OnRecordExit:
+  // record cannot render (missing field, too long), no need to retry it
+  fprintf(stderr, " -- provision: record=%ld invalid (check template fields)\n",
+          rec->index);
+  return -2;
+}
+
+// cancel every other reader monitor, caller thread exits from callback
+static void provStop(provJobT *job, pcscHandleT *self) {
+  job->stopped = 1;
+  for (int idx = 0; idx < job->hcount; idx++) {
+    if (job->handles[idx] != self)
+      pcscMonitorWait(job->handles[idx], PCSC_MONITOR_CANCEL, 0);
+  }
+}
+
+static int provMonitorCB(pcscHandleT *handle, ulong state, void *ctx) {
+  provJobT *job = (provJobT *)ctx;
+  double execMs = 0, verifyMs = 0;
+  provRecordT *rec;
+  provDoneT *item;
+  int err, finished;
+
+  if (job->stopped)
+    return 1;
+
+  if (!(state & SCARD_STATE_PRESENT)) {
+    if (job->opts->verbose)
+      fprintf(stderr, " -- provision: reader=%s card removed\n",
+              pcscReaderName(handle));
+    return 0;
+  }
+
+  u_int64_t uuid = pcscGetCardUuid(handle);
+  if (!uuid) {
+    fprintf(stderr, " -- provision: reader=%s fail reading uuid error=%s\n",
+            pcscReaderName(handle), pcscErrorMsg(handle));
+    return 0;
+  }
+
+  pthread_mutex_lock(&job->lock);
+  HASH_FIND(hh, job->uuids, &uuid, sizeof(uuid), item);
+  if (item) {
+    job->skipCount++;
+    pthread_mutex_unlock(&job->lock);
+    fprintf(stderr, " -- provision: reader=%s card=%lX already provisioned\n",
+            pcscReaderName(handle), (ulong)uuid);
+    return 0;
+  }
+  rec = provNextRecord(job);
+  if (rec)
+    job->inflight++;
+  pthread_mutex_unlock(&job->lock);
+  if (!rec)
+    return 0;
+
+  err = provExecRecord(job, handle, rec, &execMs, &verifyMs);
+
+  pthread_mutex_lock(&job->lock);
+  job->inflight--;
+  provJournal(job, handle, rec->index, uuid,
+              err == -2 ? "invalid" : err ? "fail" : "ok", execMs, verifyMs);
+  if (err == -2) {
+    job->failCount++;
+  } else if (err) {
+    job->failCount++;
+    rec->next = job->retry;
+    job->retry = rec;
+  } else {
+    job->okCount++;
+    provSetDone(job, rec->index, uuid);
+  }
+  double minutes = (provNowMs() - job->start) / 60000.0;
+  fprintf(stderr,
+          " -- provision: reader=%s card=%lX record=%ld %s exec=%.0fms "
+          "verify=%.0fms [ok=%ld fail=%ld rate=%.1f cards/min]\n",
+          pcscReaderName(handle), (ulong)uuid, rec->index,
+          err ? "FAIL" : "OK", execMs, verifyMs, job->okCount, job->failCount,
+          job->okCount / minutes);
+  if (err != -1)
+    provFreeRecord(rec);
+  finished = !job->ahead && !job->retry && !job->inflight;
+  if (finished)
+    provStop(job, handle);
+  pthread_mutex_unlock(&job->lock);
+
+  if (finished)
+    return 1;
+  if (err != -1)
+    fprintf(stderr, " ?? Insert next scard/token ??\n");
+  return 0;
+}
+
+int provisionRun(pcscConfigT *config, const provisionOptsT *opts) {
+  provJobT job = {.opts = opts, .config = config};
+  ulong tids[PCSC_MAX_DEV];
+  int err;
+
+  pthread_mutex_init(&job.lock, NULL);
+
+  job.input = fopen(opts->records, "r");
+  if (!job.input) {
+    fprintf(stderr, " -- provision: fail to open records=%s error=%s\n",
+            opts->records, strerror(errno));
+    goto OnErrorExit;
+  }
+
+  // jsonl records start with '{' otherwise csv with a header line
+  int first = fgetc(job.input);
+  while (first != EOF && isspace(first))
+    first = fgetc(job.input);
+  ungetc(first, job.input);
+  job.jsonl = (first == '{');
+
+  if (!job.jsonl) {
+    char *header = NULL;
+    size_t hsize = 0;
+    ssize_t len = getline(&header, &hsize, job.input);
+    if (len <= 0) {
+      fprintf(stderr, " -- provision: records=%s missing csv header\n",
+              opts->records);
+      goto OnErrorExit;
+    }
+    while (len > 0 && isspace(header[len - 1]))
+      header[--len] = '\0';
+    job.lcount = 1;
+    for (char *ptr = header; *ptr; ptr++)
+      if (*ptr == ',')
+        job.lcount++;
+    job.labels = calloc(job.lcount, sizeof(char *));
+    job.lcount = provCsvSplit(header, job.labels, job.lcount);
+  }
+
+  err = provLoadJournal(&job);
+  if (err)
+    goto OnErrorExit;
+
+  job.journal = fopen(opts->journal, "a");
+  if (!job.journal) {
+    fprintf(stderr, " -- provision: fail to open journal=%s error=%s\n",
+            opts->journal, strerror(errno));
+    goto OnErrorExit;
+  }
+
+  job.ahead = provReadRecord(&job);
+  if (!job.ahead) {
+    fprintf(stderr, " -- provision: nothing to do records=%s journal=%s\n",
+            opts->records, opts->journal);
+    goto OnDoneExit;
+  }
+
+  // monitor every reader matching config
+  const char *readerList[PCSC_MAX_DEV];
+  ulong readerCount = PCSC_MAX_DEV;
+  job.list = pcscList(readerList, &readerCount);
+  if (!job.list) {
+    fprintf(stderr, " -- provision: fail to connect to pcscd\n");
+    goto OnErrorExit;
+  }
+
+  job.start = provNowMs();
+  for (ulong idx = 0; idx < readerCount && job.hcount < config->maxdev;
+       idx++) {
+    if (config->reader && !strcasestr(readerList[idx], config->reader))
+      continue;
+
+    pcscHandleT *handle = pcscConnect(config->uid, readerList[idx]);
+    if (!handle)
+      continue;
+    pcscSetOpt(handle, PCSC_OPT_VERBOSE, config->verbose);
+    pcscSetOpt(handle, PCSC_OPT_TIMEOUT, config->timeout);
+    pcscSetOpt(handle, PCSC_OPT_BITRATE, (ulong)config->bitrate);
+    if (config->retry >= 0)
+      pcscSetOpt(handle, PCSC_OPT_RETRY, (ulong)config->retry);
+    pcscSetOpt(handle, PCSC_OPT_DEBOUNCE, (ulong)config->debounce);
+    pcscSetOpt(handle, PCSC_OPT_DUPTAP, (ulong)config->duptap);
+    pcscSetOpt(handle, PCSC_OPT_READAHEAD, (ulong)config->readahead);
+    if (config->ccount &&
+        pcscReaderSetup(handle, config->ctrls, config->ccount))
+      fprintf(stderr, " -- Warning: reader=%s control profile partially "
+                      "applied (%s)\n",
+              pcscReaderName(handle), pcscErrorMsg(handle));
+
+    // register handle before monitor thread may stop the job
+    pthread_mutex_lock(&job.lock);
+    job.handles[job.hcount] = handle;
+    tids[job.hcount] = pcscMonitorReader(handle, provMonitorCB, &job);
+    if (tids[job.hcount])
+      job.hcount++;
+    pthread_mutex_unlock(&job.lock);
+    fprintf(stderr, " -- provision: waiting cards on reader=%s\n",
+            readerList[idx]);
+  }
+
+  if (!job.hcount) {
+    fprintf(stderr, " -- provision: no reader matching=%s\n", config->reader);
+    goto OnErrorExit;
+  }
+  fprintf(stderr, " ?? Insert scard/token on any reader (ctrl-C to quit) ??\n");
+
+  for (int idx = 0; idx < job.hcount; idx++)
+    pcscMonitorWait(job.handles[idx], PCSC_MONITOR_WAIT, tids[idx]);
+
+  double minutes = (provNowMs() - job.start) / 60000.0;
+  fprintf(stderr,
+          "\n ** provision: done ok=%ld fail=%ld skip=%ld time=%.1fmin "
+          "rate=%.1f cards/min\n",
+          job.okCount, job.failCount, job.skipCount, minutes,
+          job.okCount / minutes);
+
+  for (int idx = 0; idx < job.hcount; idx++) {
+    pcscAuthStatsT auth;
+    pcscAuthStats(job.handles[idx], &auth);
+    if (auth.attempts)
+      fprintf(stderr,
+              " -- provision: reader=%s auth attempts=%ld failures=%ld "
+              "saved=%ld learned=%ld\n",
+              pcscReaderName(job.handles[idx]), auth.attempts, auth.failures,
+              auth.saved, auth.learned);
+    pcscRetryStatsT retry;
+    pcscRetryStats(job.handles[idx], &retry);
+    if (retry.retries)
+      fprintf(stderr,
+              " -- provision: reader=%s retries=%ld recovered=%ld "
+              "reauths=%ld exhausted=%ld\n",
+              pcscReaderName(job.handles[idx]), retry.retries,
+              retry.recovered, retry.reauths, retry.exhausted);
+    if (opts->stats)
+      clientPrintStats(job.handles[idx]);
+    pcscDisconnect(job.handles[idx]);
+  }
+  pcscDisconnect(job.list);
+
+OnDoneExit:
+  fclose(job.journal);
+  fclose(job.input);
+  return 0;
+
+OnErrorExit:
+  if (job.list)
+    pcscDisconnect(job.list);
+  if (job.journal)
+    fclose(job.journal);
+  if (job.input)
+    fclose(job.input);
+  return -1;
+}
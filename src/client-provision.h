@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2015-2022 IoT.bzh Company
+ * Author: Fulup Ar Foll <fulup@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "pcsc-config.h"
+
+typedef struct {
+  const char *records; // csv or jsonl per card records
+  const char *journal; // jsonl result log, used to resume job
+  int group;           // command group executed for each card
+  int verbose;
+  int stats; // print per reader transmit statistics at job end
+} provisionOptsT;
+
+int provisionRun(pcscConfigT *config, const provisionOptsT *opts);
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2015-2022 IoT.bzh Company
+ * Author: Fulup Ar Foll <fulup@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * private: pcsc-lite entry points used by pcsc-glue. Default backend calls pcscd,
+ * session backends record or replay exchanges (check pcsc-session.c)
+ */
+#pragma once
+
+#include <winscard.h>
+
+typedef struct {
+    const char *label;
+    LONG (*establishContext) (DWORD scope, LPCVOID reserved1, LPCVOID reserved2, SCARDCONTEXT *context);
+    LONG (*releaseContext) (SCARDCONTEXT context);
+    LONG (*listReaders) (SCARDCONTEXT context, LPCSTR groups, LPSTR readers, DWORD *readersLen);
+    LONG (*freeMemory) (SCARDCONTEXT context, LPCVOID memory);
+    LONG (*getStatusChange) (SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count);
+    LONG (*cancel) (SCARDCONTEXT context);
+    LONG (*connect) (SCARDCONTEXT context, LPCSTR reader, DWORD share, DWORD protocols, SCARDHANDLE *card, DWORD *active);
+    LONG (*reconnect) (SCARDHANDLE card, DWORD share, DWORD protocols, DWORD init, DWORD *active);
+    LONG (*disconnect) (SCARDHANDLE card, DWORD disposition);
+    LONG (*status) (SCARDHANDLE card, LPSTR names, DWORD *namesLen, DWORD *state, DWORD *protocol, BYTE *atr, DWORD *atrLen);
+    LONG (*transmit) (SCARDHANDLE card, const SCARD_IO_REQUEST *sendPci, const BYTE *send, DWORD sendLen, SCARD_IO_REQUEST *recvPci, BYTE *recv, DWORD *recvLen);
+    LONG (*control) (SCARDHANDLE card, DWORD code, LPCVOID send, DWORD sendLen, LPVOID recv, DWORD recvLen, DWORD *returned);
+} pcscBackendT;
+
+extern const pcscBackendT pcscHwBackend;  // pcscd
+extern const pcscBackendT *pcscBackend;   // active backend, switched before any handle is created
@@ -19,11 +19,14 @@
 #include "pcsc-config.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <rp-utils/rp-jsonc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 typedef struct {
@@ -36,6 +39,27 @@ static const pcscKeyEnumT pcscActionsE[] = {
     {"write", PCSC_ACTION_WRITE},
     {"trailer", PCSC_ACTION_TRAILER},
     {"uuid", PCSC_ACTION_UUID},
+    {"value", PCSC_ACTION_VALUE},
+    {"apdu", PCSC_ACTION_APDU},
+    {"store", PCSC_ACTION_STORE},
+    {NULL} // terminator
+};
+
+static const pcscKeyEnumT pcscStoreOpsE[] = {
+    {"unknown", PCSC_STORE_UNKNOWN},
+    {"get", PCSC_STORE_GET},
+    {"set", PCSC_STORE_SET},
+    {"format", PCSC_STORE_FORMAT},
+    {NULL} // terminator
+};
+
+static const pcscKeyEnumT pcscValueOpsE[] = {
+    {"unknown", PCSC_VALUE_UNKNOWN},
+    {"format", PCSC_VALUE_FORMAT},
+    {"increment", PCSC_VALUE_INCREMENT},
+    {"decrement", PCSC_VALUE_DECREMENT},
+    {"restore", PCSC_VALUE_RESTORE},
+    {"read", PCSC_VALUE_READ},
     {NULL} // terminator
 };
 
@@ -72,6 +96,71 @@ static pcscKeyT *pcscKeyByUid(pcscConfigT *config, const char *keyUid) {
   return key;
 }
 
+// parse FeliCa service code(s) as one value or an array, "0x000B" or 11
+static int pcscParseOneSvc(json_object *svcJ, u_int16_t **svcs, int *nsvc) {
+  int count = json_object_is_type(svcJ, json_type_array)
+                  ? (int)json_object_array_length(svcJ)
+                  : 1;
+
+  if (count < 1 || count > 16)
+    goto OnErrorExit;
+  *svcs = calloc(count, sizeof(u_int16_t));
+  for (int idx = 0; idx < count; idx++) {
+    json_object *valJ = json_object_is_type(svcJ, json_type_array)
+                            ? json_object_array_get_idx(svcJ, idx)
+                            : svcJ;
+    int64_t svc;
+    if (json_object_is_type(valJ, json_type_string)) {
+      char *endS;
+      svc = strtol(json_object_get_string(valJ), &endS, 0);
+      if (*endS)
+        goto OnErrorExit;
+    } else if (json_object_is_type(valJ, json_type_int)) {
+      svc = json_object_get_int64(valJ);
+    } else {
+      goto OnErrorExit;
+    }
+    if (svc < 0 || svc > 0xFFFF)
+      goto OnErrorExit;
+    (*svcs)[idx] = (u_int16_t)svc;
+  }
+  *nsvc = count;
+  return 0;
+
+OnErrorExit:
+  EXT_CRITICAL("[pcsc-onesvc-fail] svc should be one or an array[1-16] of "
+               "FeliCa service code (pcscParseOneSvc)");
+  return -1;
+}
+
+// read-ahead sectors declared after a read command
+static int pcscParseOnePrefetch(json_object *prefetchJ, u_int8_t **sectors,
+                                int *count) {
+  int array = json_object_is_type(prefetchJ, json_type_array);
+  int len = array ? (int)json_object_array_length(prefetchJ) : 1;
+
+  if (len < 1 || len > 8)
+    goto OnErrorExit;
+  *sectors = calloc(len, sizeof(u_int8_t));
+  for (int idx = 0; idx < len; idx++) {
+    json_object *valJ =
+        array ? json_object_array_get_idx(prefetchJ, idx) : prefetchJ;
+    if (!json_object_is_type(valJ, json_type_int))
+      goto OnErrorExit;
+    int64_t sector = json_object_get_int64(valJ);
+    if (sector < 0 || sector > 31)
+      goto OnErrorExit;
+    (*sectors)[idx] = (u_int8_t)sector;
+  }
+  *count = len;
+  return 0;
+
+OnErrorExit:
+  EXT_CRITICAL("[pcsc-oneprefetch-fail] prefetch should be one or an "
+               "array[1-8] of sector index 0-31 (pcscParseOnePrefetch)");
+  return -1;
+}
+
 // parse keys or command data as asci string or hexa array
 static int pcscParseOneData(json_object *dataJ, u_int8_t **data, ulong *dlen) {
   switch (json_object_get_type(dataJ)) {
@@ -124,24 +213,48 @@ OnErrorExit:
 static int pcscParseOneKey(pcscConfigT *config, json_object *keyJ,
                            pcscKeyT *key) {
   int err;
-  json_object *valueJ = NULL;
+  json_object *valueJ = NULL, *masterJ = NULL, *sysidJ = NULL;
 
   // {"uid":"abc, "idx": 0, "value":"asci value" }
-  err = rp_jsonc_unpack(keyJ, "{ss,s?i,so !}", "uid", &key->uid, "idx",
-                        &key->kidx, "value", &valueJ);
-  if (err) {
-    EXT_CRITICAL("[pcsc-onekey-fail] json supported keys:[uid,idx,value] "
-                 "(pcscParseOneKey)");
+  // {"uid":"abc, "idx": 0, "master":[16 x "0x.."], "sysid":"asci value" }
+  err = rp_jsonc_unpack(keyJ, "{ss,s?i,s?o,s?o,s?o !}", "uid", &key->uid,
+                        "idx", &key->kidx, "value", &valueJ, "master",
+                        &masterJ, "sysid", &sysidJ);
+  if (err || !valueJ == !masterJ) {
+    EXT_CRITICAL("[pcsc-onekey-fail] json supported keys:[uid,idx,value|"
+                 "master,sysid] (pcscParseOneKey)");
     goto OnErrorExit;
   }
 
   // value should be an asci string or an array of hexa valueB
-  ulong klen;
-  err = pcscParseOneData(valueJ, &key->kval, &klen);
-  if (err)
-    goto OnErrorExit;
-  key->klen = (uint8_t)klen;
+  ulong klen = 0;
+  if (valueJ) {
+    err = pcscParseOneData(valueJ, &key->kval, &klen);
+    if (err)
+      goto OnErrorExit;
+    key->klen = (uint8_t)klen;
+    return 0;
+  }
 
+  // diversified key: AES-128 master, value is computed per card/sector
+  err = pcscParseOneData(masterJ, &key->master, &klen);
+  if (err || klen != PCSC_DIVERSIFY_MASTER_LEN) {
+    EXT_CRITICAL("[pcsc-onekey-fail] key=%s master should be %d bytes",
+                 key->uid, PCSC_DIVERSIFY_MASTER_LEN);
+    goto OnErrorExit;
+  }
+  key->klen = PCSC_MIFARE_KEY_LEN;
+
+  if (sysidJ) {
+    klen = 0;
+    err = pcscParseOneData(sysidJ, &key->sysid, &klen);
+    if (err || klen > PCSC_DIVERSIFY_SYSID_MAX) {
+      EXT_CRITICAL("[pcsc-onekey-fail] key=%s sysid should be max %d bytes",
+                   key->uid, PCSC_DIVERSIFY_SYSID_MAX);
+      goto OnErrorExit;
+    }
+    key->slen = (uint8_t)klen;
+  }
   return 0;
 
 OnErrorExit:
@@ -173,7 +286,7 @@ static int pcscParseOneTrailer(pcscConfigT *config, json_object *trailerJ,
   }
 
   // value should be an asci string or an array of hexa valueB
-  ulong alen;
+  ulong alen = 0;
   err = pcscParseOneData(valueJ, &response->acls, &alen);
   if (err || alen != 4)
     goto OnErrorExit;
@@ -187,28 +300,186 @@ OnErrorExit:
   return -1;
 }
 
+// compile "text ${uuid} ${counter:6} ${time} ${field}" into segments once
+static int pcscParseOneTemplate(const char *tplS, pcscTemplateT **tpl) {
+  pcscTemplateT *response = calloc(1, sizeof(pcscTemplateT));
+  const char *ptr = tplS;
+  int smax = 0;
+
+  while (*ptr) {
+    pcscTplSegT seg = {.kind = PCSC_TPL_LITERAL};
+    const char *start = ptr;
+
+    if (ptr[0] == '$' && ptr[1] == '$') {
+      // '$$' escape a single '$'
+      seg.text = strndup(ptr, 1);
+      seg.len = 1;
+      ptr += 2;
+    } else if (ptr[0] == '$' && ptr[1] == '{') {
+      const char *end = strchr(ptr, '}');
+      if (!end)
+        goto OnErrorExit;
+      size_t llen = (size_t)(end - ptr - 2);
+      const char *colon = memchr(ptr + 2, ':', llen);
+      if (colon) {
+        seg.width = atoi(colon + 1);
+        llen = (size_t)(colon - ptr - 2);
+        if (seg.width < 0 || seg.width > PCSC_TPL_WIDTH_MAX)
+          goto OnErrorExit;
+      }
+      if (!llen)
+        goto OnErrorExit;
+      seg.text = strndup(ptr + 2, llen);
+
+      if (!strcasecmp(seg.text, "uuid"))
+        seg.kind = PCSC_TPL_UUID;
+      else if (!strcasecmp(seg.text, "counter"))
+        seg.kind = PCSC_TPL_COUNTER;
+      else if (!strcasecmp(seg.text, "time"))
+        seg.kind = PCSC_TPL_TIME;
+      else
+        seg.kind = PCSC_TPL_FIELD;
+      ptr = end + 1;
+    } else {
+      while (*ptr && ptr[0] != '$')
+        ptr++;
+      if (ptr == start)
+        ptr++; // lonely '$'
+      seg.len = (size_t)(ptr - start);
+      seg.text = strndup(start, seg.len);
+    }
+
+    if (response->count == smax) {
+      smax = smax ? smax * 2 : 4;
+      response->segs = realloc(response->segs, smax * sizeof(pcscTplSegT));
+    }
+    response->segs[response->count++] = seg;
+  }
+
+  *tpl = response;
+  return 0;
+
+OnErrorExit:
+  EXT_CRITICAL("[pcsc-template-fail] invalid placeholder template='%s' "
+               "(width max=%d) (pcscParseOneTemplate)",
+               tplS, PCSC_TPL_WIDTH_MAX);
+  for (int idx = 0; idx < response->count; idx++)
+    free((char *)response->segs[idx].text);
+  free(response->segs);
+  free(response);
+  return -1;
+}
+
+// "key":"key-a" or "key":["dfltA","key-a","key-b"] (tried in order)
+static int pcscParseCmdKey(pcscConfigT *config, pcscCmdT *cmd,
+                           json_object *keyJ) {
+  const pcscKeyT *keys[PCSC_KEY_RING_MAX];
+  char *ringUid = NULL;
+  const char *keyUid;
+  size_t count;
+
+  if (json_object_is_type(keyJ, json_type_string)) {
+    keyUid = json_object_get_string(keyJ);
+    cmd->key = pcscKeyByUid(config, keyUid);
+    if (!cmd->key)
+      goto OnKeyMissing;
+    return 0;
+  }
+
+  count = json_object_is_type(keyJ, json_type_array)
+              ? json_object_array_length(keyJ)
+              : 0;
+  if (!count || count > PCSC_KEY_RING_MAX) {
+    EXT_CRITICAL("[pcsc-onecmd-fail] cmd=%s key should be a key uid or an "
+                 "array of 1-%d key uids (pcscParseCmdKey)",
+                 cmd->uid, PCSC_KEY_RING_MAX);
+    goto OnErrorExit;
+  }
+
+  // ring uid is built from key uids, it remains valid once cmd json is freed
+  for (int idx = 0; idx < count; idx++) {
+    char *previous = ringUid;
+    keyUid = json_object_get_string(json_object_array_get_idx(keyJ, idx));
+    keys[idx] = pcscKeyByUid(config, keyUid);
+    if (!keys[idx])
+      goto OnKeyMissing;
+    if (asprintf(&ringUid, "%s%s%s", previous ? previous : "",
+                 previous ? "|" : "", keys[idx]->uid) < 0)
+      goto OnErrorExit;
+    free(previous);
+  }
+
+  cmd->key = pcscNewKeyRing(ringUid, keys, (int)count);
+  if (!cmd->key)
+    goto OnErrorExit;
+  return 0;
+
+OnKeyMissing:
+  EXT_CRITICAL("[pcsc-onecmd-fail] cmd=%s keys=%s non found within defined "
+               "keys] (pcscParseOneCmd)",
+               cmd->uid, keyUid);
+OnErrorExit:
+  free(ringUid);
+  return -1;
+}
+
 static int pcscParseOneCmd(pcscConfigT *config, json_object *cmdJ,
                            pcscCmdT *cmd) {
   int err;
-  json_object *dataJ = NULL, *trailerJ = NULL;
-  const char *keyUid = NULL, *cmdAction;
+  json_object *dataJ = NULL, *trailerJ = NULL, *svcJ = NULL, *keyJ = NULL;
+  json_object *prefetchJ = NULL;
+  const char *cmdAction, *tplS = NULL, *opS = NULL;
+  int amount = 0, dst = -1;
   cmd->info = "";
 
   // {"uid":"zzz", "action":"write", "blk": xx, "key":"kuid","data": ["0xab",
   // "0x01", ....]},
-  err = rp_jsonc_unpack(cmdJ, "{ss,s?s,ss,s?i,s?i,s?i,s?s,s?o,s?o,s?i !}",
-                        "uid", &cmd->uid, "info", &cmd->info, "action",
-                        &cmdAction, "sec", &cmd->sec, "blk", &cmd->blk, "len",
-                        &cmd->dlen, "key", &keyUid, "data", &dataJ, "trailer",
-                        &trailerJ, "group", &cmd->group);
+  err = rp_jsonc_unpack(
+      cmdJ,
+      "{ss,s?s,ss,s?i,s?i,s?i,s?o,s?o,s?o,s?i,s?s,s?s,s?i,s?i,s?o,s?i,s?o,s?s !}",
+      "uid", &cmd->uid, "info", &cmd->info, "action", &cmdAction, "sec",
+      &cmd->sec, "blk", &cmd->blk, "len", &cmd->dlen, "key", &keyJ, "data",
+      &dataJ, "trailer", &trailerJ, "group", &cmd->group, "template", &tplS,
+      "op", &opS, "amount", &amount, "dst", &dst, "svc", &svcJ, "timeout",
+      &cmd->timeout, "prefetch", &prefetchJ, "field", &cmd->field);
   if (err) {
     EXT_CRITICAL("[pcsc-onecmd-fail] json supported "
-                 "keys:[uid,info,action,blk,key,data,len] (pcscParseOneCmd)");
+                 "keys:[uid,info,action,blk,key,data,len,template,op,amount,"
+                 "dst,svc,timeout,prefetch,field] (pcscParseOneCmd)");
     goto OnErrorExit;
   }
 
   // check action
   cmd->action = pcscLabel2Value(pcscActionsE, cmdAction);
+  if (tplS && cmd->action != PCSC_ACTION_WRITE) {
+    EXT_CRITICAL("[pcsc-onecmd-fail] uid=%s template only valid with "
+                 "action=write (pcscParseOneCmd)",
+                 cmd->uid);
+    goto OnErrorExit;
+  }
+  if (svcJ) {
+    if (cmd->action != PCSC_ACTION_READ && cmd->action != PCSC_ACTION_WRITE) {
+      EXT_CRITICAL("[pcsc-onecmd-fail] uid=%s svc only valid with "
+                   "action=read|write (pcscParseOneCmd)",
+                   cmd->uid);
+      goto OnErrorExit;
+    }
+    err = pcscParseOneSvc(svcJ, &cmd->svcs, &cmd->nsvc);
+    if (err)
+      goto OnErrorExit;
+  }
+  if (prefetchJ) {
+    if (cmd->action != PCSC_ACTION_READ) {
+      EXT_CRITICAL("[pcsc-onecmd-fail] uid=%s prefetch only valid with "
+                   "action=read (pcscParseOneCmd)",
+                   cmd->uid);
+      goto OnErrorExit;
+    }
+    err = pcscParseOnePrefetch(prefetchJ, &cmd->prefetch, &cmd->nprefetch);
+    if (err)
+      goto OnErrorExit;
+  }
+
   switch (cmd->action) {
   case PCSC_ACTION_READ:
     if (!cmd->dlen || dataJ) {
@@ -229,6 +500,17 @@ static int pcscParseOneCmd(pcscConfigT *config, json_object *cmdJ,
     break;
 
   case PCSC_ACTION_WRITE:
+    if (tplS) {
+      if (dataJ || !cmd->dlen) {
+        EXT_CRITICAL("[pcsc-onecmd-fail] uid=%s action=%s template "
+                     "len:mandatory data:forbiden (pcscParseOneCmd)",
+                     cmd->uid, cmdAction);
+        goto OnErrorExit;
+      }
+      err = pcscParseOneTemplate(tplS, &cmd->tpl);
+      if (err)
+        goto OnErrorExit;
+    }
     if (dataJ) {
       err = pcscParseOneData(dataJ, &cmd->data, &cmd->dlen);
       if (err)
@@ -236,6 +518,71 @@ static int pcscParseOneCmd(pcscConfigT *config, json_object *cmdJ,
     }
     break;
 
+  case PCSC_ACTION_VALUE:
+    // {"uid":"debit", "action":"value", "op":"decrement", "sec":2, "blk":1,
+    // "amount":1, "key":"key-b"}
+    cmd->vop = pcscLabel2Value(pcscValueOpsE, opS);
+    if (dataJ || trailerJ || cmd->vop == PCSC_VALUE_UNKNOWN ||
+        (cmd->vop == PCSC_VALUE_RESTORE && dst < 0)) {
+      EXT_CRITICAL("[pcsc-onecmd-fail] uid=%s action=%s "
+                   "op:[format,increment,decrement,restore,read] "
+                   "dst:mandatory(restore) data:forbiden (pcscParseOneCmd)",
+                   cmd->uid, cmdAction);
+      goto OnErrorExit;
+    }
+    cmd->amount = (int32_t)amount;
+    cmd->dst = (u_int8_t)(dst < 0 ? 0 : dst);
+    cmd->dlen = sizeof(int32_t); // read value
+    break;
+
+  case PCSC_ACTION_APDU:
+    // {"uid":"select-ppse", "action":"apdu", "len":256, "data":["0x00","0xA4",...]}
+    if (!dataJ || json_object_get_type(dataJ) != json_type_array || trailerJ) {
+      EXT_CRITICAL("[pcsc-onecmd-fail] uid=%s action=%s data:mandatory(hexa "
+                   "array) (pcscParseOneCmd)",
+                   cmd->uid, cmdAction);
+      goto OnErrorExit;
+    }
+    err = pcscParseOneData(dataJ, &cmd->data, &cmd->alen);
+    if (err)
+      goto OnErrorExit;
+    if (!cmd->dlen)
+      cmd->dlen = 256;
+    cmd->dlen += PCSC_MIFARE_STATUS_LEN; // reserve 2 byte for status word
+    break;
+
+  case PCSC_ACTION_STORE:
+    // {"uid":"set-email", "action":"store", "op":"set", "field":"email",
+    // "data":"fulup@iot.bzh"}
+    cmd->sop = pcscLabel2Value(pcscStoreOpsE, opS);
+    if (!config->store || cmd->sop == PCSC_STORE_UNKNOWN || trailerJ ||
+        (cmd->sop != PCSC_STORE_FORMAT &&
+         (!cmd->field || pcscStoreField(config->store, cmd->field) < 0)) ||
+        (cmd->sop == PCSC_STORE_SET) != (dataJ != NULL)) {
+      EXT_CRITICAL("[pcsc-onecmd-fail] uid=%s action=%s config "
+                   "store:mandatory op:[get,set,format] field:mandatory "
+                   "data:mandatory(set) (pcscParseOneCmd)",
+                   cmd->uid, cmdAction);
+      goto OnErrorExit;
+    }
+    cmd->store = config->store;
+    if (dataJ) {
+      err = pcscParseOneData(dataJ, &cmd->data, &cmd->dlen);
+      if (err)
+        goto OnErrorExit;
+    } else if (cmd->sop == PCSC_STORE_GET) {
+      if (!cmd->dlen)
+        cmd->dlen = PCSC_STORE_RECORD_MAX;
+      cmd->dlen += 1; // zero terminated
+    }
+    if (cmd->sop == PCSC_STORE_SET && cmd->dlen > PCSC_STORE_RECORD_MAX) {
+      EXT_CRITICAL("[pcsc-onecmd-fail] uid=%s action=%s data too long "
+                   "(max=%d) (pcscParseOneCmd)",
+                   cmd->uid, cmdAction, PCSC_STORE_RECORD_MAX);
+      goto OnErrorExit;
+    }
+    break;
+
   case PCSC_ACTION_TRAILER:
     if (dataJ || cmd->dlen || !trailerJ) {
       EXT_CRITICAL("[pcsc-onecmd-fail] uid=%s action=%s trailer mandary "
@@ -256,57 +603,216 @@ static int pcscParseOneCmd(pcscConfigT *config, json_object *cmdJ,
     goto OnErrorExit;
   }
 
-  // if key is defined search for it
-  if (keyUid) {
-    cmd->key = pcscKeyByUid(config, keyUid);
-    if (!cmd->key) {
-      EXT_CRITICAL("[pcsc-onecmd-fail] cmd=%s keys=%s non found within defined "
-                   "keys] (pcscParseOneCmd)",
-                   cmd->uid, keyUid);
+  // if key is defined search for it, an array of keys defines a key ring
+  if (keyJ) {
+    err = pcscParseCmdKey(config, cmd, keyJ);
+    if (err)
+      goto OnErrorExit;
+  }
+
+  return 0;
+
+OnErrorExit:
+  return -1;
+}
+
+// add every parsed command to uid hash table
+static void pcscIndexCmds(pcscConfigT *config) {
+  if (!config->cmds)
+    return;
+
+  for (int idx = 0; config->cmds[idx].uid; idx++) {
+    pcscCmdT *cmd = &config->cmds[idx];
+    HASH_ADD_KEYPTR(hh, config->hTable, cmd->uid, strlen(cmd->uid), cmd);
+  }
+}
+
+// record store layout, fields order is directory order and should not change
+// once cards are formatted
+// {"sec":8, "count":6, "key":"key-a", "wkey":"key-b", "fields":["pseudo",...]}
+static int pcscParseOneStore(pcscConfigT *config, json_object *storeJ) {
+  json_object *fieldsJ = NULL;
+  const char *keyUid = NULL, *wkeyUid = NULL;
+  const pcscKeyT *key = NULL, *wkey = NULL;
+  const char **fields = NULL;
+  int sec = 0, count = 0, nfield, err;
+
+  err = rp_jsonc_unpack(storeJ, "{si,si,s?s,s?s,so !}", "sec", &sec, "count",
+                        &count, "key", &keyUid, "wkey", &wkeyUid, "fields",
+                        &fieldsJ);
+  if (err || !json_object_is_type(fieldsJ, json_type_array)) {
+    EXT_CRITICAL("[pcsc-store-fail] json supported "
+                 "keys:[sec,count,key,wkey,fields] (pcscParseOneStore)");
+    goto OnErrorExit;
+  }
+  if ((keyUid && !(key = pcscKeyByUid(config, keyUid))) ||
+      (wkeyUid && !(wkey = pcscKeyByUid(config, wkeyUid)))) {
+    EXT_CRITICAL("[pcsc-store-fail] key=%s wkey=%s non found within defined "
+                 "keys (pcscParseOneStore)",
+                 keyUid, wkeyUid);
+    goto OnErrorExit;
+  }
+
+  nfield = (int)json_object_array_length(fieldsJ);
+  fields = calloc(nfield + 1, sizeof(char *));
+  for (int idx = 0; idx < nfield; idx++) {
+    json_object *fieldJ = json_object_array_get_idx(fieldsJ, idx);
+    if (!json_object_is_type(fieldJ, json_type_string)) {
+      EXT_CRITICAL("[pcsc-store-fail] fields should be an array of names "
+                   "(pcscParseOneStore)");
       goto OnErrorExit;
     }
+    fields[idx] = json_object_get_string(fieldJ);
+    for (int prev = 0; prev < idx; prev++) {
+      if (!strcasecmp(fields[prev], fields[idx])) {
+        EXT_CRITICAL("[pcsc-store-fail] field=%s defined twice "
+                     "(pcscParseOneStore)",
+                     fields[idx]);
+        goto OnErrorExit;
+      }
+    }
   }
 
-  // add command to cmd hash table
-  HASH_ADD_KEYPTR(hh, config->hTable, cmd->uid, strlen(cmd->uid), cmd);
+  if (sec > 0 && sec < 32 && count > 0 && count < 32)
+    config->store = pcscNewStore("store", (u_int8_t)sec, (u_int8_t)count,
+                                 fields, nfield, key, wkey);
+  if (!config->store) {
+    EXT_CRITICAL("[pcsc-store-fail] sec=%d count=%d fields=%d invalid, "
+                 "sectors 1-31 (max %d), fields 1-%d (pcscParseOneStore)",
+                 sec, count, nfield, PCSC_STORE_SECTORS_MAX,
+                 PCSC_STORE_FIELDS_MAX);
+    goto OnErrorExit;
+  }
+  return 0;
 
+OnErrorExit:
+  // fields are owned by store only once it was created
+  free(fields);
+  return -1;
+}
+
+// reader control profile
+// {"reader":"ACR122", "buzzer":false, "polling":true, "interval":250,
+// "led":0, "timeout":0, "escape":[["0xFF","0x00","0x52","0x00","0x00"]]}
+static int pcscParseOneCtrl(json_object *ctrlJ, pcscCtrlProfileT *ctrl) {
+  json_object *escapesJ = NULL;
+  int err;
+
+  ctrl->buzzer = ctrl->polling = ctrl->interval = ctrl->led = ctrl->timeout =
+      -1;
+  err = rp_jsonc_unpack(ctrlJ, "{s?s,s?b,s?b,s?i,s?i,s?i,s?o !}", "reader",
+                        &ctrl->reader, "buzzer", &ctrl->buzzer, "polling",
+                        &ctrl->polling, "interval", &ctrl->interval, "led",
+                        &ctrl->led, "timeout", &ctrl->timeout, "escape",
+                        &escapesJ);
+  if (err) {
+    EXT_CRITICAL("[pcsc-control-fail] json supported "
+                 "keys:[reader,buzzer,polling,interval,led,timeout,escape] "
+                 "(pcscParseOneCtrl)");
+    goto OnErrorExit;
+  }
+  if (ctrl->reader)
+    ctrl->reader = strdup(ctrl->reader);
+
+  if (escapesJ) {
+    if (!json_object_is_type(escapesJ, json_type_array))
+      goto OnEscapeError;
+    ctrl->ecount = (int)json_object_array_length(escapesJ);
+    const u_int8_t **escapes = calloc(ctrl->ecount, sizeof(u_int8_t *));
+    ulong *elens = calloc(ctrl->ecount, sizeof(ulong));
+    for (int idx = 0; idx < ctrl->ecount; idx++) {
+      json_object *escapeJ = json_object_array_get_idx(escapesJ, idx);
+      if (!json_object_is_type(escapeJ, json_type_array))
+        goto OnEscapeError;
+      err = pcscParseOneData(escapeJ, (u_int8_t **)&escapes[idx], &elens[idx]);
+      if (err)
+        goto OnEscapeError;
+    }
+    ctrl->escapes = escapes;
+    ctrl->elens = elens;
+  }
   return 0;
 
+OnEscapeError:
+  EXT_CRITICAL("[pcsc-control-fail] escape should be an array of hexa arrays "
+               "(pcscParseOneCtrl)");
 OnErrorExit:
   return -1;
 }
 
-pcscConfigT *pcscParseConfig(json_object *configJ, const int verbosity) {
+// parse config header (everything except commands) and keys
+static pcscConfigT *pcscParseHeader(json_object *configJ, const int verbosity,
+                                    json_object **cmdsJ) {
   int err;
   pcscConfigT *config = calloc(1, sizeof(pcscConfigT));
-  json_object *cmdsJ = NULL, *keysJ = NULL;
+  json_object *keysJ = NULL, *ctrlsJ = NULL, *storeJ = NULL;
   config->verbose = 0;
   config->maxdev = PCSC_MAX_DEV;
-
-  err = rp_jsonc_unpack(configJ, "{s?s s?s ss s?i s?i s?i s?o s?o s?i !}",
-                        "uid", &config->uid, "info", &config->info, "reader",
-                        &config->reader, "maxdev", &config->maxdev, "debug",
-                        &config->verbose, "timeout", &config->timeout, "cmds",
-                        &cmdsJ, "keys", &keysJ, "verbose", &config->verbose);
+  config->retry = -1; // library default
+
+  err = rp_jsonc_unpack(
+      configJ,
+      "{s?s s?s ss s?i s?i s?i s?o s?o s?i s?o s?i s?i s?i s?i s?i s?i s?o !}",
+      "uid", &config->uid, "info", &config->info, "reader", &config->reader,
+      "maxdev", &config->maxdev, "debug", &config->verbose, "timeout",
+      &config->timeout, "cmds", cmdsJ, "keys", &keysJ, "verbose",
+      &config->verbose, "control", &ctrlsJ, "bitrate", &config->bitrate,
+      "retry", &config->retry, "debounce", &config->debounce, "duptap",
+      &config->duptap, "deadline", &config->deadline, "readahead",
+      &config->readahead, "store", &storeJ);
   if (err) {
     EXT_CRITICAL("[pcsc-config-fail] config json supported "
-                 "keys:[into,reader,cmds,keys] (pcscParseConfig)");
+                 "keys:[into,reader,cmds,keys,control,bitrate,retry,debounce,"
+                 "duptap,deadline,readahead,store] (pcscParseConfig)");
+    goto OnErrorExit;
+  }
+  if (config->retry < -1) {
+    EXT_CRITICAL("[pcsc-config-fail] retry=%d should be >= 0 "
+                 "(pcscParseConfig)",
+                 config->retry);
+    goto OnErrorExit;
+  }
+  if (config->debounce < 0 || config->duptap < 0) {
+    EXT_CRITICAL("[pcsc-config-fail] debounce=%d duptap=%d should be >= 0 "
+                 "(pcscParseConfig)",
+                 config->debounce, config->duptap);
     goto OnErrorExit;
   }
+  if (config->bitrate && config->bitrate != 106 && config->bitrate != 212 &&
+      config->bitrate != 424 && config->bitrate != 848) {
+    EXT_CRITICAL("[pcsc-config-fail] bitrate=%d should be 106|212|424|848 "
+                 "(pcscParseConfig)",
+                 config->bitrate);
+    goto OnErrorExit;
+  }
+
+  // reader control profiles, first matching reader name is applied
+  if (ctrlsJ) {
+    int array = json_object_is_type(ctrlsJ, json_type_array);
+    config->ccount = array ? (int)json_object_array_length(ctrlsJ) : 1;
+    config->ctrls = calloc(config->ccount, sizeof(pcscCtrlProfileT));
+    for (int idx = 0; idx < config->ccount; idx++) {
+      err = pcscParseOneCtrl(
+          array ? json_object_array_get_idx(ctrlsJ, idx) : ctrlsJ,
+          &config->ctrls[idx]);
+      if (err)
+        goto OnErrorExit;
+    }
+  }
 
   if (!config->verbose)
     config->verbose = verbosity;
   if (!config->uid)
     config->uid = config->reader;
 
-  if (keysJ && !cmdsJ) {
+  if (keysJ && !*cmdsJ) {
     EXT_CRITICAL("[pcsc-config-fail] key 'cmds' mandatory when 'keys' present "
                  "(pcscParseConfig)");
     goto OnErrorExit;
   }
 
   // make sure config wont be free
-  json_object_get(configJ);
+  config->configJ = json_object_get(configJ);
 
   // parse keys and create a hash table
   switch (json_object_get_type(keysJ)) {
@@ -339,6 +845,26 @@ pcscConfigT *pcscParseConfig(json_object *configJ, const int verbosity) {
     goto OnErrorExit;
   }
 
+  // store keys are config keys
+  if (storeJ) {
+    err = pcscParseOneStore(config, storeJ);
+    if (err)
+      goto OnErrorExit;
+  }
+  return config;
+
+OnErrorExit:
+  return NULL;
+}
+
+pcscConfigT *pcscParseConfig(json_object *configJ, const int verbosity) {
+  int err;
+  json_object *cmdsJ = NULL;
+
+  pcscConfigT *config = pcscParseHeader(configJ, verbosity, &cmdsJ);
+  if (!config)
+    goto OnErrorExit;
+
   // parse commands
   switch (json_object_get_type(cmdsJ)) {
     size_t ccount;
@@ -370,13 +896,407 @@ pcscConfigT *pcscParseConfig(json_object *configJ, const int verbosity) {
                  "object (pcscParseConfig)");
     goto OnErrorExit;
   }
+  pcscIndexCmds(config);
+  config->magic = PCSC_CONFIG_MAGIC;
+  return config;
+
+OnErrorExit:
+  return NULL;
+}
+
+// growable text buffer used by streaming parser
+typedef struct {
+  char *data;
+  size_t len;
+  size_t max;
+} pcscTextT;
+
+// streaming json reader, only one command is materialised at a time
+typedef struct {
+  FILE *file;
+  const char *path;
+  pcscTextT *text; // when set every consumed char is copied to text
+  int peek;        // next unconsumed char
+  ulong line;
+} pcscStreamT;
+
+static void pcscTextAdd(pcscTextT *text, const char *data, size_t len) {
+  if (text->len + len + 1 > text->max) {
+    while (text->len + len + 1 > text->max)
+      text->max = text->max ? text->max * 2 : 256;
+    text->data = realloc(text->data, text->max);
+  }
+  memcpy(&text->data[text->len], data, len);
+  text->len += len;
+  text->data[text->len] = '\0';
+}
+
+// consume current char and read next one
+static int pcscStreamNext(pcscStreamT *stream) {
+  int c = stream->peek;
+  if (c == EOF)
+    return c;
+
+  if (stream->text) {
+    char byte = (char)c;
+    pcscTextAdd(stream->text, &byte, 1);
+  }
+  if (c == '\n')
+    stream->line++;
+  stream->peek = getc_unlocked(stream->file);
+  return c;
+}
+
+// skip spaces and json-c tolerated comments
+static int pcscStreamBlank(pcscStreamT *stream) {
+  while (stream->peek != EOF) {
+    if (isspace(stream->peek)) {
+      pcscStreamNext(stream);
+      continue;
+    }
+    if (stream->peek != '/')
+      break;
+
+    pcscStreamNext(stream);
+    switch (stream->peek) {
+    case '/':
+      while (stream->peek != EOF && stream->peek != '\n')
+        pcscStreamNext(stream);
+      break;
+
+    case '*':
+      pcscStreamNext(stream);
+      for (int star = 0; stream->peek != EOF;) {
+        int c = pcscStreamNext(stream);
+        if (star && c == '/')
+          break;
+        star = (c == '*');
+      }
+      break;
+
+    default:
+      goto OnErrorExit;
+    }
+  }
+  return stream->peek;
+
+OnErrorExit:
+  return -1;
+}
+
+static int pcscStreamString(pcscStreamT *stream) {
+  pcscStreamNext(stream); // opening quote
+  while (stream->peek != EOF) {
+    int c = pcscStreamNext(stream);
+    if (c == '\\')
+      pcscStreamNext(stream);
+    else if (c == '"')
+      return 0;
+  }
+  return -1;
+}
+
+// scan one json value (string, literal, object or array)
+static int pcscStreamValue(pcscStreamT *stream) {
+  int depth = 0;
+
+  if (pcscStreamBlank(stream) < 0)
+    goto OnErrorExit;
+
+  while (1) {
+    switch (stream->peek) {
+    case EOF:
+      goto OnErrorExit;
+
+    case '"':
+      if (pcscStreamString(stream))
+        goto OnErrorExit;
+      if (!depth)
+        return 0;
+      break;
+
+    case '{':
+    case '[':
+      depth++;
+      pcscStreamNext(stream);
+      break;
+
+    case '}':
+    case ']':
+      if (!depth)
+        return 0; // literal closed by parent object/array
+      depth--;
+      pcscStreamNext(stream);
+      if (!depth)
+        return 0;
+      break;
+
+    case '/':
+      if (!depth)
+        return 0;
+      if (pcscStreamBlank(stream) < 0)
+        goto OnErrorExit;
+      break;
+
+    default:
+      // number/literal stop on first delimiter
+      if (!depth && (stream->peek == ',' || isspace(stream->peek)))
+        return 0;
+      pcscStreamNext(stream);
+    }
+  }
+
+OnErrorExit:
+  EXT_CRITICAL("[pcsc-stream-fail] path=%s line=%ld invalid json value "
+               "(pcscStreamValue)",
+               stream->path, stream->line);
+  return -1;
+}
+
+// parse every command from 'cmds' array without building the whole DOM
+static int pcscStreamCmds(pcscConfigT *config, pcscStreamT *stream) {
+  json_tokener *tokener = json_tokener_new();
+  pcscTextT text = {0};
+  size_t ccount = 0, cmax = 0;
+  int err, single;
+
+  if (pcscStreamBlank(stream) < 0)
+    goto OnErrorExit;
+
+  // cmds may be a single object or an array of objects
+  single = (stream->peek == '{');
+  if (!single) {
+    if (stream->peek != '[')
+      goto OnErrorExit;
+    pcscStreamNext(stream);
+  }
+
+  while (1) {
+    if (pcscStreamBlank(stream) < 0)
+      goto OnErrorExit;
+    if (!single && stream->peek == ']')
+      break;
+
+    text.len = 0;
+    stream->text = &text;
+    err = pcscStreamValue(stream);
+    stream->text = NULL;
+    if (err)
+      goto OnErrorExit;
+
+    if (ccount + 1 >= cmax) {
+      cmax = cmax ? cmax * 2 : 64;
+      config->cmds = realloc(config->cmds, cmax * sizeof(pcscCmdT));
+      memset(&config->cmds[ccount], 0, (cmax - ccount) * sizeof(pcscCmdT));
+    }
+
+    json_tokener_reset(tokener);
+    json_object *cmdJ = json_tokener_parse_ex(tokener, text.data, (int)text.len);
+    if (!cmdJ) {
+      EXT_CRITICAL("[pcsc-stream-fail] path=%s line=%ld error=%s "
+                   "(pcscStreamCmds)",
+                   stream->path, stream->line,
+                   json_tokener_error_desc(json_tokener_get_error(tokener)));
+      goto OnErrorExit;
+    }
+
+    pcscCmdT *cmd = &config->cmds[ccount];
+    err = pcscParseOneCmd(config, cmdJ, cmd);
+    if (!err) {
+      // command strings should survive json object release
+      cmd->uid = strdup(cmd->uid);
+      cmd->info = strdup(cmd->info);
+      if (cmd->field)
+        cmd->field = strdup(cmd->field);
+    }
+    json_object_put(cmdJ);
+    if (err)
+      goto OnErrorExit;
+    ccount++;
+
+    if (single)
+      break;
+    if (pcscStreamBlank(stream) < 0)
+      goto OnErrorExit;
+    if (stream->peek == ',')
+      pcscStreamNext(stream);
+    else if (stream->peek != ']')
+      goto OnErrorExit;
+  }
+
+  free(text.data);
+  json_tokener_free(tokener);
+  return 0;
+
+OnErrorExit:
+  EXT_CRITICAL("[pcsc-stream-fail] path=%s line=%ld invalid cmds array "
+               "(pcscStreamCmds)",
+               stream->path, stream->line);
+  free(text.data);
+  json_tokener_free(tokener);
+  return -1;
+}
+
+// parse config from file streaming 'cmds' to keep memory flat with huge
+// command sets. Header (keys, reader, ...) is small and parsed as a DOM.
+pcscConfigT *pcscParseConfigFile(const char *path, const int verbosity) {
+  pcscConfigT *config = NULL;
+  json_object *headJ = NULL, *cmdsJ = NULL;
+  pcscTextT head = {0}, key = {0};
+  pcscStreamT stream = {.path = path, .line = 1};
+  long cmdsAt = -1;
+  int err;
+
+  stream.file = fopen(path, "r");
+  if (!stream.file) {
+    EXT_CRITICAL("[pcsc-stream-fail] path=%s error=%s (pcscParseConfigFile)",
+                 path, strerror(errno));
+    goto OnErrorExit;
+  }
+  stream.peek = getc_unlocked(stream.file);
+
+  // 1st pass: copy top level members except 'cmds' whose offset is kept
+  if (pcscStreamBlank(&stream) != '{')
+    goto OnErrorExit;
+  pcscStreamNext(&stream);
+  pcscTextAdd(&head, "{", 1);
+
+  while (1) {
+    if (pcscStreamBlank(&stream) < 0)
+      goto OnErrorExit;
+    if (stream.peek == '}')
+      break;
+    if (stream.peek != '"')
+      goto OnErrorExit;
+
+    key.len = 0;
+    stream.text = &key;
+    err = pcscStreamString(&stream);
+    stream.text = NULL;
+    if (err || pcscStreamBlank(&stream) != ':')
+      goto OnErrorExit;
+    pcscStreamNext(&stream);
+    if (pcscStreamBlank(&stream) < 0)
+      goto OnErrorExit;
+
+    if (head.len > 1)
+      pcscTextAdd(&head, ",", 1);
+    pcscTextAdd(&head, key.data, key.len);
+    pcscTextAdd(&head, ":", 1);
+
+    if (!strcmp(key.data, "\"cmds\"")) {
+      // peek char was already read from file
+      cmdsAt = ftell(stream.file) - 1;
+      pcscTextAdd(&head, "[]", 2);
+      err = pcscStreamValue(&stream);
+    } else {
+      stream.text = &head;
+      err = pcscStreamValue(&stream);
+      stream.text = NULL;
+    }
+    if (err)
+      goto OnErrorExit;
+
+    if (pcscStreamBlank(&stream) < 0)
+      goto OnErrorExit;
+    if (stream.peek == ',')
+      pcscStreamNext(&stream);
+    else if (stream.peek != '}')
+      goto OnErrorExit;
+  }
+  pcscTextAdd(&head, "}", 1);
+
+  headJ = json_tokener_parse(head.data);
+  if (!headJ)
+    goto OnErrorExit;
+
+  config = pcscParseHeader(headJ, verbosity, &cmdsJ);
+  json_object_put(headJ); // header keeps its own reference
+  if (!config)
+    goto OnErrorExit;
+
+  // 2nd pass: stream commands once keys are known
+  config->streamed = 1;
+  if (cmdsAt >= 0) {
+    err = fseek(stream.file, cmdsAt, SEEK_SET);
+    if (err)
+      goto OnErrorExit;
+    stream.peek = getc_unlocked(stream.file);
+    err = pcscStreamCmds(config, &stream);
+    if (err)
+      goto OnErrorExit;
+  }
+
+  pcscIndexCmds(config);
   config->magic = PCSC_CONFIG_MAGIC;
+  fclose(stream.file);
+  free(head.data);
+  free(key.data);
   return config;
 
 OnErrorExit:
+  EXT_CRITICAL("[pcsc-stream-fail] path=%s line=%ld fail to parse config "
+               "(pcscParseConfigFile)",
+               path, stream.line);
+  if (stream.file)
+    fclose(stream.file);
+  free(head.data);
+  free(key.data);
   return NULL;
 }
 
+// release a parsed config, commands and keys should not be used afterward
+void pcscFreeConfig(pcscConfigT *config) {
+  if (!config)
+    return;
+  HASH_CLEAR(hh, config->hTable);
+
+  for (int idx = 0; config->cmds && config->cmds[idx].uid; idx++) {
+    pcscCmdT *cmd = &config->cmds[idx];
+    free(cmd->data);
+    free(cmd->svcs);
+    free(cmd->prefetch);
+    pcscFreeKeyRing(cmd->key);
+    if (cmd->trailer) {
+      free(cmd->trailer->acls);
+      free(cmd->trailer);
+    }
+    if (cmd->tpl) {
+      for (int jdx = 0; jdx < cmd->tpl->count; jdx++)
+        free((char *)cmd->tpl->segs[jdx].text);
+      free(cmd->tpl->segs);
+      free(cmd->tpl);
+    }
+    if (config->streamed) {
+      free((char *)cmd->uid);
+      free((char *)cmd->info);
+      free((char *)cmd->field);
+    }
+  }
+  free(config->cmds);
+
+  for (int idx = 0; config->keys && config->keys[idx].uid; idx++) {
+    free(config->keys[idx].kval);
+    free(config->keys[idx].master);
+    free(config->keys[idx].sysid);
+  }
+  free(config->keys);
+
+  for (int idx = 0; idx < config->ccount; idx++) {
+    pcscCtrlProfileT *ctrl = &config->ctrls[idx];
+    for (int jdx = 0; jdx < ctrl->ecount; jdx++)
+      free((u_int8_t *)ctrl->escapes[jdx]);
+    free((void *)ctrl->escapes);
+    free((void *)ctrl->elens);
+    free((char *)ctrl->reader);
+  }
+  free(config->ctrls);
+
+  pcscFreeStore(config->store);
+  json_object_put(config->configJ);
+  free(config);
+}
+
 // get a command from its uid using uthash table
 pcscCmdT *pcscCmdByUid(pcscConfigT *config, const char *uid) {
   assert(config->magic == PCSC_CONFIG_MAGIC);
@@ -394,24 +1314,136 @@ const char *pcscCmdUid(const pcscCmdT *cmd) { return cmd->uid; }
 
 const char *pcscCmdInfo(const pcscCmdT *cmd) { return cmd->info; }
 
+// search a field value within card record
+static const char *pcscRecordField(const pcscRecordT *record,
+                                   const char *label) {
+  if (!record || !record->fields)
+    return NULL;
+
+  for (int idx = 0; record->fields[idx].label; idx++) {
+    if (!strcasecmp(record->fields[idx].label, label))
+      return record->fields[idx].value;
+  }
+  return NULL;
+}
+
+// render command template directly into caller buffer, remaining bytes are
+// zeroed. Returns rendered length or -1 when a field is missing or data
+// does not fit (never write a truncated personalisation)
+long pcscTplRender(pcscHandleT *handle, const pcscCmdT *cmd,
+                   const pcscRecordT *record, u_int8_t *buffer, size_t len) {
+  const pcscTemplateT *tpl = cmd->tpl;
+  ulong counter = 0;
+  size_t idx = 0;
+
+  if (!tpl)
+    goto OnErrorExit;
+
+  for (int sdx = 0; sdx < tpl->count; sdx++) {
+    const pcscTplSegT *seg = &tpl->segs[sdx];
+    char number[24];
+    const char *value;
+    size_t vlen;
+
+    switch (seg->kind) {
+    case PCSC_TPL_LITERAL:
+      value = seg->text;
+      vlen = seg->len;
+      break;
+
+    case PCSC_TPL_UUID:
+      vlen = (size_t)snprintf(number, sizeof(number), "%0*lX", seg->width,
+                              (ulong)pcscGetCardUuid(handle));
+      value = number;
+      break;
+
+    case PCSC_TPL_COUNTER:
+      // one counter value per rendering
+      if (!counter)
+        counter = record && record->counter
+                      ? record->counter
+                      : __atomic_add_fetch(&cmd->tpl->counter, 1,
+                                           __ATOMIC_RELAXED);
+      vlen = (size_t)snprintf(number, sizeof(number), "%0*lu", seg->width,
+                              counter);
+      value = number;
+      break;
+
+    case PCSC_TPL_TIME:
+      vlen = (size_t)snprintf(number, sizeof(number), "%0*ld", seg->width,
+                              (long)time(NULL));
+      value = number;
+      break;
+
+    case PCSC_TPL_FIELD:
+      value = pcscRecordField(record, seg->text);
+      if (!value) {
+        EXT_ERROR("[pcsc-template-field] cmd=%s field=%s missing in record",
+                  cmd->uid, seg->text);
+        goto OnErrorExit;
+      }
+      vlen = strlen(value);
+      break;
+
+    default:
+      goto OnErrorExit;
+    }
+
+    // snprintf returns the untruncated length
+    if (value == number && vlen >= sizeof(number))
+      goto OnErrorExit;
+    if (idx + vlen > len) {
+      EXT_ERROR("[pcsc-template-overflow] cmd=%s rendered data > len=%ld",
+                cmd->uid, len);
+      goto OnErrorExit;
+    }
+    memcpy(&buffer[idx], value, vlen);
+    idx += vlen;
+  }
+  memset(&buffer[idx], 0, len - idx);
+  return (long)idx;
+
+OnErrorExit:
+  return -1;
+}
+
 int pcscExecOneCmd(pcscHandleT *handle, const pcscCmdT *cmd, u_int8_t *data) {
+  return pcscExecRecordCmd(handle, cmd, NULL, data);
+}
+
+// execute a command, write templates are rendered from card record
+static int pcscExecAction(pcscHandleT *handle, const pcscCmdT *cmd,
+                          const pcscRecordT *record, u_int8_t *data) {
   int err;
   ulong dlen = cmd->dlen;
 
   switch (cmd->action) {
 
   case PCSC_ACTION_READ:
-    err = pcscReadBlock(handle, cmd->uid, cmd->sec, cmd->blk, data, dlen,
-                        cmd->key);
+    if (cmd->nsvc) {
+      err = pcscFelicaRead(handle, cmd->uid, cmd->svcs, cmd->nsvc,
+                           (u_int16_t)(cmd->sec * 4 + cmd->blk), data,
+                           dlen - PCSC_MIFARE_STATUS_LEN);
+    } else {
+      err = pcscReadBlock(handle, cmd->uid, cmd->sec, cmd->blk, data, dlen,
+                          cmd->key);
+    }
     if (err)
       goto OnErrorExit;
+    // declared next sectors are prefetched while application decides
+    if (cmd->nprefetch)
+      pcscReadAheadHint(handle, cmd->prefetch, cmd->nprefetch, cmd->key);
     break;
 
   case PCSC_ACTION_WRITE: {
     // if no data use the one from config file
     u_int8_t buffer[cmd->dlen];
 
-    if (!data) {
+    if (!data && cmd->tpl) {
+      if (pcscTplRender(handle, cmd, record, buffer, cmd->dlen) < 0)
+        goto OnErrorExit;
+      data = buffer;
+    } else if (!data) {
       data = cmd->data;
     } else {
       for (int idx= 0; idx < cmd->dlen; idx++) {
@@ -431,8 +1463,14 @@ int pcscExecOneCmd(pcscHandleT *handle, const pcscCmdT *cmd, u_int8_t *data) {
                    cmd->uid);
       goto OnErrorExit;
     }
-    err = pcsWriteBlock(handle, cmd->uid, cmd->sec, cmd->blk, data, cmd->dlen,
-                        cmd->key);
+    if (cmd->nsvc) {
+      err = pcscFelicaWrite(handle, cmd->uid, cmd->svcs, cmd->nsvc,
+                            (u_int16_t)(cmd->sec * 4 + cmd->blk), data,
+                            cmd->dlen);
+    } else {
+      err = pcsWriteBlock(handle, cmd->uid, cmd->sec, cmd->blk, data,
+                          cmd->dlen, cmd->key);
+    }
     if (err)
       goto OnErrorExit;
     break;
@@ -451,6 +1489,47 @@ int pcscExecOneCmd(pcscHandleT *handle, const pcscCmdT *cmd, u_int8_t *data) {
       goto OnErrorExit;
     break;
 
+  case PCSC_ACTION_VALUE: {
+    int32_t value = cmd->amount;
+    err = pcscValueBlock(handle, cmd->uid, cmd->sec, cmd->blk, cmd->vop,
+                         &value, cmd->dst, cmd->key);
+    if (err)
+      goto OnErrorExit;
+    if (data)
+      memcpy(data, &value, sizeof(value));
+    break;
+  }
+
+  case PCSC_ACTION_APDU: {
+    u_int8_t buffer[data ? 1 : cmd->dlen];
+    u_int16_t sw;
+    err = pcscSendApdu(handle, cmd->uid, cmd->data, cmd->alen,
+                       data ? data : buffer, &dlen, &sw);
+    if (err)
+      goto OnErrorExit;
+    break;
+  }
+
+  case PCSC_ACTION_STORE:
+    switch (cmd->sop) {
+    case PCSC_STORE_FORMAT:
+      err = pcscStoreFormat(handle, cmd->uid, cmd->store);
+      break;
+    case PCSC_STORE_SET:
+      err = pcscStoreSet(handle, cmd->uid, cmd->store, cmd->field, cmd->data,
+                         cmd->dlen);
+      break;
+    default: {
+      u_int8_t buffer[data ? 1 : cmd->dlen];
+      err = pcscStoreGet(handle, cmd->uid, cmd->store, cmd->field,
+                         data ? data : buffer, &dlen);
+      break;
+    }
+    }
+    if (err)
+      goto OnErrorExit;
+    break;
+
   default:
     goto OnErrorExit;
   }
@@ -459,3 +1538,40 @@ int pcscExecOneCmd(pcscHandleT *handle, const pcscCmdT *cmd, u_int8_t *data) {
 OnErrorExit:
   return -1;
 }
+
+// read back what a write command stored, through the same path as the write:
+// FeliCa services (interleaved per service), type-2 pages or Mifare blocks.
+// check holds cmd dlen + PCSC_MIFARE_STATUS_LEN bytes
+int pcscReadBackCmd(pcscHandleT *handle, const pcscCmdT *cmd,
+                    u_int8_t *check) {
+  int err;
+
+  if (cmd->action != PCSC_ACTION_WRITE || !cmd->dlen)
+    return -1;
+  if (cmd->timeout)
+    pcscSetDeadline(handle, PCSC_DEADLINE_CMD, (ulong)cmd->timeout);
+  if (cmd->nsvc) {
+    err = pcscFelicaRead(handle, cmd->uid, cmd->svcs, cmd->nsvc,
+                         (u_int16_t)(cmd->sec * 4 + cmd->blk), check,
+                         cmd->dlen);
+  } else {
+    err = pcscReadBlock(handle, cmd->uid, cmd->sec, cmd->blk, check,
+                        cmd->dlen + PCSC_MIFARE_STATUS_LEN, cmd->key);
+  }
+  if (cmd->timeout)
+    pcscSetDeadline(handle, PCSC_DEADLINE_CMD, 0);
+  return err;
+}
+
+// command timeout is checked before each exchange sent to card
+int pcscExecRecordCmd(pcscHandleT *handle, const pcscCmdT *cmd,
+                      const pcscRecordT *record, u_int8_t *data) {
+  int err;
+
+  if (cmd->timeout)
+    pcscSetDeadline(handle, PCSC_DEADLINE_CMD, (ulong)cmd->timeout);
+  err = pcscExecAction(handle, cmd, record, data);
+  if (cmd->timeout)
+    pcscSetDeadline(handle, PCSC_DEADLINE_CMD, 0);
+  return err;
+}
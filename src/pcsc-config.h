@@ -24,6 +24,7 @@
 
 #define PCSC_MAX_DEV 16 // default max connected readers
 #define PCSC_CONFIG_MAGIC 789654123
+#define PCSC_TPL_WIDTH_MAX 20 // max zero padded width (20 digits fits a ulong)
 
 typedef enum {
     PCSC_ACTION_UNKNOWN=0,
@@ -31,8 +32,51 @@ typedef enum {
     PCSC_ACTION_WRITE,
     PCSC_ACTION_TRAILER,
     PCSC_ACTION_UUID,
+    PCSC_ACTION_VALUE,
+    PCSC_ACTION_APDU,
+    PCSC_ACTION_STORE,
 } pcscActionE;
 
+typedef enum {
+    PCSC_STORE_UNKNOWN=0,
+    PCSC_STORE_GET,
+    PCSC_STORE_SET,
+    PCSC_STORE_FORMAT,
+} pcscStoreOpE;
+
+typedef enum {
+    PCSC_TPL_LITERAL=0,
+    PCSC_TPL_UUID,
+    PCSC_TPL_COUNTER,
+    PCSC_TPL_TIME,
+    PCSC_TPL_FIELD,
+} pcscTplKindE;
+
+// precompiled write template segment: literal bytes or placeholder
+typedef struct {
+    pcscTplKindE kind;
+    const char *text; // literal value or field label
+    size_t len;       // literal length
+    int width;        // zero padded width for numeric placeholders
+} pcscTplSegT;
+
+typedef struct {
+    pcscTplSegT *segs;
+    int count;
+    ulong counter; // rendering counter when record does not provide one
+} pcscTemplateT;
+
+// per card record fields used to render templates
+typedef struct {
+    const char *label;
+    const char *value;
+} pcscFieldT;
+
+typedef struct {
+    const pcscFieldT *fields; // NULL label terminated
+    ulong counter;            // 0 use template own counter
+} pcscRecordT;
+
 typedef struct {
     const char *uid;
     const char *info;
@@ -43,7 +87,20 @@ typedef struct {
     const pcscKeyT *key;
     pcscActionE action;
     pcscTrailerT *trailer;
+    pcscTemplateT *tpl;
+    pcscValueOpE vop;  // value block operation
+    int32_t amount;    // value block store/increment/decrement amount
+    u_int8_t dst;      // value block restore target block
+    ulong alen;        // apdu length (apdu within data)
+    u_int16_t *svcs;   // FeliCa service codes
+    int nsvc;
     int group;
+    int timeout;       // command deadline (ms, 0=none)
+    u_int8_t *prefetch; // sectors read ahead after this read
+    int nprefetch;
+    pcscStoreOpE sop;  // record store operation
+    const char *field; // record store field
+    const pcscStoreT *store;
     UT_hash_handle hh;
 } pcscCmdT;
 
@@ -55,14 +112,30 @@ typedef struct {
     ulong timeout;
     int maxdev;
     int verbose;
+    int bitrate;  // ISO14443-4 max bitrate (kbit/s)
+    int retry;    // transient error retry budget per command (-1=default)
+    int debounce; // monitor debounce window (ms)
+    int duptap;   // same card not reported again within (ms)
+    int deadline; // group execution deadline (ms)
+    int readahead; // learned sectors prefetched after a read
+    const pcscStoreT *store; // card record store layout
     pcscCmdT *cmds;
     pcscKeyT *keys;
     pcscCmdT *hTable;
+    pcscCtrlProfileT *ctrls;  // reader control profiles
+    int ccount;
+    json_object *configJ; // retained json, header/cmd strings point into it
+    int streamed;         // cmd strings are owned copies (pcscParseConfigFile)
 } pcscConfigT;
 
 pcscConfigT *pcscParseConfig (json_object *configJ, const int verbosity);
+pcscConfigT *pcscParseConfigFile (const char *path, const int verbosity);
+void pcscFreeConfig (pcscConfigT *config);
 pcscCmdT *pcscCmdByUid (pcscConfigT *config, const char *cmdUid);
 int pcscExecOneCmd(pcscHandleT *handle, const pcscCmdT *cmd, u_int8_t *data);
+int pcscExecRecordCmd(pcscHandleT *handle, const pcscCmdT *cmd, const pcscRecordT *record, u_int8_t *data);
+int pcscReadBackCmd(pcscHandleT *handle, const pcscCmdT *cmd, u_int8_t *check);
+long pcscTplRender(pcscHandleT *handle, const pcscCmdT *cmd, const pcscRecordT *record, u_int8_t *buffer, size_t len);
 size_t pcscCmdDataLen(const pcscCmdT *cmd);
 pcscActionE pcscCmdAction(const pcscCmdT *cmd);
 const char* pcscCmdUid(const pcscCmdT *cmd);
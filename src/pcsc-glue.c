@@ -23,6 +23,7 @@
 #define _GNU_SOURCE
 
 #include "pcsc-glue.h"
+#include "pcsc-backend.h"
 
 #include <sys/types.h>
 #include <stdlib.h>
@@ -33,9 +34,31 @@
 #include <errno.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
 
 #include <winscard.h>
 #include <pcsclite.h>
+#include <reader.h>
+#include <uthash.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+
+// USDT static probes, provider pcscd_glue (cmake -DPCSC_USDT=ON). When disabled probes and
+// their arguments are compiled out, when enabled an untraced probe is a single nop
+#ifdef PCSC_USDT
+#include <sys/sdt.h>
+#define PCSC_PROBE(...) STAP_PROBEV(pcscd_glue, __VA_ARGS__)
+#else
+#define PCSC_PROBE(...)
+#endif
+
+// CCID escape (requires ifdDriverOptions 0x0001 within ccid Info.plist)
+#define PCSC_IOCTL_CCID_ESCAPE SCARD_CTL_CODE(3500)
 
 
 typedef struct {
@@ -52,47 +75,251 @@ typedef union {
 } mifareSecBlkT;
 
 static BYTE defaultKey[]= {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
-static BYTE pcPsRid[]= {0xA0,0x00,0x00,0x03,0x06};
 
-typedef union {
-    u_int16_t  id;
-    BYTE data[2];
-} atrIsoCardid;
+// pcsc-lite entry points, session record/replay swap them (pcscSessionRecord/pcscSessionReplay)
+const pcscBackendT pcscHwBackend = {
+    .label= "pcscd",
+    .establishContext= SCardEstablishContext,
+    .releaseContext= SCardReleaseContext,
+    .listReaders= SCardListReaders,
+    .freeMemory= SCardFreeMemory,
+    .getStatusChange= SCardGetStatusChange,
+    .cancel= SCardCancel,
+    .connect= SCardConnect,
+    .reconnect= SCardReconnect,
+    .disconnect= SCardDisconnect,
+    .status= SCardStatus,
+    .transmit= SCardTransmit,
+    .control= SCardControl,
+};
+const pcscBackendT *pcscBackend= &pcscHwBackend;
+// ATR database trie generated at build time by atr-gen (etc/smartcard_list.txt)
+typedef struct {
+    int32_t first;  // first edge within pcscAtrEdges
+    int32_t count;  // exact byte edges (sorted)
+    int32_t any;    // '..' wildcard child or -1
+    int32_t model;  // model index when an ATR ends here or -1
+} pcscAtrNodeT;
+
+typedef struct {
+    BYTE byte;
+    int32_t child;
+} pcscAtrEdgeT;
+
+#include "pcsc-atr-db.h"
 
+
+// NFC type-2 (Mifare Ultralight/NTAG) geometry as detected from GET_VERSION
 typedef struct {
-  atrCardidEnumT uid;
-  atrIsoCardid  cardid;
-} isoAtrCardIdMapT;
-
-static isoAtrCardIdMapT isoArtCardIds[] = {
-    {.uid=ATR_MIFARE_1K,   .cardid={.data= {0x00, 0x01}}},
-    {.uid=ATR_MIFARE_4K,   .cardid={.data= {0x00, 0x02}}},
-    {.uid=ATR_MIFARE_UL,   .cardid={.data= {0x00, 0x03}}},
-    {.uid=ATR_MIFARE_MINI, .cardid={.data= {0x00, 0x26}}},
-    {.uid=ATR_FELICA_212K, .cardid={.data= {0xF0, 0x11}}},
-    {.uid=ATR_FELICA_424K, .cardid={.data= {0xF0, 0x12}}},
-
-    {.uid= ATR_UNKNOWN} // trailer
+    const char *label;
+    BYTE storage;     // GET_VERSION storage size byte (0=unknown)
+    u_int16_t pages;  // total pages including lock/config pages
+    int fastRead;     // support FAST_READ (0x3A)
+    u_int16_t userEnd; // first page after user memory (lock/config/password pages follow)
+} pcscT2ModelT;
+
+static const pcscT2ModelT pcscT2Models[] = {
+    {"ultralight-ev1-48" , 0x0B, 20, 1, 16},
+    {"ultralight-ev1-128", 0x0E, 41, 1, 36},
+    {"ntag213"           , 0x0F, 45, 1, 40},
+    {"ntag215"           , 0x11, 135, 1, 130},
+    {"ntag216"           , 0x13, 231, 1, 226},
+    {NULL}  // trailer
 };
+// no GET_VERSION support: legacy Ultralight (16 pages) or Ultralight-C (48 pages)
+static const pcscT2ModelT pcscT2Legacy = {"ultralight", 0x00, 16, 0, 16};
+static const pcscT2ModelT pcscT2LegacyC = {"ultralight-c", 0x00, 48, 0, 40};
+
+// type-2 transfers: READ returns 4 pages, FAST_READ size is bounded by reader frame
+#define PCSC_T2_PAGE_LEN 4
+#define PCSC_T2_READ_PAGES 4
+#define PCSC_T2_FAST_PAGES 48
+
+// FeliCa without encryption: blocks per request are card dependent, start high and
+// shrink on refusal. Read is bounded by reader frame (15 blocks would overflow PN532)
+#define PCSC_FELICA_IDM_LEN 8
+#define PCSC_FELICA_BLK_LEN 16
+#define PCSC_FELICA_READ_MAX 12
+#define PCSC_FELICA_WRITE_MAX 8
+#define PCSC_FELICA_SVC_MAX 16
+
+// card UID is 4, 7 or 10 bytes (ISO14443-3 single/double/triple size)
+#define PCSC_CARD_UID_MAX 10
+
+// Mifare classic multi-block read (Le=blocks*16) within one sector, lowered to one block
+// when reader refuses it
+#define PCSC_MIFARE_READ_MAX 4
+
+// card dump file: header followed by one record per sector, data only follows readable sectors.
+// Fields are serialised byte by byte, 16 bits values little endian, whatever the host
+#define PCSC_DUMP_MAGIC "PCSCDMP2"
+#define PCSC_DUMP_NOKEY 0xFF
+#define PCSC_DUMP_HEADER_LEN (8+1+1+2+2+1+PCSC_CARD_UID_MAX)
+#define PCSC_DUMP_SECTOR_LEN 6
+typedef enum {
+    PCSC_DUMP_CLASSIC=1, // 16 bytes blocks, sector trailer included
+    PCSC_DUMP_TYPE2,     // 4 bytes pages by 4
+} pcscDumpFamilyE;
 
-typedef union {
-    BYTE data[20];
-    struct  {
-        BYTE Header;
-        BYTE T0;
-        BYTE TD1;
-        BYTE TD2;
-        BYTE T1;
-        BYTE Tk;
-        BYTE length;
-        BYTE rid[5];
-        BYTE Standard;
-        BYTE cardid[2];
-        BYTE rfu[4];
-        BYTE checkSum;
-    } value;
-} isoAtrDataP3T;
+typedef struct {
+    char magic[8];
+    u_int8_t family;     // pcscDumpFamilyE
+    u_int8_t blkLen;
+    u_int16_t sectors;
+    u_int16_t blocks;    // blocks/pages of card
+    u_int8_t uidLen;
+    u_int8_t uid[PCSC_CARD_UID_MAX];
+} pcscDumpHeaderT;
+
+typedef struct {
+    u_int16_t first;     // first block/page of sector
+    u_int8_t sector;
+    u_int8_t status;     // pcscDumpStatusE
+    u_int8_t key;        // ring key index which opened sector (PCSC_DUMP_NOKEY none)
+    u_int8_t blocks;     // blocks following record (0 when unreadable)
+} pcscDumpSectorT;
+
+// record store within consecutive Mifare classic sectors, store blocks are sector data blocks
+// (3 per sector, trailers skipped). Directory starts at store block 0: 'P','S', version, field
+// count, free map (one bit per store block) then per field first block and record length (0=empty)
+#define PCSC_STORE_VERSION 1
+#define PCSC_STORE_BLOCKS (PCSC_STORE_SECTORS_MAX*3)
+#define PCSC_STORE_HEADER_LEN 4
+struct pcscStoreS {
+    const char *uid;
+    u_int8_t sector;     // first store sector
+    u_int8_t count;      // store sectors
+    int blocks;          // store blocks
+    int dirBlocks;       // blocks holding directory (within first sector)
+    int mapLen;          // free map bytes
+    const char **fields; // field name per directory entry
+    int nfield;
+    const pcscKeyT *key;  // read key (NULL=default keyA)
+    const pcscKeyT *wkey; // write key (NULL=default keyA)
+};
+#define PCSC_AES_BLK_LEN 16
+
+// diversified key cache, one entry per (card uuid, key, sector) for current card
+typedef struct {
+    u_int64_t uuid;
+    const pcscKeyT *key;
+    u_int8_t sector;
+} pcscDivKeyIdT;
+
+typedef struct pcscDivKeyS {
+    pcscDivKeyIdT id;
+    BYTE kval[PCSC_MIFARE_KEY_LEN];
+    UT_hash_handle hh;
+} pcscDivKeyT;
+
+// retry backoff doubles on each attempt (5ms, 10ms, 20ms...)
+#define PCSC_RETRY_BACKOFF_US 5000
+static const char *pcscErrClassLabels[] = {"none", "transient", "auth", "card-gone", "fatal", "aborted"};
+
+// pcscReaderCheck waits ticks of fixed length for a card, independent of reader timeout
+#define PCSC_CHECK_TICK_MS 10000
+
+// watchdog: reader reappears on pcscd within PCSC_WDG_WAIT_MS after context/usb reset
+#define PCSC_WDG_WAIT_MS 10000
+#define PCSC_WDG_POLL_MS 250
+static const char *pcscWdgStepLabels[] = {"none", "reconnect", "context", "usb-reset"};
+
+// transmit statistics, updated lock free (relaxed atomics) from any thread
+typedef struct {
+    atomic_ulong count;
+    atomic_ulong errors;
+    atomic_ulong bytesOut;
+    atomic_ulong bytesIn;
+    atomic_ulong usecTotal;
+    atomic_ulong usecMax;
+    atomic_ulong hist[PCSC_STATS_BUCKETS];
+} pcscActionCountersT;
+static const char *pcscStatLabels[] = {"key", "authent", "read", "write", "uuid", "value", "apdu", "other"};
+
+// binary trace: fixed size events within a per handle ring, writers claim a slot with one
+// atomic increment and publish it through slot sequence (seqlock), readers drop torn slots.
+// Event layout is also the trace file format (check pcscTraceSave/pcscTraceDecode)
+#define PCSC_TRACE_MAGIC "PCSCTRC1"
+#define PCSC_TRACE_DATA_MAX 88 // payload bytes kept per event (full length is recorded)
+#define PCSC_TRACE_ACTION_LEN 16
+#define PCSC_TRACE_MASK_MAX 8  // masked key ranges per event (keyA/keyB of up to 4 trailers)
+typedef enum {
+    PCSC_TRACE_SEND=1,  // command sent to card (extra: -)
+    PCSC_TRACE_RECV,    // card response or transport error (extra: response buffer size)
+    PCSC_TRACE_BLOCK,   // pcscReadBlock request (extra: sector<<8|block, len: data size)
+    PCSC_TRACE_STATUS,  // reader status change (extra: SCARD_STATE mask)
+} pcscTraceTypeE;
+
+typedef struct {
+    u_int64_t usec;      // monotonic timestamp
+    u_int16_t type;      // pcscTraceTypeE
+    u_int16_t len;       // payload length before truncation
+    u_int32_t extra;
+    int32_t status;      // pcsc return code
+    u_int8_t mask[PCSC_TRACE_MASK_MAX][2]; // masked payload (offset,len), bytes are zeroed
+    char action[PCSC_TRACE_ACTION_LEN];
+    u_int8_t data[PCSC_TRACE_DATA_MAX];
+} pcscTraceEventT;
+
+typedef struct {
+    char magic[8];
+    u_int32_t evtSize;   // sizeof(pcscTraceEventT), checked by decoder
+    u_int32_t count;
+    char reader[64];
+} pcscTraceHeaderT;
+
+typedef struct {
+    atomic_ulong seq;    // ticket+1 once event is complete, 0 while written
+    pcscTraceEventT event;
+} pcscTraceSlotT;
+
+// learned key memo: ring key which opened a (card uuid, sector), kept across card taps
+#define PCSC_KEY_MEMO_MAX 4096 // memo is reset when full
+typedef struct {
+    u_int64_t uuid;
+    u_int8_t sector;
+} pcscKeyMemoIdT;
+
+typedef struct pcscKeyMemoS {
+    pcscKeyMemoIdT id;
+    const pcscKeyT *key;
+    UT_hash_handle hh;
+} pcscKeyMemoT;
+
+// reader scheduler: one holder at a time, waiters sorted by class, deadline then arrival
+typedef struct pcscSchedWaiterS {
+    pcscPrioE prio;
+    u_int64_t deadline;  // monotonic usec (0=none)
+    u_int64_t ticket;
+    int granted;
+    struct pcscSchedWaiterS *next;
+} pcscSchedWaiterT;
+static const char *pcscPrioLabels[] = {"interactive", "normal", "bulk"};
+
+// cancellation token, shared between requester and the thread running a group
+struct pcscTokenS {
+    atomic_int cancelled;
+};
+
+// monitor: recent cards kept for duplicate tap suppression
+#define PCSC_TAP_MAX 8
+#define PCSC_DEBOUNCE_SPAN 8 // max debounce windows before a bouncing state is handled
+typedef struct {
+    u_int64_t uuid;
+    u_int64_t seenMs;  // last removal
+} pcscTapT;
+
+// read-ahead: session cache holds prefetched data blocks of 4 blocks Mifare classic sectors
+#define PCSC_RA_SECTORS 32
+#define PCSC_RA_QUEUE 8
+#define PCSC_RA_CONFIDENT 2 // learned successor confidence (2 bits counter) before it is prefetched
+typedef struct {
+    u_int8_t sector;
+    const pcscKeyT *key;
+} pcscRaQueueT;
 
+static const u_int16_t felicaDfltReadSvc = 0x000B;  // random service read-only access
+static const u_int16_t felicaDfltWriteSvc = 0x0009; // random service read/write access
 
 typedef struct pcscHandleS {
   const char *uid;
@@ -107,104 +334,652 @@ typedef struct pcscHandleS {
   SCARDHANDLE hCard;
   const SCARD_IO_REQUEST *pioSendPci;
   DWORD  activeProtocol;
-  ulong timeout;
+  ulong timeout;   // reader status wait (ms)
   ulong verbose;
   const char *error;
   ulong tid;
   void *ctx;
+  const pcscCardModelT *model; // ATR database model
+  const pcscT2ModelT *t2Model; // NFC type-2 geometry (GET_VERSION)
+  int apduShort; // card refused extended length apdu
+  u_int16_t sw;  // last apdu status word
+  BYTE felicaIdm[PCSC_FELICA_IDM_LEN]; // FeliCa manufacture ID (0 when not read)
+  int felicaReadMax;  // adaptive blocks per read/write request
+  int mifareReadMax;  // Mifare classic blocks per read command (reader dependent)
+  int felicaWriteMax;
+  ulong bitrateMax;   // requested ISO14443-4 bitrate (kbit/s)
+  int bitrate;        // negotiated bitrate for current card (0=not negotiated)
+  int bitrateErrors;  // consecutive transmit errors at current bitrate
+  BYTE cardUid[PCSC_CARD_UID_MAX]; // raw card UID (diversification input)
+  u_int8_t cardUidLen;
+  pcscDivKeyT *divKeys; // diversified keys cache for current card
+  pcscKeyMemoT *keyMemo; // learned ring keys (not reset on card change)
+  pcscAuthStatsT authStats;
+  ulong retryMax;       // retry budget per command
+  int retrying;         // recovery in progress (no nested retry)
+  pcscErrClassE errClass; // last error class
+  pcscRetryStatsT retryStats;
+  int authActive;       // a sector is authenticated, re-authenticate after card reactivation
+  u_int8_t authBlk;
+  u_int8_t authSector;
+  const pcscKeyT *authKey;
+  int wdgErrors;        // consecutive reader failures/stalls
+  int wdgPending;       // recovery requested to monitor thread
+  ulong wdgSimulate;    // simulated failure: steps below this one fail
+  char *wdgReaderName;  // reader name owned by watchdog after re-enumeration
+  pcscActionCountersT stats[PCSC_STAT_COUNT];
+  pcscTraceSlotT *trace; // binary trace ring (power of 2 slots)
+  ulong traceMask;
+  atomic_ulong traceHead;  // next ticket
+  atomic_ulong traceShown; // first ticket not yet printed by pcscTracePrint
+  char *tracePath;       // trace saved here on error
+  pthread_mutex_t schedLock;
+  pthread_cond_t schedCond;  // monotonic clock
+  int schedBusy;
+  pcscPrioE schedPrio;       // current holder class
+  pcscSchedWaiterT *schedQueue;
+  u_int64_t schedTicket;
+  pcscSchedStatsT schedStats;
+  ulong debounce;        // monitor debounce window (ms)
+  ulong dupTap;          // same card not reported again within (ms)
+  int monReported;       // last presence given to callback (-1=none)
+  int monSuppressed;     // insertion not reported, skip its removal
+  pcscMonitorStatsT monStats;
+  pcscTapT taps[PCSC_TAP_MAX];
+  u_int64_t deadlines[PCSC_DEADLINE_COUNT]; // monotonic ms (0=none), checked before each command sent
+  pcscTokenT *token;     // in-flight work cancellation
+  atomic_int killed;     // PCSC_MONITOR_KILL in progress
+  int raEnabled;         // read-ahead hinted or learned, Mifare classic reads go through session cache
+  ulong raDepth;         // learned successors queued after a read (0=none)
+  u_int8_t raBlocks[PCSC_RA_SECTORS*4][16]; // session cache (trailer blocks unused)
+  u_int32_t raValid;     // prefetched sectors of current card
+  u_int32_t raUsed;      // prefetched sectors read at least once
+  ulong raCost[PCSC_RA_SECTORS]; // prefetch commands per cached sector
+  const pcscKeyT *raKeyUsed[PCSC_RA_SECTORS]; // key cached sector was authenticated with
+  pcscRaQueueT raQueue[PCSC_RA_QUEUE];
+  int raCount;
+  u_int8_t raNext[PCSC_RA_SECTORS]; // learned successor sector+1 (0=none), kept across taps
+  u_int8_t raConf[PCSC_RA_SECTORS];
+  const pcscKeyT *raKeys[PCSC_RA_SECTORS]; // key of last read per sector
+  int raLast;            // last sector read on current card +1 (0=none)
+  int raActive;          // prefetch in progress, commands are accounted
+  pcscReadAheadStatsT raStats;
+  const pcscStoreT *store; // record store cached blocks belong to (NULL=none)
+  u_int8_t stBlocks[PCSC_STORE_BLOCKS][16]; // store session cache
+  u_int64_t stValid;     // cached store blocks
+  ulong stWrites;        // card writes when cache was checked, other writes drop it
+  pcscStoreStatsT stStats;
 } pcscHandleT;
 
-static long pcscSendCmd (pcscHandleT *handle, const char *cmdUid, const char *action, const u_int8_t *cmdBuf, long cmdLen, u_int8_t *dataBuf, long unsigned *dataLen)
+static u_int64_t pcscNowUs (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (u_int64_t)now.tv_sec*1000000 + (u_int64_t)now.tv_nsec/1000;
+}
+
+static u_int64_t pcscNowMs (void) {
+    return pcscNowUs()/1000;
+}
+
+// type-2 (NTAG/Ultralight) and FeliCa exchanges share the Mifare read/write/uuid classes
+static pcscStatActionE pcscStatAction (const char *action) {
+    static const struct {
+        const char *action;
+        pcscStatActionE stat;
+    } actions[]= {
+        {"read", PCSC_STAT_READ}, {"fast-read", PCSC_STAT_READ}, {"felica-read", PCSC_STAT_READ},
+        {"get-version", PCSC_STAT_READ}, {"probe", PCSC_STAT_READ},
+        {"write", PCSC_STAT_WRITE}, {"felica-write", PCSC_STAT_WRITE},
+        {"authent", PCSC_STAT_AUTH},
+        {"key", PCSC_STAT_KEY},
+        {"read-uuid", PCSC_STAT_UUID}, {"felica-idm", PCSC_STAT_UUID},
+        {"value", PCSC_STAT_VALUE},
+        {NULL}
+    };
+    for (int idx=0; actions[idx].action; idx++) {
+        if (!strcmp (action, actions[idx].action)) return actions[idx].stat;
+    }
+    return PCSC_STAT_OTHER;
+}
+
+static void pcscStatsRecord (pcscHandleT *handle, pcscStatActionE action, u_int64_t usec, ulong sent, ulong received, int failed) {
+    pcscActionCountersT *counters= &handle->stats[action];
+    ulong max= atomic_load_explicit (&counters->usecMax, memory_order_relaxed);
+    int bucket= usec ? 64 - __builtin_clzll (usec) : 0;
+
+    if (bucket >= PCSC_STATS_BUCKETS) bucket= PCSC_STATS_BUCKETS-1;
+    atomic_fetch_add_explicit (&counters->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit (&counters->bytesOut, sent, memory_order_relaxed);
+    atomic_fetch_add_explicit (&counters->bytesIn, received, memory_order_relaxed);
+    atomic_fetch_add_explicit (&counters->usecTotal, usec, memory_order_relaxed);
+    atomic_fetch_add_explicit (&counters->hist[bucket], 1, memory_order_relaxed);
+    if (failed) atomic_fetch_add_explicit (&counters->errors, 1, memory_order_relaxed);
+    while (usec > max && !atomic_compare_exchange_weak_explicit (&counters->usecMax, &max, usec, memory_order_relaxed, memory_order_relaxed));
+}
+
+static int pcscTraceAlloc (pcscHandleT *handle, ulong events) {
+    ulong size= 1;
+
+    if (events > PCSC_TRACE_MAX) events= PCSC_TRACE_MAX;
+    while (size < events) size <<= 1;
+    pcscTraceSlotT *trace= calloc (size, sizeof(pcscTraceSlotT));
+    if (!trace) return -1;
+
+    // ring is resized before use, not while commands are running
+    free (handle->trace);
+    handle->trace= trace;
+    handle->traceMask= size-1;
+    atomic_store (&handle->traceHead, 0);
+    atomic_store (&handle->traceShown, 0);
+    return 0;
+}
+
+// hot path: one atomic increment, a copy and a release store, no lock, no stdio
+static void pcscTraceRecord (pcscHandleT *handle, pcscTraceTypeE type, const char *action, long status, ulong extra, const u_int8_t *data, ulong len, u_int8_t mask[PCSC_TRACE_MASK_MAX][2]) {
+    if (!handle->trace) return;
+    ulong ticket= atomic_fetch_add_explicit (&handle->traceHead, 1, memory_order_relaxed);
+    pcscTraceSlotT *slot= &handle->trace[ticket & handle->traceMask];
+    pcscTraceEventT *event= &slot->event;
+    ulong dlen= !data ? 0 : len < PCSC_TRACE_DATA_MAX ? len : PCSC_TRACE_DATA_MAX;
+
+    atomic_store_explicit (&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence (memory_order_release);
+    event->usec= pcscNowUs();
+    event->type= (u_int16_t)type;
+    event->len= (u_int16_t)len;
+    event->extra= (u_int32_t)extra;
+    event->status= (int32_t)status;
+    strncpy (event->action, action ? action : "", PCSC_TRACE_ACTION_LEN);
+    if (dlen) memcpy (event->data, data, dlen);
+    memset (event->mask, 0, sizeof(event->mask));
+    for (int idx=0; mask && idx < PCSC_TRACE_MASK_MAX; idx++) {
+        if (!mask[idx][1] || mask[idx][0] >= dlen) continue;
+        ulong mlen= mask[idx][0] + mask[idx][1] > dlen ? dlen - mask[idx][0] : mask[idx][1];
+        memset (&event->data[mask[idx][0]], 0, mlen);
+        event->mask[idx][0]= mask[idx][0];
+        event->mask[idx][1]= (u_int8_t)mlen;
+    }
+    atomic_store_explicit (&slot->seq, ticket+1, memory_order_release);
+}
+
+// key bytes never reach the trace: load key value and Mifare trailer keyA/keyB (write and read)
+static void pcscTraceKeys (pcscHandleT *handle, const u_int8_t *cmdBuf, long cmdLen, u_int8_t sendMask[PCSC_TRACE_MASK_MAX][2], u_int8_t recvMask[PCSC_TRACE_MASK_MAX][2]) {
+    if (cmdLen < 5 || cmdBuf[0] != 0xFF) return;
+
+    if (cmdBuf[1] == 0x82) {
+        sendMask[0][0]= 5;
+        sendMask[0][1]= (u_int8_t)(cmdLen-5);
+        return;
+    }
+    if (handle->cardId != ATR_MIFARE_1K && handle->cardId != ATR_MIFARE_4K && handle->cardId != ATR_MIFARE_MINI) return;
+    if (cmdBuf[2] || (cmdBuf[1] != 0xD6 && cmdBuf[1] != 0xB0)) return;
+
+    // multi-block read/write may span several trailers, mask keyA/keyB of each one
+    u_int8_t (*mask)[2]= cmdBuf[1] == 0xD6 ? sendMask : recvMask;
+    ulong first= cmdBuf[3], count= (cmdBuf[4] ? cmdBuf[4] : 256) / 16, base= cmdBuf[1] == 0xD6 ? 5 : 0;
+    int slot= 0;
+    for (ulong block=first; block < first+count && slot+2 <= PCSC_TRACE_MASK_MAX; block++) {
+        ulong offset= base + (block-first)*16;
+        if (block < 128 ? block % 4 != 3 : (block-128) % 16 != 15) continue;
+        if (offset + 10 > 0xFF) break; // beyond trace payload anyway
+        mask[slot][0]= (u_int8_t)offset;
+        mask[slot++][1]= PCSC_MIFARE_KEY_LEN;
+        mask[slot][0]= (u_int8_t)(offset + 10);
+        mask[slot++][1]= PCSC_MIFARE_KEY_LEN;
+    }
+}
+
+// copy published events within [from,head[, slots overwritten or being written are skipped
+static ulong pcscTraceSnapshot (pcscHandleT *handle, ulong from, ulong head, pcscTraceEventT *events) {
+    ulong count=0;
+
+    for (ulong ticket=from; ticket < head; ticket++) {
+        pcscTraceSlotT *slot= &handle->trace[ticket & handle->traceMask];
+        if (atomic_load_explicit (&slot->seq, memory_order_acquire) != ticket+1) continue;
+        events[count]= slot->event;
+        atomic_thread_fence (memory_order_acquire);
+        if (atomic_load_explicit (&slot->seq, memory_order_relaxed) != ticket+1) continue;
+        count++;
+    }
+    return count;
+}
+
+static void pcscTraceHexa (const pcscTraceEventT *event, ulong dlen, FILE *out) {
+    for (ulong idx=0; idx < dlen; idx++) {
+        int masked=0;
+        for (int jdx=0; jdx < PCSC_TRACE_MASK_MAX; jdx++) {
+            if (idx >= event->mask[jdx][0] && idx < (ulong)event->mask[jdx][0] + event->mask[jdx][1]) masked=1;
+        }
+        if (masked) fprintf (out, "0x**,");
+        else fprintf (out, "0x%02X,", event->data[idx]);
+    }
+    if (event->len > dlen) fprintf (out, "...");
+}
+
+// human readable event, same layout as former verbose output. sent holds last command timestamp
+static void pcscTraceEventPrint (const pcscTraceEventT *event, const char *reader, u_int64_t *sent, FILE *out) {
+    ulong dlen= event->len < PCSC_TRACE_DATA_MAX ? event->len : PCSC_TRACE_DATA_MAX;
+    int ascii=0;
+
+    switch (event->type) {
+        case PCSC_TRACE_SEND:
+            *sent= event->usec;
+            fprintf (out, "\n -- action=%.*s\n -- len=%u sending:[", PCSC_TRACE_ACTION_LEN, event->action, event->len);
+            pcscTraceHexa (event, dlen, out);
+            fprintf (out, "]\n");
+            break;
+
+        case PCSC_TRACE_RECV:
+            if (event->status != SCARD_S_SUCCESS) {
+                fprintf (out, " -- len=0/%u error=%s (%ldus)\n", event->extra, pcsc_stringify_error(event->status), (long)(event->usec - *sent));
+                break;
+            }
+            fprintf (out, " -- len=%u/%u received: [", event->len, event->extra);
+            for (ulong idx=0; idx < dlen; idx++) {
+                if (!event->data[idx]) break;
+                if (event->data[idx] >= ' ' && event->data[idx] <= '~') {
+                    fputc (event->data[idx], out);
+                    ascii=1;
+                }
+            }
+            if (ascii) fprintf (out, "] [");
+            pcscTraceHexa (event, dlen, out);
+            fprintf (out, "] (%ldus)\n", (long)(event->usec - *sent));
+            break;
+
+        case PCSC_TRACE_BLOCK:
+            fprintf (out, "\n# pcscReadBlock reader=%s cmd=%.*s sec=%d blk=%d dlen=%d\n", reader, PCSC_TRACE_ACTION_LEN, event->action, event->extra >> 8, event->extra & 0xFF, event->len);
+            break;
+
+        case PCSC_TRACE_STATUS:
+            fprintf (out, "\n -- async: reader=%s status=0x%x\n", reader, event->extra);
+            break;
+
+        default:
+            fprintf (out, " -- unknown trace event type=%d\n", event->type);
+    }
+}
+
+// write trace ring to file (binary), decode with pcscTraceDecode
+int pcscTraceSave (pcscHandleT *handle, const char *path) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    pcscTraceHeaderT header= {.magic=PCSC_TRACE_MAGIC, .evtSize=sizeof(pcscTraceEventT)};
+    pcscTraceEventT *events= NULL;
+    FILE *file= NULL;
+
+    if (!handle->trace) {
+        handle->error= "Trace is not enabled";
+        goto OnErrorExit;
+    }
+    events= malloc ((handle->traceMask+1) * sizeof(pcscTraceEventT));
+    if (!events) {
+        handle->error= "Fail to allocate trace snapshot";
+        goto OnErrorExit;
+    }
+    ulong head= atomic_load_explicit (&handle->traceHead, memory_order_acquire);
+    ulong from= head > handle->traceMask+1 ? head - (handle->traceMask+1) : 0;
+    header.count= (u_int32_t)pcscTraceSnapshot (handle, from, head, events);
+    strncpy (header.reader, handle->readerName ? handle->readerName : "", sizeof(header.reader)-1);
+
+    file= fopen (path, "w");
+    if (!file) {
+        handle->error= strerror(errno);
+        goto OnErrorExit;
+    }
+    if (fwrite (&header, sizeof(header), 1, file) != 1 || fwrite (events, sizeof(pcscTraceEventT), header.count, file) != header.count) {
+        handle->error= "Fail to write trace file";
+        goto OnErrorExit;
+    }
+    if (fclose (file)) {
+        file= NULL;
+        handle->error= "Fail to close trace file";
+        goto OnErrorExit;
+    }
+    free (events);
+    return (int)header.count;
+
+OnErrorExit:
+    if (file) fclose (file);
+    free (events);
+    EXT_DEBUG ("[pcsc-trace-save-fail] reader=%s path=%s error=%s", handle->readerName, path, handle->error);
+    return -1;
+}
+
+// print events not yet printed since last call
+int pcscTracePrint (pcscHandleT *handle, FILE *out) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    u_int64_t sent=0;
+
+    if (!handle->trace) return 0;
+    pcscTraceEventT *events= malloc ((handle->traceMask+1) * sizeof(pcscTraceEventT));
+    if (!events) return -1;
+
+    ulong head= atomic_load_explicit (&handle->traceHead, memory_order_acquire);
+    ulong from= atomic_exchange (&handle->traceShown, head);
+    if (head - from > handle->traceMask+1) from= head - (handle->traceMask+1);
+    ulong count= pcscTraceSnapshot (handle, from, head, events);
+    for (ulong idx=0; idx < count; idx++) pcscTraceEventPrint (&events[idx], handle->readerName, &sent, out);
+
+    free (events);
+    return (int)count;
+}
+
+// offline decoder for pcscTraceSave files
+int pcscTraceDecode (const char *path, FILE *out) {
+    pcscTraceHeaderT header;
+    pcscTraceEventT event;
+    u_int64_t sent=0;
+    int count=0;
+
+    FILE *file= fopen (path, "r");
+    if (!file) {
+        EXT_ERROR ("[pcsc-trace-decode-fail] path=%s error=%s", path, strerror(errno));
+        goto OnErrorExit;
+    }
+    if (fread (&header, sizeof(header), 1, file) != 1 || memcmp (header.magic, PCSC_TRACE_MAGIC, sizeof(header.magic)) || header.evtSize != sizeof(pcscTraceEventT)) {
+        EXT_ERROR ("[pcsc-trace-decode-fail] path=%s not a pcsc trace file (or incompatible version)", path);
+        goto OnErrorExit;
+    }
+    header.reader[sizeof(header.reader)-1]= '\0';
+
+    while (fread (&event, sizeof(event), 1, file) == 1) {
+        pcscTraceEventPrint (&event, header.reader, &sent, out);
+        count++;
+    }
+    if (count != (int)header.count) EXT_WARNING ("[pcsc-trace-decode-truncated] path=%s events=%d/%d", path, count, header.count);
+    fclose (file);
+    return count;
+
+OnErrorExit:
+    if (file) fclose (file);
+    return -1;
+}
+
+// trace is saved to path each time a command fails (NULL to disable)
+int pcscTraceFile (pcscHandleT *handle, const char *path) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+
+    free (handle->tracePath);
+    handle->tracePath= path ? strdup (path) : NULL;
+    return 0;
+}
+
+static void pcscTraceError (pcscHandleT *handle) {
+    if (handle->tracePath) pcscTraceSave (handle, handle->tracePath);
+    if (handle->verbose) pcscTracePrint (handle, stdout);
+}
+
+static long pcscReAuth (pcscHandleT *handle, const char *uid);
+
+static pcscErrClassE pcscErrClassify (long rv) {
+    switch (rv) {
+        case SCARD_S_SUCCESS:
+            return PCSC_ERR_NONE;
+        // a card moving in the field reports removal, reactivation (pcscRecover) tells whether it left
+        case SCARD_W_REMOVED_CARD:
+        case SCARD_W_RESET_CARD:
+        case SCARD_W_UNRESPONSIVE_CARD:
+        case SCARD_W_UNPOWERED_CARD:
+        case SCARD_E_NOT_TRANSACTED:
+        case SCARD_E_TIMEOUT:
+        case SCARD_F_COMM_ERROR:
+            return PCSC_ERR_TRANSIENT;
+        case SCARD_E_NO_SMARTCARD:
+            return PCSC_ERR_CARD_GONE;
+        default:
+            return PCSC_ERR_FATAL;
+    }
+}
+
+// consecutive reader level failures or stalled exchanges trigger watchdog recovery, when a
+// monitor thread is running recovery is delegated to it (woken up through SCardCancel)
+static void pcscWatchdogCheck (pcscHandleT *handle, long rv, u_int64_t elapsed) {
+    int suspect= elapsed > PCSC_WDG_SLOW_MS;
+
+    switch (rv) {
+        case SCARD_S_SUCCESS:
+        case SCARD_W_REMOVED_CARD:
+        case SCARD_E_NO_SMARTCARD:
+        case SCARD_W_RESET_CARD:
+            break; // card side events are not reader failures
+        default:
+            suspect= 1;
+    }
+    if (!suspect) {
+        handle->wdgErrors= 0;
+        return;
+    }
+    if (++handle->wdgErrors < PCSC_WDG_ERR_MAX || handle->retrying) return;
+
+    handle->wdgErrors= 0;
+    EXT_WARNING ("[pcsc-watchdog] reader=%s unresponsive (last err=%s elapsed=%ldms)", handle->readerName, pcsc_stringify_error(rv), (long)elapsed);
+    if (handle->tid) {
+        handle->wdgPending= 1;
+        pcscBackend->cancel (handle->hContext);
+    } else {
+        pcscWatchdogRecover (handle);
+    }
+}
+
+// deadline and cancellation are checked between commands, an exchange already sent to card
+// is never interrupted. Return 0 when next command can be sent
+static int pcscAbortCheck (pcscHandleT *handle) {
+    u_int64_t now;
+
+    if (handle->killed) {
+        handle->error= "Monitor killed";
+        goto OnErrorExit;
+    }
+    if (handle->token && atomic_load (&handle->token->cancelled)) {
+        handle->error= "Cancelled";
+        goto OnErrorExit;
+    }
+    if (!handle->deadlines[PCSC_DEADLINE_GROUP] && !handle->deadlines[PCSC_DEADLINE_CMD]) return 0;
+
+    now= pcscNowMs();
+    if (handle->deadlines[PCSC_DEADLINE_CMD] && now >= handle->deadlines[PCSC_DEADLINE_CMD]) {
+        handle->error= "Command deadline expired";
+        goto OnErrorExit;
+    }
+    if (handle->deadlines[PCSC_DEADLINE_GROUP] && now >= handle->deadlines[PCSC_DEADLINE_GROUP]) {
+        handle->error= "Group deadline expired";
+        goto OnErrorExit;
+    }
+    return 0;
+
+OnErrorExit:
+    handle->errClass= PCSC_ERR_ABORTED;
+    handle->retryStats.errors[PCSC_ERR_ABORTED]++;
+    return -1;
+}
+
+static long pcscTransmitCmd (pcscHandleT *handle, const char *cmdUid, const char *action, const u_int8_t *cmdBuf, long cmdLen, u_int8_t *dataBuf, long unsigned *dataLen)
 {
     assert (handle->magic == PCSC_HANDLE_MAGIC);
     long unsigned bufferLen= *dataLen;
     long rv;
 
-    if (handle->verbose) {
-	    printf("\n -- action=%s\n -- len=%lu sending:[", action, cmdLen);
-	    for (int i=0; i<cmdLen; i++) printf("0x%02X,", cmdBuf[i]);
-	    printf("]\n");
+    if (pcscAbortCheck (handle)) {
+        *dataLen= 0;
+        EXT_DEBUG ("[pcsc-transmit-abort] uid=%s action=%s error=%s (pcscSendCmd)", cmdUid, action, handle->error);
+        return SCARD_E_CANCELLED;
     }
-
-	rv = SCardTransmit(handle->hCard, handle->pioSendPci, cmdBuf, cmdLen, NULL, dataBuf, dataLen);
+    if (handle->raActive) handle->raStats.apdus++;
+
+    u_int8_t sendMask[PCSC_TRACE_MASK_MAX][2]= {{0}}, recvMask[PCSC_TRACE_MASK_MAX][2]= {{0}};
+    pcscTraceKeys (handle, cmdBuf, cmdLen, sendMask, recvMask);
+    pcscTraceRecord (handle, PCSC_TRACE_SEND, action, 0, 0, cmdBuf, (ulong)cmdLen, sendMask);
+
+    PCSC_PROBE (apdu__start, handle->readerName, action, cmdLen);
+    u_int64_t start= pcscNowUs();
+	rv = pcscBackend->transmit(handle->hCard, handle->pioSendPci, cmdBuf, cmdLen, NULL, dataBuf, dataLen);
+    u_int64_t elapsed= pcscNowUs()-start;
+    PCSC_PROBE (apdu__end, handle->readerName, action, rv, *dataLen, elapsed);
+    pcscTraceRecord (handle, PCSC_TRACE_RECV, action, rv, bufferLen, dataBuf, rv == SCARD_S_SUCCESS ? *dataLen : 0, recvMask);
+    pcscWatchdogCheck (handle, rv, elapsed/1000);
     if (rv !=  SCARD_S_SUCCESS) {
         handle->error= pcsc_stringify_error(rv);
+        handle->errClass= pcscErrClassify (rv);
+        *dataLen= 0;
         goto OnErrorExit;
     }
 
-    if (handle->verbose) {
-        int ascii=0;
-    	printf(" -- len=%lu/%lu received: [", *dataLen, bufferLen);
-        for (int idx=0; idx< *dataLen; idx++) {
-            if (!dataBuf[idx]) break;
-            if (dataBuf[idx] >= ' ' && dataBuf[idx] <= '~') {
-                fwrite(&dataBuf[idx], sizeof(char), 1, stdout);
-                ascii=1;
-            }
-        }
-        if (ascii) printf ("] [");
-	    for (int idx=0; idx< *dataLen; idx++) printf("0x%02X,", dataBuf[idx]);
-	    printf("]\n");
-    }
-
     // checked smartcard is happy response and by 0x90,x00
     if (dataBuf[*dataLen-2] != 0x90 || dataBuf[*dataLen-1] != 0x00) {
         handle->error= "Smartcard CMD refused (auth?)";
+        handle->errClass= (dataBuf[*dataLen-2] == 0x63) ? PCSC_ERR_AUTH : PCSC_ERR_FATAL;
         rv= SCARD_STATE_INUSE;
         goto OnErrorExit;
     }
 
     // close buffer in case it would be used as ascii and remove Mifare status from readlen
     dataBuf[*dataLen-PCSC_MIFARE_STATUS_LEN]='\0';
+    pcscStatsRecord (handle, pcscStatAction (action), elapsed, (ulong)cmdLen, *dataLen, 0);
 
     return rv;
 
 OnErrorExit:
-    EXT_DEBUG ("[pcsc-transmit-error] uid=%s action=%s error=%s (pcscSendCmd)\n", cmdUid, action, handle->error);
+    pcscStatsRecord (handle, pcscStatAction (action), elapsed, (ulong)cmdLen, *dataLen, 1);
+    handle->retryStats.errors[handle->errClass]++;
+    EXT_DEBUG ("[pcsc-transmit-error] uid=%s action=%s class=%s error=%s (pcscSendCmd)\n", cmdUid, action, pcscErrClassLabels[handle->errClass], handle->error);
     return rv;
 }
 
-// search cardId within supported ATR
-static atrCardidEnumT isoAtrParseCard (pcscHandleT *handle, BYTE *buffer, DWORD len) {
-    isoAtrDataP3T *atr;
-    atrCardidEnumT atrUid=ATR_UNKNOWN;
-    atrIsoCardid   cardid;
-    // reference http://ludovic.rousseau.free.fr/softwares/pcsc-tools/smartcard_list.txt
-    switch (len) {
-
-        case sizeof(isoAtrDataP3T):
-            // mirefare1K= .data={0x3B,0x8F,0x80,0x01,0x80,0x4F,0x0C,0xA0,0x00,0x00,0x03,0x06,0x03,0x00,0x00,0x00,0x00,0x00,0x00,0x6A}
-            atr= (isoAtrDataP3T*)buffer;
-
-            // check we are facing a MyFare RID
-            if (memcmp (atr->value.rid, pcPsRid, sizeof(pcPsRid))) goto OnErrorExit;
-
-            // move cardid as int16 in case value is not aligned
-            memcpy (cardid.data, atr->value.cardid, sizeof(cardid));
-
-            // search for cardid within supported list
-            for (int idx=0; isoArtCardIds[idx].uid != ATR_UNKNOWN; idx++) {
-                if (isoArtCardIds[idx].cardid.id == cardid.id) {
-                    atrUid= isoArtCardIds[idx].uid;
-                    break;
-                }
-            }
+// reactivate card after a transient error and restore sector authentication
+static int pcscRecover (pcscHandleT *handle, const char *uid) {
+    long rv;
+
+    handle->retrying= 1;
+    rv= pcscBackend->reconnect (handle->hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, SCARD_RESET_CARD, &handle->activeProtocol);
+    if (rv != SCARD_S_SUCCESS) {
+        handle->error= pcsc_stringify_error(rv);
+        handle->errClass= (rv == SCARD_E_NO_SMARTCARD || rv == SCARD_W_REMOVED_CARD) ? PCSC_ERR_CARD_GONE : PCSC_ERR_FATAL;
+        goto OnErrorExit;
+    }
+    handle->bitrate= 0;
+    handle->bitrateErrors= 0;
+
+    if (handle->authActive) {
+        handle->retryStats.reauths++;
+        rv= pcscReAuth (handle, uid);
+        if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+    }
+    handle->retrying= 0;
+    return 0;
+
+OnErrorExit:
+    handle->retrying= 0;
+    handle->authActive= 0;
+    EXT_DEBUG ("[pcsc-recover-fail] uid=%s class=%s error=%s", uid, pcscErrClassLabels[handle->errClass], handle->error);
+    return -1;
+}
+
+// send one command, transient errors and lost authentication are retried within handle budget
+// only idempotent commands are resent, a transient error on write/value may come after the card
+// applied it (eg: decrement), caller gets the error and decides
+static int pcscRetryable (const char *action) {
+    static const char *actions[]= {"read", "fast-read", "read-uuid", "felica-read", "felica-idm", "authent", "key", NULL};
+    for (int idx=0; actions[idx]; idx++) {
+        if (!strcmp (action, actions[idx])) return 1;
+    }
+    return 0;
+}
+
+static long pcscSendCmd (pcscHandleT *handle, const char *cmdUid, const char *action, const u_int8_t *cmdBuf, long cmdLen, u_int8_t *dataBuf, long unsigned *dataLen)
+{
+    long unsigned bufferLen= *dataLen;
+    long rv;
+
+    for (ulong retry=0; ; retry++) {
+        *dataLen= bufferLen;
+        handle->errClass= PCSC_ERR_NONE;
+        rv= pcscTransmitCmd (handle, cmdUid, action, cmdBuf, cmdLen, dataBuf, dataLen);
+        if (rv == SCARD_S_SUCCESS) {
+            if (retry) handle->retryStats.recovered++;
             break;
+        }
 
-        case 9:
-            // loosely handle bank card
-            atr= (isoAtrDataP3T*)buffer;
-            atrUid= ATR_BANK_FR;
+        // authentication refusal is the ring/caller business, other refusals are definitive
+        if (handle->retrying || !pcscRetryable (action)) break;
+        if (handle->errClass != PCSC_ERR_TRANSIENT && (handle->errClass != PCSC_ERR_AUTH || !handle->authActive || !strcmp (action, "authent"))) break;
+        if (retry >= handle->retryMax) {
+            handle->retryStats.exhausted++;
             break;
+        }
 
-        default:
-            goto OnErrorExit;
+        handle->retryStats.retries++;
+        if (handle->verbose) fprintf (stderr, " -- retry=%ld/%ld action=%s class=%s\n", retry+1, handle->retryMax, action, pcscErrClassLabels[handle->errClass]);
+        usleep (PCSC_RETRY_BACKOFF_US << retry);
+        if (pcscRecover (handle, cmdUid)) {
+            rv= -1;
+            break;
+        }
+    }
+    // refused ring keys are expected, caller reports authentication failure
+    if (rv != SCARD_S_SUCCESS && handle->errClass != PCSC_ERR_AUTH) pcscTraceError (handle);
+    return rv;
+}
+
+// walk ATR trie, exact bytes first then wildcard. A failed exact branch backtracks through
+// the '..' edge, so worst case visits every node reachable from root within ATR length (each
+// node has one parent and is visited at most once). Lists with few overlapping wildcards stay
+// close to ATR length, lookup never exceeds trie size whatever the ATR.
+static int32_t pcscAtrWalk (int32_t node, const BYTE *atr, ulong len) {
+    const pcscAtrNodeT *current= &pcscAtrNodes[node];
+    int32_t model;
+
+    if (!len) return current->model;
+
+    // binary search exact byte within sorted edges
+    int32_t low= current->first, high= current->first + current->count -1;
+    while (low <= high) {
+        int32_t mid= (low + high) / 2;
+        if (pcscAtrEdges[mid].byte == atr[0]) {
+            model= pcscAtrWalk (pcscAtrEdges[mid].child, atr+1, len-1);
+            if (model >= 0) return model;
+            break;
+        }
+        if (pcscAtrEdges[mid].byte < atr[0]) low= mid+1;
+        else high= mid-1;
     }
 
-    return atrUid;
+    if (current->any < 0) return -1;
+    return pcscAtrWalk (current->any, atr+1, len-1);
+}
+
+// search ATR within database, return NULL when unknown
+const pcscCardModelT *pcscAtrLookup (const u_int8_t *atr, ulong atrLen) {
+    int32_t model;
+
+    if (!atrLen || atrLen > MAX_ATR_SIZE) return NULL;
+    model= pcscAtrWalk (0, atr, atrLen);
+    if (model < 0) return NULL;
+    return &pcscAtrModels[model];
+}
+
+// return current card model (NULL when no card or unknown ATR)
+const pcscCardModelT *pcscCardModel (pcscHandleT *handle) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    return handle->model;
+}
+
+// search cardId within ATR database
+static atrCardidEnumT isoAtrParseCard (pcscHandleT *handle, BYTE *buffer, DWORD len) {
+
+    handle->model= pcscAtrLookup (buffer, len);
+    if (!handle->model) {
+        handle->error= "pcsc unsupported ATR smartcard model";
+        goto OnErrorExit;
+    }
+    if (handle->model->cardId == ATR_UNKNOWN) {
+        handle->error= "pcsc ATR smartcard model has no supported family";
+        EXT_NOTICE ("[pcsc-atr-unsupported] reader=%s model=%s (%s)", handle->readerName, handle->model->label, handle->model->info);
+        goto OnErrorExit;
+    }
+    if (handle->verbose) fprintf (stderr, " -- atr model=%s (%s)\n", handle->model->label, handle->model->info);
+    return handle->model->cardId;
 
 OnErrorExit:
-    handle->error= "pcsc unsupported ATR smartcard model";
     return ATR_UNKNOWN;
 }
 
@@ -232,174 +1007,2222 @@ static u_int64_t pcscGetCardUuidNum (pcscHandleT *handle) {
 
     rv= pcscReadUuid (handle, "uuid", receiveBuffer, &receiveLength);
     if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+
+    // keep raw uid for key diversification
+    handle->cardUidLen= (u_int8_t)(receiveLength-2 < PCSC_CARD_UID_MAX ? receiveLength-2 : PCSC_CARD_UID_MAX);
+    memcpy (handle->cardUid, receiveBuffer, handle->cardUidLen);
+
     for (int idx= 0; idx != receiveLength-2; idx++) {
         uuid <<= 8;
         uuid |= (u_int64_t)receiveBuffer[idx];
     }
+    PCSC_PROBE (uid__read, handle->readerName, uuid, handle->cardUidLen);
     return uuid;
 
 OnErrorExit:
     return 0;
 }
 
-static long pcscAuthSCard (pcscHandleT *handle, const char *uid, u_int8_t secIdx, u_int8_t blkIdx, ulong dataLen, const pcscKeyT *key, ulong *blkSector, ulong *blkLength) {
+// send a raw card command through reader direct transmit (PN532 InCommunicateThru)
+// on success response payload is moved at respBuf[0] and respLen is payload length
+static long pcscThru (pcscHandleT *handle, const char *uid, const char *action, const BYTE *cmd, ulong cmdLen, BYTE *respBuf, ulong *respLen) {
+    BYTE thruCmd[7+cmdLen];
     long rv;
-    u_int8_t *keyVal;
-    u_int8_t keyIdx;
-    BYTE status[32];
 
-    switch (handle->cardId) {
+    // Lc is one byte and includes D4 42 header
+    if (cmdLen > 253) {
+        handle->error= "Reader direct transmit command too long (max 253)";
+        rv= SCARD_E_INVALID_PARAMETER;
+        goto OnErrorExit;
+    }
 
-        case ATR_MIFARE_1K:
-        case ATR_MIFARE_4K:
+    thruCmd[0]=0xFF; thruCmd[1]=0x00; thruCmd[2]=0x00; thruCmd[3]=0x00;
+    thruCmd[4]=(BYTE)(cmdLen+2); thruCmd[5]=0xD4; thruCmd[6]=0x42;
+    memcpy (&thruCmd[7], cmd, cmdLen);
 
-            *blkSector=4L; // mifare classic block/sector organisation
-            *blkLength=16L;   // fixe block size
+    rv= pcscSendCmd (handle, uid, action, thruCmd, sizeof(thruCmd), respBuf, respLen);
+    if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
 
-            // mifare only use block index
-            if (secIdx) {
-                //blkIdx= (u_int8_t)((secIdx*4) + blkIdx);
-                blkIdx= (u_int8_t)(secIdx*4); // authent is per page
-                secIdx= 0;
-            }
+    // response D5 43 <status> <payload> 90 00
+    if (*respLen < 3+PCSC_MIFARE_STATUS_LEN || respBuf[0] != 0xD5 || respBuf[1] != 0x43 || respBuf[2] != 0x00) {
+        handle->error= "Reader direct transmit refused";
+        rv= SCARD_STATE_INUSE;
+        goto OnErrorExit;
+    }
+    *respLen -= 3+PCSC_MIFARE_STATUS_LEN;
+    memmove (respBuf, &respBuf[3], *respLen);
+    return SCARD_S_SUCCESS;
 
-            // assert request is possible
-            if (dataLen > 48 || dataLen % 16) {
-                handle->error= "Invalid MIFARE_CLASSIC dlen should 16*x where x=1-3.";
-                goto OnErrorExit;
-            }
+OnErrorExit:
+    return rv;
+}
 
-            if (!key) {
-                keyVal= defaultKey;
-                keyIdx =0; // keyA
-            }
-            else {
-                if (key->klen != 6) {
-                    handle->error= "Invalid MIFARE_CLASSIC keyken should 6";
-                    goto OnErrorExit;
-                }
-                keyVal= key->kval;
-                keyIdx= key->kidx;
+// detect type-2 geometry once per card
+static const pcscT2ModelT *pcscT2Model (pcscHandleT *handle, const char *uid) {
+    BYTE versionCmd[]= {0x60};
+    BYTE version[32];
+    ulong vlen= sizeof(version);
+    long rv;
+
+    if (handle->t2Model) return handle->t2Model;
+    handle->t2Model= &pcscT2Legacy;
+
+    rv= pcscThru (handle, uid, "get-version", versionCmd, sizeof(versionCmd), version, &vlen);
+    if (rv != SCARD_S_SUCCESS) {
+        // legacy Ultralight NAK GET_VERSION and fall back to idle, wake it up
+        pcscBackend->reconnect (handle->hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, SCARD_RESET_CARD, &handle->activeProtocol);
+
+        // page 16 only exists on Ultralight-C, plain Ultralight NAK it
+        BYTE probeCmd[] = {0xFF, 0xB0, 0x00, (BYTE)pcscT2Legacy.pages, PCSC_T2_READ_PAGES*PCSC_T2_PAGE_LEN};
+        vlen= sizeof(version);
+        rv= pcscSendCmd (handle, uid, "probe", probeCmd, sizeof(probeCmd), version, &vlen);
+        if (rv == SCARD_S_SUCCESS && vlen == PCSC_T2_READ_PAGES*PCSC_T2_PAGE_LEN+PCSC_MIFARE_STATUS_LEN) {
+            handle->t2Model= &pcscT2LegacyC;
+        } else {
+            pcscBackend->reconnect (handle->hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, SCARD_RESET_CARD, &handle->activeProtocol);
+        }
+        goto OnExit;
+    }
+
+    // 00 04 <type> <subtype> <major> <minor> <storage> 03
+    if (vlen >= 7) {
+        for (int idx=0; pcscT2Models[idx].label; idx++) {
+            if (pcscT2Models[idx].storage == version[6]) {
+                handle->t2Model= &pcscT2Models[idx];
+                break;
             }
-            BYTE keyCmd[] = {0xFF, 0x82, 0x00, 0x00, 0x06, keyVal[0], keyVal[1], keyVal[2], keyVal[3], keyVal[4], keyVal[5]};
-            ulong keyStatusLen= sizeof(status);
-            rv= pcscSendCmd (handle, uid, "key", keyCmd, sizeof(keyCmd), status, &keyStatusLen);
-            if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+        }
+    }
 
-            // send authentication block
-            BYTE authCmd[] = {0xFF, 0x86, 0x00, 0x00, 0x05, 0x01, secIdx, blkIdx, 0x60|keyIdx, 0x00};
-            ulong authStatusLen= sizeof(status);
-            rv= pcscSendCmd (handle, uid, "authent", authCmd, sizeof(authCmd), status, &authStatusLen);
-            if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+OnExit:
+    if (handle->verbose) fprintf (stderr, " -- type-2 model=%s pages=%d fast-read=%d\n", handle->t2Model->label, handle->t2Model->pages, handle->t2Model->fastRead);
+    return handle->t2Model;
+}
 
-            break;
+// type-2 read: FAST_READ page range when supported, else READ (4 pages per exchange)
+static long pcscT2Read (pcscHandleT *handle, const char *uid, u_int16_t page, u_int8_t *data, ulong dataLen) {
+    const pcscT2ModelT *model= pcscT2Model (handle, uid);
+    BYTE resp[3 + PCSC_T2_FAST_PAGES*PCSC_T2_PAGE_LEN + PCSC_MIFARE_STATUS_LEN];
+    ulong npages= dataLen / PCSC_T2_PAGE_LEN;
+    ulong dataIdx=0;
+    long rv;
 
-        case ATR_MIFARE_UL:
+    if (dataLen % PCSC_T2_PAGE_LEN || page + npages > model->pages) {
+        handle->error= "Invalid MIFARE_UL read (dlen should be mod/4 and within card pages)";
+        goto OnErrorExit;
+    }
+
+    while (dataIdx < dataLen) {
+        ulong count= (dataLen - dataIdx) / PCSC_T2_PAGE_LEN;
+        ulong rlen= sizeof(resp);
+
+        if (model->fastRead) {
+            if (count > PCSC_T2_FAST_PAGES) count= PCSC_T2_FAST_PAGES;
+            BYTE fastCmd[]= {0x3A, (BYTE)page, (BYTE)(page+count-1)};
+            rv= pcscThru (handle, uid, "fast-read", fastCmd, sizeof(fastCmd), resp, &rlen);
+            if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+        } else {
+            // READ always returns 4 pages (rolling over at end of memory)
+            BYTE readCmd[] = {0xFF, 0xB0, 0x00, (BYTE)page, PCSC_T2_READ_PAGES*PCSC_T2_PAGE_LEN};
+            rv= pcscSendCmd (handle, uid, "read", readCmd, sizeof(readCmd), resp, &rlen);
+            if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+            rlen -= PCSC_MIFARE_STATUS_LEN;
+            if (count > PCSC_T2_READ_PAGES) count= PCSC_T2_READ_PAGES;
+        }
+
+        if (rlen < count*PCSC_T2_PAGE_LEN) {
+            handle->error= "NFC type-2 read short response";
+            goto OnErrorExit;
+        }
+        memcpy (&data[dataIdx], resp, count*PCSC_T2_PAGE_LEN);
+        dataIdx += count*PCSC_T2_PAGE_LEN;
+        page    += (u_int16_t)count;
+    }
+    return 0;
+
+OnErrorExit:
+    return -1;
+}
+
+// type-2 write: card only supports one page per WRITE, pages are sent back to back
+static long pcscT2Write (pcscHandleT *handle, const char *uid, u_int16_t page, const u_int8_t *data, ulong dataLen) {
+    const pcscT2ModelT *model= pcscT2Model (handle, uid);
+    BYTE writeCmd[]= {0xFF, 0xD6, 0x00, 0x00, PCSC_T2_PAGE_LEN, 0,0,0,0};
+    BYTE status[16];
+    long rv;
+
+    if (dataLen % PCSC_T2_PAGE_LEN || page + dataLen/PCSC_T2_PAGE_LEN > model->pages) {
+        handle->error= "Invalid MIFARE_UL write (dlen should be mod/4 and within card pages)";
+        goto OnErrorExit;
+    }
+
+    for (ulong dataIdx=0; dataIdx < dataLen; dataIdx += PCSC_T2_PAGE_LEN, page++) {
+        ulong slen= sizeof(status);
+        writeCmd[3]= (BYTE)page;
+        memcpy (&writeCmd[5], &data[dataIdx], PCSC_T2_PAGE_LEN);
+        rv= pcscSendCmd (handle, uid, "write", writeCmd, sizeof(writeCmd), status, &slen);
+        if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+    }
+    return 0;
+
+OnErrorExit:
+    return -1;
+}
+
+// FeliCa IDm is required within every command frame, read it once per card
+static long pcscFelicaIdm (pcscHandleT *handle, const char *uid) {
+    BYTE idmCmd[] = {0xFF, 0xCA, 0x00, 0x00, 0x00};
+    BYTE idm[PCSC_FELICA_IDM_LEN + PCSC_MIFARE_STATUS_LEN];
+    ulong ilen= sizeof(idm);
+    long rv;
+
+    if (handle->felicaIdm[0]) return SCARD_S_SUCCESS;
+    rv= pcscSendCmd (handle, uid, "felica-idm", idmCmd, sizeof(idmCmd), idm, &ilen);
+    if (rv != SCARD_S_SUCCESS) return rv;
+    if (ilen != PCSC_FELICA_IDM_LEN + PCSC_MIFARE_STATUS_LEN) {
+        handle->error= "FeliCa invalid IDm";
+        return -1;
+    }
+    memcpy (handle->felicaIdm, idm, PCSC_FELICA_IDM_LEN);
+    return SCARD_S_SUCCESS;
+}
+
+// one FeliCa Read/Write Without Encryption exchange, blocks [first,first+count[ of every service.
+// frame: len cmd IDm nsvc svc(le)... nblk blklist [data], blocklist uses 2 or 3 bytes elements
+static long pcscFelicaExchange (pcscHandleT *handle, const char *uid, int write, const u_int16_t *svcs, int nsvc, u_int16_t first, int count, u_int8_t *data) {
+    BYTE frame[255];
+    BYTE resp[3 + 13 + PCSC_FELICA_READ_MAX*PCSC_FELICA_BLK_LEN + PCSC_MIFARE_STATUS_LEN];
+    ulong rlen= sizeof(resp);
+    ulong idx=1;
+    int nblk= nsvc*count;
+    long rv;
+
+    if (!write && nblk > PCSC_FELICA_READ_MAX) goto OnRefusedExit;
+
+    frame[idx++]= write ? 0x08 : 0x06;
+    memcpy (&frame[idx], handle->felicaIdm, PCSC_FELICA_IDM_LEN);
+    idx += PCSC_FELICA_IDM_LEN;
+    frame[idx++]= (BYTE)nsvc;
+    for (int svc=0; svc < nsvc; svc++) {
+        frame[idx++]= (BYTE)(svcs[svc] & 0xFF);
+        frame[idx++]= (BYTE)(svcs[svc] >> 8);
+    }
+    frame[idx++]= (BYTE)nblk;
+    for (int svc=0; svc < nsvc; svc++) {
+        for (int blk=0; blk < count; blk++) {
+            u_int16_t num= (u_int16_t)(first + blk);
+            if (num <= 0xFF) {
+                frame[idx++]= (BYTE)(0x80 | svc);
+                frame[idx++]= (BYTE)num;
+            } else {
+                frame[idx++]= (BYTE)svc;
+                frame[idx++]= (BYTE)(num & 0xFF);
+                frame[idx++]= (BYTE)(num >> 8);
+            }
+        }
+    }
+    if (write) {
+        if (idx + nblk*PCSC_FELICA_BLK_LEN > sizeof(frame)) goto OnRefusedExit;
+        memcpy (&frame[idx], data, nblk*PCSC_FELICA_BLK_LEN);
+        idx += nblk*PCSC_FELICA_BLK_LEN;
+    }
+    frame[0]= (BYTE)idx;
+
+    rv= pcscThru (handle, uid, write ? "felica-write" : "felica-read", frame, idx, resp, &rlen);
+    if (rv != SCARD_S_SUCCESS) goto OnRefusedExit;
+
+    // len rsp IDm status1 status2 [nblk data]
+    if (rlen < 12 || resp[1] != frame[1]+1 || resp[10] != 0x00) {
+        handle->error= "FeliCa command refused (status flags)";
+        goto OnRefusedExit;
+    }
+    if (!write) {
+        if (rlen < 13 + (ulong)nblk*PCSC_FELICA_BLK_LEN || resp[12] != nblk) {
+            handle->error= "FeliCa read short response";
+            goto OnRefusedExit;
+        }
+        memcpy (data, &resp[13], nblk*PCSC_FELICA_BLK_LEN);
+    }
+    return SCARD_S_SUCCESS;
+
+OnRefusedExit:
+    return -1;
+}
+
+// FeliCa multi-service/multi-block transfer. Blocks [first,first+dataLen/16/nsvc[ are transferred
+// for every service (data is service after service). Each request carries as many blocks as the
+// card accepts, on refusal the per card limit is halved and request is retried.
+static long pcscFelicaTransfer (pcscHandleT *handle, const char *uid, int write, const u_int16_t *svcs, int nsvc, u_int16_t first, u_int8_t *data, ulong dataLen) {
+    int *limit= write ? &handle->felicaWriteMax : &handle->felicaReadMax;
+    ulong blocks;
+    long rv;
+
+    if (handle->cardId != ATR_FELICA_212K && handle->cardId != ATR_FELICA_424K) {
+        handle->error= "FeliCa transfer requires FELICA smartcard";
+        goto OnErrorExit;
+    }
+    if (nsvc < 1 || nsvc > PCSC_FELICA_SVC_MAX || (!write && nsvc > PCSC_FELICA_READ_MAX) || dataLen % (PCSC_FELICA_BLK_LEN*nsvc)) {
+        handle->error= "Invalid FELICA (dlen should be 16*blocks*services)";
+        goto OnErrorExit;
+    }
+    blocks= dataLen / PCSC_FELICA_BLK_LEN / nsvc;
+
+    rv= pcscFelicaIdm (handle, uid);
+    if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+    if (*limit < 1) *limit= write ? PCSC_FELICA_WRITE_MAX : PCSC_FELICA_READ_MAX;
+
+    for (ulong done=0; done < blocks; ) {
+        ulong count= (ulong)(*limit / nsvc);
+        if (count < 1) count= 1;
+        if (count > blocks - done) count= blocks - done;
+
+        // request data is grouped by service, gather/scatter from caller layout
+        BYTE chunk[nsvc*count*PCSC_FELICA_BLK_LEN];
+        if (write) {
+            for (int svc=0; svc < nsvc; svc++) {
+                memcpy (&chunk[svc*count*PCSC_FELICA_BLK_LEN], &data[(svc*blocks + done)*PCSC_FELICA_BLK_LEN], count*PCSC_FELICA_BLK_LEN);
+            }
+        }
+
+        if (*limit >= nsvc) {
+            rv= pcscFelicaExchange (handle, uid, write, svcs, nsvc, (u_int16_t)(first + done), (int)count, chunk);
+            if (rv != SCARD_S_SUCCESS && (count > 1 || nsvc > 1)) {
+                *limit= (int)(count*nsvc) / 2;
+                if (handle->verbose) fprintf (stderr, " -- felica %s limit=%d blocks\n", write ? "write" : "read", *limit);
+                continue;
+            }
+        } else {
+            // card refuses one block of every service, send services one by one
+            for (int svc=0; svc < nsvc; svc++) {
+                rv= pcscFelicaExchange (handle, uid, write, &svcs[svc], 1, (u_int16_t)(first + done), 1, &chunk[svc*PCSC_FELICA_BLK_LEN]);
+                if (rv != SCARD_S_SUCCESS) break;
+            }
+        }
+        if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+
+        if (!write) {
+            for (int svc=0; svc < nsvc; svc++) {
+                memcpy (&data[(svc*blocks + done)*PCSC_FELICA_BLK_LEN], &chunk[svc*count*PCSC_FELICA_BLK_LEN], count*PCSC_FELICA_BLK_LEN);
+            }
+        }
+        done += count;
+    }
+    return SCARD_S_SUCCESS;
+
+OnErrorExit:
+    return -1;
+}
+
+int pcscFelicaRead (pcscHandleT *handle, const char *uid, const u_int16_t *svcs, int nsvc, u_int16_t blkIdx, u_int8_t *data, ulong dataLen)
+{
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    long rv;
+
+    if (handle->verbose) fprintf (stderr, "\n# pcscFelicaRead reader=%s cmd=%s svc=%d blk=%d dlen=%ld\n", handle->readerName, uid, nsvc, blkIdx, dataLen);
+    rv= pcscFelicaTransfer (handle, uid, 0, svcs, nsvc, blkIdx, data, dataLen);
+    if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+    return 0;
+
+OnErrorExit:
+    EXT_DEBUG ("[pcsc-felica-fail] cmd=%s action=read err=%s", uid, handle->error);
+    return -1;
+}
+
+int pcscFelicaWrite (pcscHandleT *handle, const char *uid, const u_int16_t *svcs, int nsvc, u_int16_t blkIdx, const u_int8_t *data, ulong dataLen)
+{
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    long rv;
+
+    if (handle->verbose) fprintf (stderr, "\n# pcscFelicaWrite reader=%s cmd=%s svc=%d blk=%d dlen=%ld\n", handle->readerName, uid, nsvc, blkIdx, dataLen);
+    rv= pcscFelicaTransfer (handle, uid, 1, svcs, nsvc, blkIdx, (u_int8_t*)data, dataLen);
+    if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+    return 0;
+
+OnErrorExit:
+    EXT_DEBUG ("[pcsc-felica-fail] cmd=%s action=write err=%s", uid, handle->error);
+    return -1;
+}
+
+// CMAC subkey derivation: shift left one bit, xor Rb(0x87) when msb was set
+static void pcscCmacShift (BYTE *block) {
+    BYTE msb= block[0] & 0x80;
+    for (int idx=0; idx < PCSC_AES_BLK_LEN-1; idx++) {
+        block[idx]= (BYTE)((block[idx] << 1) | (block[idx+1] >> 7));
+    }
+    block[PCSC_AES_BLK_LEN-1]= (BYTE)(block[PCSC_AES_BLK_LEN-1] << 1);
+    if (msb) block[PCSC_AES_BLK_LEN-1] ^= 0x87;
+}
+
+// NXP AN10922 AES-128 key diversification https://www.nxp.com/docs/en/application-note/AN10922.pdf
+// input M=0x01|uid|sector|sysid is padded to 32 bytes (0x80 0x00...) and CMAC last block is
+// xored with K2 when padded (K1 otherwise). Mifare classic key is the first 6 bytes of result.
+int pcscKeyDiversify (const pcscKeyT *key, const u_int8_t *cardUid, ulong uidLen, u_int8_t sector, u_int8_t *kval, ulong klen) {
+    BYTE msg[2*PCSC_AES_BLK_LEN]={0}, mac[2*PCSC_AES_BLK_LEN];
+    BYTE subKey[PCSC_AES_BLK_LEN]={0}, iv[PCSC_AES_BLK_LEN]={0};
+    EVP_CIPHER_CTX *ctx= NULL;
+    ulong mlen=0;
+    int outLen;
+
+    if (!key || !key->master || klen > PCSC_AES_BLK_LEN || uidLen > PCSC_CARD_UID_MAX || key->slen > PCSC_DIVERSIFY_SYSID_MAX) goto OnErrorExit;
+
+    msg[mlen++]= 0x01; // AES-128 diversification constant
+    memcpy (&msg[mlen], cardUid, uidLen);
+    mlen += uidLen;
+    msg[mlen++]= sector;
+    if (key->slen) {
+        memcpy (&msg[mlen], key->sysid, key->slen);
+        mlen += key->slen;
+    }
+
+    ctx= EVP_CIPHER_CTX_new();
+    if (!ctx) goto OnErrorExit;
+
+    // K0=AES(master,0^128) K1=K0<<1 K2=K1<<1
+    if (!EVP_EncryptInit_ex (ctx, EVP_aes_128_ecb(), NULL, key->master, NULL)) goto OnErrorExit;
+    EVP_CIPHER_CTX_set_padding (ctx, 0);
+    if (!EVP_EncryptUpdate (ctx, subKey, &outLen, subKey, sizeof(subKey))) goto OnErrorExit;
+    pcscCmacShift (subKey);
+    if (mlen < sizeof(msg)) {
+        msg[mlen]= 0x80;
+        pcscCmacShift (subKey);
+    }
+    for (int idx=0; idx < PCSC_AES_BLK_LEN; idx++) msg[PCSC_AES_BLK_LEN+idx] ^= subKey[idx];
+
+    // CBC-MAC with zero iv, diversified key is last cipher block
+    if (!EVP_EncryptInit_ex (ctx, EVP_aes_128_cbc(), NULL, key->master, iv)) goto OnErrorExit;
+    EVP_CIPHER_CTX_set_padding (ctx, 0);
+    if (!EVP_EncryptUpdate (ctx, mac, &outLen, msg, sizeof(msg))) goto OnErrorExit;
+    memcpy (kval, &mac[PCSC_AES_BLK_LEN], klen);
+
+    EVP_CIPHER_CTX_free (ctx);
+    OPENSSL_cleanse (subKey, sizeof(subKey));
+    OPENSSL_cleanse (mac, sizeof(mac));
+    return 0;
+
+OnErrorExit:
+    EVP_CIPHER_CTX_free (ctx);
+    OPENSSL_cleanse (subKey, sizeof(subKey));
+    return -1;
+}
+
+static void pcscDivKeyFlush (pcscHandleT *handle) {
+    pcscDivKeyT *entry, *tmp;
+
+    HASH_ITER (hh, handle->divKeys, entry, tmp) {
+        HASH_DEL (handle->divKeys, entry);
+        OPENSSL_cleanse (entry->kval, sizeof(entry->kval));
+        free (entry);
+    }
+}
+
+// diversified keys are computed once per card session, later authentications only hit the cache
+static const BYTE *pcscDivKeyGet (pcscHandleT *handle, const char *uid, const pcscKeyT *key, u_int8_t sector) {
+    pcscDivKeyIdT id;
+    pcscDivKeyT *entry;
+    int err;
+
+    // card uid is needed as diversification input
+    if (!handle->cardUidLen) {
+        handle->uuid= 0;
+        if (!pcscGetCardUuid (handle) || !handle->cardUidLen) {
+            handle->error= "Fail to read card uid for key diversification";
+            goto OnErrorExit;
+        }
+    }
+
+    memset (&id, 0, sizeof(id)); // hash key includes padding bytes
+    id.uuid= handle->uuid;
+    id.key= key;
+    id.sector= sector;
+    HASH_FIND (hh, handle->divKeys, &id, sizeof(id), entry);
+    if (entry) return entry->kval;
+
+    entry= calloc (1, sizeof(pcscDivKeyT));
+    entry->id= id;
+    err= pcscKeyDiversify (key, handle->cardUid, handle->cardUidLen, sector, entry->kval, sizeof(entry->kval));
+    if (err) {
+        free (entry);
+        handle->error= "Fail to diversify key (check master/sysid)";
+        goto OnErrorExit;
+    }
+    HASH_ADD (hh, handle->divKeys, id, sizeof(entry->id), entry);
+    if (handle->verbose) fprintf (stderr, " -- key=%s sector=%d diversified for uuid=%lx\n", key->uid, sector, handle->uuid);
+    return entry->kval;
+
+OnErrorExit:
+    EXT_DEBUG ("[pcsc-diversify-fail] cmd=%s key=%s sector=%d err=%s", uid, key->uid, sector, handle->error);
+    return NULL;
+}
+
+// mifare classic sector from (sector,block) addressing, 4K sectors 32-39 hold 16 blocks
+static u_int8_t pcscMifareSector (u_int8_t secIdx, u_int8_t blkIdx) {
+    if (secIdx) return secIdx;
+    if (blkIdx < 128) return (u_int8_t)(blkIdx/4);
+    return (u_int8_t)(32 + (blkIdx-128)/16);
+}
+
+// load key within reader and authenticate mifare classic block (NULL key is default keyA)
+static long pcscAuthKey (pcscHandleT *handle, const char *uid, u_int8_t blkIdx, u_int8_t sector, const pcscKeyT *key) {
+    const u_int8_t *keyVal;
+    u_int8_t keyIdx;
+    BYTE status[32];
+    long rv;
+
+    if (!key) {
+        keyVal= defaultKey;
+        keyIdx =0; // keyA
+    }
+    else {
+        if (key->klen != 6) {
+            handle->error= "Invalid MIFARE_CLASSIC keyken should 6";
+            goto OnErrorExit;
+        }
+        keyVal= key->master ? pcscDivKeyGet (handle, uid, key, sector) : key->kval;
+        keyIdx= key->kidx;
+        if (!keyVal) goto OnErrorExit;
+    }
+    BYTE keyCmd[] = {0xFF, 0x82, 0x00, 0x00, 0x06, keyVal[0], keyVal[1], keyVal[2], keyVal[3], keyVal[4], keyVal[5]};
+    ulong keyStatusLen= sizeof(status);
+    rv= pcscSendCmd (handle, uid, "key", keyCmd, sizeof(keyCmd), status, &keyStatusLen);
+    if (rv != SCARD_S_SUCCESS) return rv;
+
+    // send authentication block
+    BYTE authCmd[] = {0xFF, 0x86, 0x00, 0x00, 0x05, 0x01, 0x00, blkIdx, 0x60|keyIdx, 0x00};
+    ulong authStatusLen= sizeof(status);
+    handle->authStats.attempts++;
+    PCSC_PROBE (auth__start, handle->readerName, sector, blkIdx);
+    rv= pcscSendCmd (handle, uid, "authent", authCmd, sizeof(authCmd), status, &authStatusLen);
+    PCSC_PROBE (auth__end, handle->readerName, sector, rv);
+    if (rv == SCARD_STATE_INUSE) handle->authStats.failures++;
+    return rv;
+
+OnErrorExit:
+    return -1;
+}
+
+static void pcscKeyMemoFlush (pcscHandleT *handle) {
+    pcscKeyMemoT *memo, *tmp;
+
+    HASH_ITER (hh, handle->keyMemo, memo, tmp) {
+        HASH_DEL (handle->keyMemo, memo);
+        free (memo);
+    }
+}
+
+static void pcscKeyMemoSet (pcscHandleT *handle, const pcscKeyMemoIdT *id, pcscKeyMemoT *memo, const pcscKeyT *key) {
+    if (!memo) {
+        if (HASH_COUNT (handle->keyMemo) >= PCSC_KEY_MEMO_MAX) pcscKeyMemoFlush (handle);
+        memo= calloc (1, sizeof(pcscKeyMemoT));
+        memo->id= *id;
+        HASH_ADD (hh, handle->keyMemo, id, sizeof(memo->id), memo);
+    }
+    memo->key= key;
+    handle->authStats.learned++;
+}
+
+// try ring keys in order, key which opened (uuid,sector) on a previous access or tap goes first
+static long pcscAuthRing (pcscHandleT *handle, const char *uid, u_int8_t blkIdx, u_int8_t sector, const pcscKeyT *ring) {
+    pcscKeyMemoT *memo= NULL;
+    pcscKeyMemoIdT id;
+    int learned= -1;
+    long rv= -1;
+
+    if (!handle->uuid) pcscGetCardUuid (handle);
+    memset (&id, 0, sizeof(id)); // hash key includes padding bytes
+    id.uuid= handle->uuid;
+    id.sector= sector;
+    if (id.uuid) HASH_FIND (hh, handle->keyMemo, &id, sizeof(id), memo);
+    if (memo) {
+        for (int idx=0; idx < ring->rcount; idx++) {
+            if (ring->ring[idx] == memo->key) learned= idx;
+        }
+    }
+
+    for (int idx=-1; idx < ring->rcount; idx++) {
+        const pcscKeyT *key;
+
+        if (idx < 0) {
+            if (learned < 0) continue;
+            key= ring->ring[learned];
+        } else {
+            if (idx == learned) continue;
+            key= ring->ring[idx];
+        }
+
+        rv= pcscAuthKey (handle, uid, blkIdx, sector, key);
+        if (rv == SCARD_S_SUCCESS) {
+            if (idx < 0) handle->authStats.saved += (ulong)learned;
+            else if (id.uuid) pcscKeyMemoSet (handle, &id, memo, key);
+            if (handle->verbose) fprintf (stderr, " -- ring=%s sector=%d key=%s%s\n", ring->uid, sector, key->uid, idx < 0 ? " (learned)" : "");
+            return rv;
+        }
+
+        // only card refusal moves to next key, failed authentication halts card: reactivate it
+        if (rv != SCARD_STATE_INUSE) goto OnErrorExit;
+        pcscBackend->reconnect (handle->hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, SCARD_RESET_CARD, &handle->activeProtocol);
+    }
+    handle->error= "No key within ring authenticates sector";
+
+OnErrorExit:
+    EXT_DEBUG ("[pcsc-ring-fail] cmd=%s ring=%s sector=%d err=%s", uid, ring->uid, sector, handle->error);
+    return rv;
+}
+
+static long pcscAuthMifare (pcscHandleT *handle, const char *uid, u_int8_t blkIdx, u_int8_t sector, const pcscKeyT *key) {
+    if (key && key->ring) return pcscAuthRing (handle, uid, blkIdx, sector, key);
+    return pcscAuthKey (handle, uid, blkIdx, sector, key);
+}
+
+// restore authentication lost with card reactivation (called from pcscRecover)
+static long pcscReAuth (pcscHandleT *handle, const char *uid) {
+    return pcscAuthMifare (handle, uid, handle->authBlk, handle->authSector, handle->authKey);
+}
+
+const pcscKeyT *pcscNewKeyRing (const char *uid, const pcscKeyT **keys, int count) {
+    pcscKeyT *ring;
+
+    if (count <= 0 || count > PCSC_KEY_RING_MAX) return NULL;
+    ring= calloc (1, sizeof(pcscKeyT));
+    ring->uid= uid;
+    ring->klen= PCSC_MIFARE_KEY_LEN;
+    ring->ring= calloc ((size_t)count, sizeof(pcscKeyT*));
+    for (int idx=0; idx < count; idx++) {
+        if (!keys[idx] || keys[idx]->ring) goto OnErrorExit; // no nested ring
+        ring->ring[idx]= keys[idx];
+    }
+    ring->rcount= (u_int8_t)count;
+    return ring;
+
+OnErrorExit:
+    free (ring->ring);
+    free (ring);
+    return NULL;
+}
+
+void pcscFreeKeyRing (const pcscKeyT *ring) {
+    if (!ring || !ring->ring) return; // plain config key
+    free ((void*)ring->ring);
+    free ((char*)ring->uid);
+    free ((pcscKeyT*)ring);
+}
+
+int pcscAuthStats (pcscHandleT *handle, pcscAuthStatsT *stats) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    *stats= handle->authStats;
+    return 0;
+}
+
+int pcscRetryStats (pcscHandleT *handle, pcscRetryStatsT *stats) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    *stats= handle->retryStats;
+    return 0;
+}
+
+// snapshot is not atomic as a whole, every counter is consistent by itself
+int pcscGetStats (pcscHandleT *handle, pcscStatsT *stats) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+
+    for (int idx=0; idx < PCSC_STAT_COUNT; idx++) {
+        pcscActionCountersT *counters= &handle->stats[idx];
+        pcscActionStatsT *action= &stats->actions[idx];
+
+        action->count= atomic_load_explicit (&counters->count, memory_order_relaxed);
+        action->errors= atomic_load_explicit (&counters->errors, memory_order_relaxed);
+        action->bytesOut= atomic_load_explicit (&counters->bytesOut, memory_order_relaxed);
+        action->bytesIn= atomic_load_explicit (&counters->bytesIn, memory_order_relaxed);
+        action->usecTotal= atomic_load_explicit (&counters->usecTotal, memory_order_relaxed);
+        action->usecMax= atomic_load_explicit (&counters->usecMax, memory_order_relaxed);
+        for (int bucket=0; bucket < PCSC_STATS_BUCKETS; bucket++) {
+            action->hist[bucket]= atomic_load_explicit (&counters->hist[bucket], memory_order_relaxed);
+        }
+    }
+    return 0;
+}
+
+const char *pcscStatLabel (pcscStatActionE action) {
+    if (action >= PCSC_STAT_COUNT) return "unknown";
+    return pcscStatLabels[action];
+}
+
+// upper bound (usec) of histogram bucket holding requested percentile, 0 when empty
+ulong pcscStatsPercentile (const pcscActionStatsT *action, double percent) {
+    ulong total=0, sum=0, target;
+
+    for (int bucket=0; bucket < PCSC_STATS_BUCKETS; bucket++) total += action->hist[bucket];
+    if (!total) return 0;
+
+    target= (ulong)(total * percent / 100.0);
+    if (target < 1) target= 1;
+    for (int bucket=0; bucket < PCSC_STATS_BUCKETS; bucket++) {
+        sum += action->hist[bucket];
+        if (sum >= target) {
+            ulong bound= 1UL << bucket;
+            return (bucket == PCSC_STATS_BUCKETS-1 || bound > action->usecMax) ? action->usecMax : bound;
+        }
+    }
+    return action->usecMax;
+}
+
+// deadline relative to now in ms, 0 clears it
+int pcscSetDeadline (pcscHandleT *handle, pcscDeadlineE scope, ulong ms) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    if (scope >= PCSC_DEADLINE_COUNT) return -1;
+    handle->deadlines[scope]= ms ? pcscNowMs() + ms : 0;
+    return 0;
+}
+
+pcscTokenT *pcscTokenCreate (void) {
+    return calloc (1, sizeof(pcscTokenT));
+}
+
+// callable from any thread (or signal handler)
+void pcscTokenCancel (pcscTokenT *token) {
+    atomic_store (&token->cancelled, 1);
+}
+
+int pcscTokenCancelled (pcscTokenT *token) {
+    return atomic_load (&token->cancelled);
+}
+
+void pcscTokenFree (pcscTokenT *token) {
+    free (token);
+}
+
+// token checked before each command sent until detached (NULL) or reader released
+int pcscSetToken (pcscHandleT *handle, pcscTokenT *token) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    handle->token= token;
+    return 0;
+}
+
+// waiter a is served before waiter b
+static int pcscSchedBefore (const pcscSchedWaiterT *a, const pcscSchedWaiterT *b) {
+    if (a->prio != b->prio) return a->prio < b->prio;
+    if (a->deadline != b->deadline) {
+        if (!a->deadline || !b->deadline) return a->deadline != 0;
+        return a->deadline < b->deadline;
+    }
+    return a->ticket < b->ticket;
+}
+
+static void pcscSchedQueue (pcscHandleT *handle, pcscSchedWaiterT *waiter) {
+    pcscSchedWaiterT **prev= &handle->schedQueue;
+    pcscSchedClassT *stats= &handle->schedStats.classes[waiter->prio];
+
+    while (*prev && !pcscSchedBefore (waiter, *prev)) prev= &(*prev)->next;
+    waiter->next= *prev;
+    *prev= waiter;
+    if (++stats->depth > stats->depthMax) stats->depthMax= stats->depth;
+}
+
+static void pcscSchedUnqueue (pcscHandleT *handle, pcscSchedWaiterT *waiter) {
+    for (pcscSchedWaiterT **prev= &handle->schedQueue; *prev; prev= &(*prev)->next) {
+        if (*prev == waiter) {
+            *prev= waiter->next;
+            break;
+        }
+    }
+    handle->schedStats.classes[waiter->prio].depth--;
+}
+
+// hand reader to first waiter (schedLock held)
+static void pcscSchedNext (pcscHandleT *handle) {
+    pcscSchedWaiterT *waiter= handle->schedQueue;
+
+    if (!waiter) {
+        handle->schedBusy= 0;
+        return;
+    }
+    pcscSchedUnqueue (handle, waiter);
+    waiter->granted= 1;
+    handle->schedPrio= waiter->prio;
+    pthread_cond_broadcast (&handle->schedCond);
+}
+
+// wait for reader, deadline (ms) bounds queue time, 0 waits forever
+int pcscSchedAcquire (pcscHandleT *handle, pcscPrioE prio, ulong deadline) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    if (prio >= PCSC_PRIO_COUNT) prio= PCSC_PRIO_BULK;
+    pcscSchedWaiterT waiter= {.prio=prio};
+    pcscSchedClassT *stats= &handle->schedStats.classes[prio];
+    u_int64_t start= pcscNowUs();
+    ulong waited;
+
+    pthread_mutex_lock (&handle->schedLock);
+    if (!handle->schedBusy) {
+        handle->schedBusy= 1;
+        handle->schedPrio= prio;
+        stats->granted++;
+        pthread_mutex_unlock (&handle->schedLock);
+        return 0;
+    }
+
+    if (deadline) waiter.deadline= start + (u_int64_t)deadline*1000;
+    waiter.ticket= ++handle->schedTicket;
+    pcscSchedQueue (handle, &waiter);
+
+    while (!waiter.granted) {
+        if (!waiter.deadline) {
+            pthread_cond_wait (&handle->schedCond, &handle->schedLock);
+            continue;
+        }
+        struct timespec limit= {.tv_sec= (time_t)(waiter.deadline/1000000), .tv_nsec= (long)(waiter.deadline%1000000)*1000};
+        if (pthread_cond_timedwait (&handle->schedCond, &handle->schedLock, &limit) == ETIMEDOUT && !waiter.granted) {
+            pcscSchedUnqueue (handle, &waiter);
+            stats->expired++;
+            pthread_mutex_unlock (&handle->schedLock);
+            goto OnErrorExit;
+        }
+    }
+
+    waited= (ulong)(pcscNowUs() - start);
+    stats->granted++;
+    stats->waitUsec += waited;
+    if (waited > stats->waitMax) stats->waitMax= waited;
+    pthread_mutex_unlock (&handle->schedLock);
+    return 0;
+
+OnErrorExit:
+    handle->error= "reader scheduler deadline expired";
+    EXT_DEBUG ("[pcsc-sched-expired] reader=%s class=%s deadline=%ldms", handle->readerName, pcscPrioLabels[prio], deadline);
+    return -1;
+}
+
+// called by holder at command/sector boundaries, lets a higher class go first.
+// Return 1 when reader was yielded (card authentication may be lost)
+int pcscSchedYield (pcscHandleT *handle) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    pcscSchedWaiterT waiter= {.ticket=0}; // resumes ahead of its own class
+
+    pthread_mutex_lock (&handle->schedLock);
+    if (!handle->schedQueue || handle->schedQueue->prio >= handle->schedPrio) {
+        pthread_mutex_unlock (&handle->schedLock);
+        return 0;
+    }
+
+    // deadlines and token belong to the holder
+    u_int64_t deadlines[PCSC_DEADLINE_COUNT];
+    pcscTokenT *token= handle->token;
+    memcpy (deadlines, handle->deadlines, sizeof(deadlines));
+    memset (handle->deadlines, 0, sizeof(handle->deadlines));
+    handle->token= NULL;
+
+    waiter.prio= handle->schedPrio;
+    handle->schedStats.classes[waiter.prio].preempted++;
+    pcscSchedNext (handle);
+    pcscSchedQueue (handle, &waiter);
+    while (!waiter.granted) pthread_cond_wait (&handle->schedCond, &handle->schedLock);
+    memcpy (handle->deadlines, deadlines, sizeof(deadlines));
+    handle->token= token;
+    pthread_mutex_unlock (&handle->schedLock);
+    return 1;
+}
+
+int pcscSchedRelease (pcscHandleT *handle) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+
+    pthread_mutex_lock (&handle->schedLock);
+    memset (handle->deadlines, 0, sizeof(handle->deadlines));
+    handle->token= NULL;
+    pcscSchedNext (handle);
+    pthread_mutex_unlock (&handle->schedLock);
+    return 0;
+}
+
+int pcscSchedStats (pcscHandleT *handle, pcscSchedStatsT *stats) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+
+    pthread_mutex_lock (&handle->schedLock);
+    *stats= handle->schedStats;
+    pthread_mutex_unlock (&handle->schedLock);
+    return 0;
+}
+
+const char *pcscPrioLabel (pcscPrioE prio) {
+    if (prio >= PCSC_PRIO_COUNT) return "unknown";
+    return pcscPrioLabels[prio];
+}
+
+pcscErrClassE pcscErrorClass (pcscHandleT *handle) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    return handle->errClass;
+}
+
+const char *pcscErrorClassLabel (pcscErrClassE errClass) {
+    if (errClass > PCSC_ERR_ABORTED) return "unknown";
+    return pcscErrClassLabels[errClass];
+}
+
+static long pcscAuthSCard (pcscHandleT *handle, const char *uid, u_int8_t secIdx, u_int8_t blkIdx, ulong dataLen, const pcscKeyT *key, ulong *blkSector, ulong *blkLength) {
+    long rv;
+
+    switch (handle->cardId) {
+
+        case ATR_MIFARE_1K:
+        case ATR_MIFARE_4K:
+
+            *blkSector=4L; // mifare classic block/sector organisation
+            *blkLength=16L;   // fixe block size
+
+            // mifare only use block index
+            u_int8_t sector= pcscMifareSector (secIdx, blkIdx);
+            if (secIdx) {
+                //blkIdx= (u_int8_t)((secIdx*4) + blkIdx);
+                blkIdx= (u_int8_t)(secIdx*4); // authent is per page
+                secIdx= 0;
+            }
+
+            // assert request is possible
+            if (dataLen > 48 || dataLen % 16) {
+                handle->error= "Invalid MIFARE_CLASSIC dlen should 16*x where x=1-3.";
+                goto OnErrorExit;
+            }
+
+            handle->authActive= 0;
+
+            // a single key refused by a moving card is retried once after reactivation
+            rv= pcscAuthMifare (handle, uid, blkIdx, sector, key);
+            if (rv == SCARD_STATE_INUSE && !(key && key->ring) && handle->retryMax) {
+                handle->retryStats.retries++;
+                usleep (PCSC_RETRY_BACKOFF_US);
+                if (pcscRecover (handle, uid) == 0) {
+                    rv= pcscAuthMifare (handle, uid, blkIdx, sector, key);
+                    if (rv == SCARD_S_SUCCESS) handle->retryStats.recovered++;
+                    else handle->retryStats.exhausted++;
+                }
+            }
+            if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+
+            handle->authActive= 1;
+            handle->authBlk= blkIdx;
+            handle->authSector= sector;
+            handle->authKey= key;
+
+            break;
+
+        case ATR_MIFARE_UL:
             *blkSector=4L; // mifare UL block/sector organisation
             *blkLength=4L; // fixe block size
 
-            // no authentication
-            if ((blkIdx*4 + dataLen) > 38*4L || (dataLen != 4L)) {
-                handle->error= "Invalid MIFARE_UL (dlen should be mod/4)";
-                goto OnErrorExit;
-            }
-            break;
+            // no authentication
+            if (dataLen % PCSC_T2_PAGE_LEN) {
+                handle->error= "Invalid MIFARE_UL (dlen should be mod/4)";
+                goto OnErrorExit;
+            }
+            break;
+
+        default:
+            handle->error="Unsupported smartcard model";
+            goto OnErrorExit;
+    }
+    return SCARD_S_SUCCESS;
+
+OnErrorExit:
+    return -1;
+}
+
+// drop a cached sector, its prefetch commands are wasted when it was never read
+static void pcscReadAheadDrop (pcscHandleT *handle, u_int8_t sector) {
+    u_int32_t bit;
+
+    if (sector >= PCSC_RA_SECTORS) return;
+    bit= 1U << sector;
+    if ((handle->raValid & bit) && !(handle->raUsed & bit)) handle->raStats.wasted += handle->raCost[sector];
+    handle->raValid &= ~bit;
+    handle->raUsed &= ~bit;
+}
+
+// card changed: session cache and pending prefetch are dropped, learned sequences are kept
+static void pcscReadAheadFlush (pcscHandleT *handle) {
+    for (u_int8_t sector=0; sector < PCSC_RA_SECTORS; sector++) pcscReadAheadDrop (handle, sector);
+    handle->raCount= 0;
+    handle->raLast= 0;
+}
+
+static void pcscReadAheadQueue (pcscHandleT *handle, u_int8_t sector, const pcscKeyT *key) {
+    if (sector >= PCSC_RA_SECTORS || (handle->raValid & (1U << sector))) return;
+    for (int idx=0; idx < handle->raCount; idx++) {
+        if (handle->raQueue[idx].sector == sector) return;
+    }
+    if (handle->raCount == PCSC_RA_QUEUE) return;
+    handle->raQueue[handle->raCount++]= (pcscRaQueueT){.sector= sector, .key= key};
+    handle->raStats.queued++;
+}
+
+// learn sector sequence (last successor with a saturating confidence) and queue confident successors
+static void pcscReadAheadLearn (pcscHandleT *handle, u_int8_t sector, const pcscKeyT *key) {
+    int last= handle->raLast -1;
+
+    handle->raKeys[sector]= key;
+    if (last >= 0 && last != sector) {
+        if (handle->raNext[last] == sector+1) {
+            if (handle->raConf[last] < 3) handle->raConf[last]++;
+        } else if (handle->raConf[last]) {
+            handle->raConf[last]--;
+        } else {
+            handle->raNext[last]= (u_int8_t)(sector+1);
+            handle->raConf[last]= 1;
+        }
+    }
+    handle->raLast= sector+1;
+
+    u_int8_t next= sector;
+    for (ulong depth=0; depth < handle->raDepth; depth++) {
+        if (!handle->raNext[next] || handle->raConf[next] < PCSC_RA_CONFIDENT) break;
+        next= (u_int8_t)(handle->raNext[next] -1);
+        if (next == sector) break;
+        pcscReadAheadQueue (handle, next, handle->raKeys[next]);
+    }
+}
+
+// serve a read from session cache, blocks are the ones pcscReadBlock would request to card. A sector
+// prefetched with another key is not served: the card would check the read key, the cache does not
+static int pcscReadAheadCopy (pcscHandleT *handle, u_int8_t secIdx, u_int8_t blkIdx, u_int8_t *data, ulong dataLen, const pcscKeyT *key) {
+    ulong dlen= dataLen - PCSC_MIFARE_STATUS_LEN;
+    ulong dataIdx=0;
+
+    if (dataLen <= PCSC_MIFARE_STATUS_LEN || dlen > 48 || dlen % 16) return -1;
+    for (ulong idx=blkIdx%4; (idx<4 && dataIdx < dlen); idx++, dataIdx += 16) {
+        ulong block= (ulong)secIdx*4 + blkIdx - blkIdx%4 + idx;
+        if (block >= PCSC_RA_SECTORS*4 || block%4 == 3 || !(handle->raValid & (1U << (block/4)))) return -1;
+        if (handle->raKeyUsed[block/4] != key) return -1;
+    }
+
+    dataIdx=0;
+    for (ulong idx=blkIdx%4; (idx<4 && dataIdx < dlen); idx++, dataIdx += 16) {
+        ulong block= (ulong)secIdx*4 + blkIdx - blkIdx%4 + idx;
+        memcpy (&data[dataIdx], handle->raBlocks[block], 16);
+        handle->raUsed |= 1U << (block/4);
+    }
+    data[dataIdx]='\0';
+    return 0;
+}
+
+// authenticate and read sector data blocks into session cache
+static long pcscReadAheadSector (pcscHandleT *handle, const char *uid, u_int8_t sector, const pcscKeyT *key) {
+    u_int8_t buffer[16 + PCSC_MIFARE_STATUS_LEN];
+    ulong apdus= handle->raStats.apdus;
+    ulong blkSector, blkLength, dlen;
+    long rv;
+
+    handle->raActive= 1;
+    rv= pcscAuthSCard (handle, uid, sector, 0, 48, key, &blkSector, &blkLength);
+    for (u_int8_t idx=0; rv == SCARD_S_SUCCESS && idx < 3; idx++) {
+        u_int8_t block= (u_int8_t)(sector*4 + idx);
+        BYTE readBlk[] = {0xFF, 0xB0, 0x00, block, 16};
+        dlen= sizeof(buffer);
+        rv= pcscSendCmd (handle, uid, "read", readBlk, sizeof(readBlk), buffer, &dlen);
+        if (rv == SCARD_S_SUCCESS) memcpy (handle->raBlocks[block], buffer, 16);
+    }
+    handle->raActive= 0;
+    handle->raCost[sector]= handle->raStats.apdus - apdus;
+
+    if (rv != SCARD_S_SUCCESS) {
+        // refused authentication halts card, reactivate it for next command
+        if (handle->errClass == PCSC_ERR_AUTH) {
+            pcscBackend->reconnect (handle->hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, SCARD_RESET_CARD, &handle->activeProtocol);
+            handle->authActive= 0;
+        }
+        handle->raStats.wasted += handle->raCost[sector];
+        EXT_DEBUG ("[pcsc-readahead-fail] cmd=%s sector=%d err=%s", uid, sector, handle->error);
+        return rv;
+    }
+    handle->raValid |= 1U << sector;
+    handle->raKeyUsed[sector]= key;
+    handle->raStats.prefetched++;
+    return rv;
+}
+
+// queue declared successors of current access, prefetched by pcscReadAhead. Return queued sectors
+int pcscReadAheadHint (pcscHandleT *handle, const u_int8_t *sectors, int count, const pcscKeyT *key) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+
+    handle->raEnabled= 1;
+    if (handle->cardId != ATR_MIFARE_1K && handle->cardId != ATR_MIFARE_4K) return 0;
+    for (int idx=0; idx < count; idx++) pcscReadAheadQueue (handle, sectors[idx], key);
+    return handle->raCount;
+}
+
+// prefetch up to max queued sectors while application is not using the card (max=0 returns
+// queued sectors). Return prefetched sectors or -1 when card is gone or work was aborted
+int pcscReadAhead (pcscHandleT *handle, const char *uid, int max) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    int count=0;
+
+    if (!max || !handle->hCard) return handle->hCard ? handle->raCount : 0;
+    while (handle->raCount && count < max) {
+        pcscRaQueueT entry= handle->raQueue[0];
+        handle->raCount--;
+        memmove (&handle->raQueue[0], &handle->raQueue[1], (size_t)handle->raCount * sizeof(pcscRaQueueT));
+        if (handle->raValid & (1U << entry.sector)) continue;
+
+        if (pcscReadAheadSector (handle, uid, entry.sector, entry.key) != SCARD_S_SUCCESS) {
+            if (handle->errClass == PCSC_ERR_CARD_GONE || handle->errClass == PCSC_ERR_ABORTED) return -1;
+            continue;
+        }
+        count++;
+    }
+    return count;
+}
+
+int pcscReadAheadStats (pcscHandleT *handle, pcscReadAheadStatsT *stats) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    *stats= handle->raStats;
+    return 0;
+}
+
+// try to read data bloc
+int pcscReadBlock (pcscHandleT *handle, const char *uid,  u_int8_t secIdx, u_int8_t blkIdx, u_int8_t *data, ulong dataLen, const pcscKeyT *key)
+{
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    long rv=0;
+    ulong blkSector, blkLength;
+    ulong dlen;
+
+    pcscTraceRecord (handle, PCSC_TRACE_BLOCK, uid, 0, (ulong)(secIdx << 8 | blkIdx), NULL, dataLen, NULL);
+
+    // FeliCa blocks through default random service (no authentication)
+    if (handle->cardId == ATR_FELICA_212K || handle->cardId == ATR_FELICA_424K) {
+        rv= pcscFelicaRead (handle, uid, &felicaDfltReadSvc, 1, (u_int16_t)(secIdx*4 + blkIdx), data, dataLen-PCSC_MIFARE_STATUS_LEN);
+        if (rv) goto OnErrorExit;
+        data[dataLen-PCSC_MIFARE_STATUS_LEN]='\0';
+        return 0;
+    }
+
+    // Mifare classic: learn access sequence, prefetched sectors are served from session cache
+    if (handle->raEnabled && (handle->cardId == ATR_MIFARE_1K || handle->cardId == ATR_MIFARE_4K)) {
+        u_int8_t sector= pcscMifareSector (secIdx, blkIdx);
+        int cached= pcscReadAheadCopy (handle, secIdx, blkIdx, data, dataLen, key) == 0;
+        if (sector < PCSC_RA_SECTORS) pcscReadAheadLearn (handle, sector, key);
+        if (cached) {
+            handle->raStats.hits++;
+            return 0;
+        }
+        handle->raStats.misses++;
+    }
+
+    rv= pcscAuthSCard (handle, uid, secIdx, blkIdx, dataLen-PCSC_MIFARE_STATUS_LEN, key, &blkSector, &blkLength);
+    if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+
+    // type-2 pages are not bounded by sector
+    if (handle->cardId == ATR_MIFARE_UL) {
+        dlen= dataLen-PCSC_MIFARE_STATUS_LEN;
+        rv= pcscT2Read (handle, uid, (u_int16_t)(secIdx*4 + blkIdx), data, dlen);
+        if (rv) goto OnErrorExit;
+        data[dlen]='\0';
+        return 0;
+    }
+
+    // try to read bloc
+    ulong dataIdx=0;
+    for (ulong idx=blkIdx%blkSector; (idx<blkSector && dataIdx < dataLen-PCSC_MIFARE_STATUS_LEN); idx++) {
+        mifareSecBlkT sIdx;
+        sIdx.u16= (u_int16_t)(secIdx*4 + blkIdx - blkIdx%blkSector + idx);
+
+        dlen = blkLength + PCSC_MIFARE_STATUS_LEN;  // add cmd status to buffer size
+        u_int8_t readBlk[] = {0xFF, 0xB0, sIdx.u8[1], sIdx.u8[0], (u_int8_t)blkLength};
+        rv= pcscSendCmd (handle, uid, "read", readBlk, sizeof(readBlk), &data[dataIdx], &dlen);
+        if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+
+        // move to new block if any
+        dataIdx += blkLength;
+    }
+    return 0;
+
+OnErrorExit:
+    if (handle->verbose) fprintf (stderr, " -- read sec=%d blk=%d error=%s\n", secIdx, blkIdx, handle->error);
+    if (handle->errClass == PCSC_ERR_AUTH) pcscTraceError (handle);
+    EXT_DEBUG ("[pcsc-readblk-fail] cmd=%s action:read err=%s", uid, handle->error);
+    return -1;
+}
+
+
+// try to read data bloc
+int pcsWriteBlock (pcscHandleT *handle, const char *uid,  u_int8_t secIdx, u_int8_t blkIdx, u_int8_t *dataBuf, ulong dataLen, const pcscKeyT *key)
+{
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    long rv=0;
+    ulong blkSector, blkLength;
+
+    if (handle->verbose) fprintf (stderr, "\n# pcsWriteBlock reader=%s cmd=%s scard=%ld sec=%d blk=%d dlen=%ld\n", handle->readerName, uid, handle->uuid, secIdx, blkIdx, dataLen);
+    if (handle->cardId == ATR_FELICA_212K || handle->cardId == ATR_FELICA_424K) {
+        rv= pcscFelicaWrite (handle, uid, &felicaDfltWriteSvc, 1, (u_int16_t)(secIdx*4 + blkIdx), dataBuf, dataLen);
+        if (rv) goto OnErrorExit;
+        return 0;
+    }
+
+    rv= pcscAuthSCard (handle, uid, secIdx, blkIdx, dataLen, key, &blkSector, &blkLength);
+    if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+
+    if (handle->cardId == ATR_MIFARE_UL) {
+        rv= pcscT2Write (handle, uid, (u_int16_t)(secIdx*4 + blkIdx), dataBuf, dataLen);
+        if (rv) goto OnErrorExit;
+        return 0;
+    }
+
+    // Write is done by block within one sector
+    ulong dataIdx=0;
+    for (ulong idx=blkIdx%blkSector; (idx<blkSector && dataIdx < dataLen); idx++) {
+
+        mifareSecBlkT sIdx;
+        sIdx.u16= (u_int16_t)(secIdx*4 + blkIdx - blkIdx%blkSector + idx);
+        if (sIdx.u16 < PCSC_RA_SECTORS*4) pcscReadAheadDrop (handle, (u_int8_t)(sIdx.u16/4));
+
+        BYTE writeCmd[] = {0xFF, 0xD6, sIdx.u8[1], sIdx.u8[0], (u_int8_t)blkLength};
+        BYTE bufferRqt[blkLength+sizeof(writeCmd)];
+        memcpy (&bufferRqt[0], writeCmd, sizeof(writeCmd));
+        memcpy (&bufferRqt[sizeof(writeCmd)], &dataBuf[dataIdx], blkLength);
+        ulong length= blkLength+sizeof(writeCmd);
+
+        rv= pcscSendCmd (handle, uid, "write", bufferRqt, sizeof(bufferRqt), dataBuf, &length);
+        if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+
+        // move to new block if any
+        dataIdx += blkLength;
+    }
+
+    return 0;
+
+OnErrorExit:
+    if (handle->errClass == PCSC_ERR_AUTH) pcscTraceError (handle);
+    EXT_DEBUG("[pcsc-writeblk-fail] cmd=%s action=write err=%s", uid, handle->error);
+    return -1;
+}
+
+// build an ISO7816-4 apdu, extended length is used when data or le does not fit short apdu.
+// le=0 means no response expected, le=256 (short) or le=65536 (extended) are encoded as 0.
+// return apdu length or -1 when buffer is too small.
+long pcscApduBuild (u_int8_t *apdu, ulong size, u_int8_t cla, u_int8_t ins, u_int8_t p1, u_int8_t p2, const u_int8_t *data, ulong dataLen, ulong le)
+{
+    int extended= (dataLen > 255 || le > 256);
+    ulong idx=0;
+
+    if (dataLen > 65535 || le > 65536) goto OnErrorExit;
+    if (size < 4 + dataLen + (extended ? 5 : 2)) goto OnErrorExit;
+
+    apdu[idx++]= cla;
+    apdu[idx++]= ins;
+    apdu[idx++]= p1;
+    apdu[idx++]= p2;
+
+    if (extended) {
+        apdu[idx++]= 0x00;
+        if (dataLen) {
+            apdu[idx++]= (u_int8_t)(dataLen >> 8);
+            apdu[idx++]= (u_int8_t)dataLen;
+        }
+    } else if (dataLen) {
+        apdu[idx++]= (u_int8_t)dataLen;
+    }
+
+    if (dataLen) {
+        memcpy (&apdu[idx], data, dataLen);
+        idx += dataLen;
+    }
+
+    if (le) {
+        if (extended) apdu[idx++]= (u_int8_t)(le >> 8);
+        apdu[idx++]= (u_int8_t)le;
+    }
+    return (long)idx;
+
+OnErrorExit:
+    return -1;
+}
+
+// ISO14443-4 bitrates (PN53x BR code is index), fallback after consecutive errors
+static const int pcscBitrates[] = {106, 212, 424, 848};
+#define PCSC_BITRATE_ERR_MAX 3
+
+// return PN53x BR code of a bitrate or -1 when unsupported
+static int pcscBitrateIndex (int bitrate) {
+    for (int idx=0; idx < 4; idx++) {
+        if (pcscBitrates[idx] == bitrate) return idx;
+    }
+    return -1;
+}
+
+// change reader/card bitrate with PN53x InPSL through reader escape
+static int pcscBitrateSet (pcscHandleT *handle, int brIdx) {
+    BYTE pslCmd[]= {0xFF, 0x00, 0x00, 0x00, 0x05, 0xD4, 0x4E, 0x01, (BYTE)brIdx, (BYTE)brIdx};
+    BYTE resp[16];
+    ulong rlen= sizeof(resp);
+
+    if (pcscReaderControl (handle, pslCmd, sizeof(pslCmd), resp, &rlen)) goto OnErrorExit;
+
+    // D5 4F <status> 90 00
+    if (rlen < 3 || resp[0] != 0xD5 || resp[1] != 0x4F || resp[2] != 0x00) {
+        handle->error= "Reader refused bitrate (InPSL)";
+        goto OnErrorExit;
+    }
+    handle->bitrate= pcscBitrates[brIdx];
+    handle->bitrateErrors= 0;
+    return 0;
+
+OnErrorExit:
+    EXT_DEBUG ("[pcsc-bitrate-fail] reader=%s bitrate=%d err=%s", handle->readerName, pcscBitrates[brIdx], handle->error);
+    return -1;
+}
+
+// apply requested bitrate once per card. PC/SC only exposes ATS historical bytes (TA1 is not
+// reachable), card support is checked by InPSL own PPS exchange: refusal falls back to next
+// lower rate.
+static void pcscBitrateNegotiate (pcscHandleT *handle, const char *uid) {
+    int brIdx= pcscBitrateIndex ((int)handle->bitrateMax);
+
+    handle->bitrate= pcscBitrates[0];
+    if (brIdx <= 0) return;
+    while (brIdx > 0 && pcscBitrateSet (handle, brIdx)) brIdx--;
+
+    if (handle->verbose) fprintf (stderr, " -- bitrate reader=%s card=%s bitrate=%dkbit/s\n", handle->readerName, uid, handle->bitrate);
+}
+
+// count transmit errors, step down one bitrate when they pile up
+static void pcscBitrateCheck (pcscHandleT *handle, long rv) {
+    if (handle->bitrate <= pcscBitrates[0]) return;
+    if (rv == SCARD_S_SUCCESS) {
+        handle->bitrateErrors= 0;
+        return;
+    }
+    if (++handle->bitrateErrors < PCSC_BITRATE_ERR_MAX) return;
+
+    for (int idx=1; idx < 4; idx++) {
+        if (pcscBitrates[idx] == handle->bitrate) {
+            EXT_NOTICE ("[pcsc-bitrate-fallback] reader=%s bitrate=%d errors=%d", handle->readerName, handle->bitrate, handle->bitrateErrors);
+            if (pcscBitrateSet (handle, idx-1)) handle->bitrate= pcscBitrates[0];
+            break;
+        }
+    }
+    handle->bitrateErrors= 0;
+}
+
+// return bitrate used with current card (0 when not negotiated)
+int pcscBitrate (pcscHandleT *handle) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    return handle->bitrate;
+}
+
+// true when apdu is short case 2 (header+Le) or case 4 (header+Lc+data+Le), Le is then last byte
+static int pcscApduShortLe (const BYTE *apdu, ulong apduLen) {
+    if (apduLen == 5) return 1;
+    if (apduLen < 6 || !apdu[4]) return 0; // case 1 or extended length
+    return apduLen == 6 + (ulong)apdu[4];
+}
+
+// send one apdu and chain GET RESPONSE (61xx) directly into caller buffer. Each response status
+// word is overwritten by next chunk, dataLen should include PCSC_MIFARE_STATUS_LEN bytes for
+// last status word and returns received data length (status excluded). Wrong Le (6Cxx) is re-sent once
+// with card proposed Le for short case 2/4 apdus, other cases return 6Cxx to caller. Return 0 when
+// final status is 9000, status word is always returned.
+int pcscSendApdu (pcscHandleT *handle, const char *uid, const u_int8_t *apdu, ulong apduLen, u_int8_t *data, ulong *dataLen, u_int16_t *sw)
+{
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    BYTE getResponse[] = {(BYTE)(apduLen ? apdu[0] : 0x00), 0xC0, 0x00, 0x00, 0x00};
+    BYTE resend[apduLen > sizeof(getResponse) ? apduLen : sizeof(getResponse)];
+    const BYTE *sendBuf= apdu;
+    ulong sendLen= apduLen;
+    ulong size= *dataLen;
+    ulong count=0;
+    int wrongLe=0;
+    long rv;
+
+    *sw= 0;
+    if (apduLen < 4) {
+        handle->error= "Invalid apdu (header should be 4 bytes)";
+        goto OnErrorExit;
+    }
+    if (!handle->bitrate) pcscBitrateNegotiate (handle, uid);
+
+    while (1) {
+        DWORD rlen;
+        if (size - count < PCSC_MIFARE_STATUS_LEN) {
+            handle->error= "Apdu response buffer too small";
+            goto OnErrorExit;
+        }
+        rlen= (DWORD)(size - count);
+        if (pcscAbortCheck (handle)) goto OnErrorExit;
+
+        pcscTraceRecord (handle, PCSC_TRACE_SEND, "apdu", 0, 0, sendBuf, sendLen, NULL);
+        PCSC_PROBE (apdu__start, handle->readerName, "apdu", sendLen);
+        u_int64_t start= pcscNowUs();
+        rv = pcscBackend->transmit(handle->hCard, handle->pioSendPci, sendBuf, sendLen, NULL, &data[count], &rlen);
+        u_int64_t elapsed= pcscNowUs()-start;
+        PCSC_PROBE (apdu__end, handle->readerName, "apdu", rv, rlen, elapsed);
+        pcscTraceRecord (handle, PCSC_TRACE_RECV, "apdu", rv, size - count, &data[count], rv == SCARD_S_SUCCESS ? rlen : 0, NULL);
+        pcscWatchdogCheck (handle, rv, elapsed/1000);
+        pcscBitrateCheck (handle, rv);
+        pcscStatsRecord (handle, PCSC_STAT_APDU, elapsed, sendLen, rv == SCARD_S_SUCCESS ? rlen : 0, rv != SCARD_S_SUCCESS);
+        if (rv != SCARD_S_SUCCESS) {
+            handle->error= pcsc_stringify_error(rv);
+            handle->errClass= pcscErrClassify (rv);
+            goto OnErrorExit;
+        }
+        if (rlen < PCSC_MIFARE_STATUS_LEN) {
+            handle->error= "Invalid apdu response (no status word)";
+            goto OnErrorExit;
+        }
+
+        rlen -= PCSC_MIFARE_STATUS_LEN;
+        *sw= (u_int16_t)(data[count+rlen] << 8 | data[count+rlen+1]);
+        count += rlen;
+
+        if ((*sw >> 8) == 0x61) {
+            // more data available, fetch it just after what we already have
+            ulong le= (*sw & 0xFF) ? (*sw & 0xFF) : 256;
+            ulong avail= size - count - PCSC_MIFARE_STATUS_LEN;
+            if (!avail) {
+                handle->error= "Apdu response buffer too small";
+                goto OnErrorExit;
+            }
+            if (le > avail) le= avail;
+            getResponse[4]= (BYTE)le;
+            sendBuf= getResponse;
+            sendLen= sizeof(getResponse);
+            continue;
+        }
+
+        if ((*sw >> 8) == 0x6C && !wrongLe && pcscApduShortLe (sendBuf, sendLen)) {
+            // wrong Le, re-send with exact length proposed by card
+            memcpy (resend, sendBuf, sendLen);
+            resend[sendLen-1]= (BYTE)(*sw & 0xFF);
+            sendBuf= resend;
+            wrongLe=1;
+            continue;
+        }
+        break;
+    }
+
+    *dataLen= count;
+    handle->sw= *sw;
+    if (*sw != PCSC_APDU_SW_OK) {
+        handle->error= "Smartcard APDU refused (check status word)";
+        goto OnErrorExit;
+    }
+    return 0;
+
+OnErrorExit:
+    *dataLen= count;
+    handle->sw= *sw;
+    pcscTraceError (handle);
+    EXT_DEBUG ("[pcsc-apdu-fail] uid=%s sw=0x%04X err=%s", uid, *sw, handle->error);
+    return -1;
+}
+
+// read a transparent EF (previously selected). Data is requested with extended Le when card
+// accepts it, else by 256 bytes chunks. Read stops at end of file, dataLen returns data read.
+int pcscIsoReadBinary (pcscHandleT *handle, const char *uid, u_int16_t offset, u_int8_t *data, ulong *dataLen, u_int16_t *sw)
+{
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    ulong size= *dataLen;
+    ulong count=0;
+    int err;
+
+    while (size - count > PCSC_MIFARE_STATUS_LEN && offset <= 0x7FFF) {
+        ulong want= size - count - PCSC_MIFARE_STATUS_LEN;
+        ulong le= handle->apduShort ? 256 : 65536;
+        BYTE apdu[PCSC_APDU_HEADER_MAX];
+        if (want < le) le= want;
+
+        long alen= pcscApduBuild (apdu, sizeof(apdu), 0x00, 0xB0, (u_int8_t)(offset >> 8), (u_int8_t)offset, NULL, 0, le);
+        ulong rlen= size - count;
+        err= pcscSendApdu (handle, uid, apdu, (ulong)alen, &data[count], &rlen, sw);
+        count += rlen;
+        offset += (u_int16_t)rlen;
+
+        if (err) {
+            // card does not support extended length, retry by short chunks
+            if (le > 256 && *sw == 0x6700 && !rlen) {
+                handle->apduShort= 1;
+                continue;
+            }
+            // end of file reached before le
+            if (*sw == 0x6282 || (*sw == 0x6B00 && count)) break;
+            goto OnErrorExit;
+        }
+        if (!rlen) break;
+    }
+    *dataLen= count;
+    return 0;
+
+OnErrorExit:
+    *dataLen= count;
+    return -1;
+}
+
+// Mifare classic value block operations through reader pseudo APDUs
+// (ACR122U #5.5). Increment/decrement/restore are transferred by the reader
+// within the same exchange, a counter update is atomic on the card.
+int pcscValueBlock (pcscHandleT *handle, const char *uid, u_int8_t secIdx, u_int8_t blkIdx, pcscValueOpE op, int32_t *value, u_int8_t dstIdx, const pcscKeyT *key)
+{
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    ulong blkSector, blkLength;
+    BYTE status[16];
+    ulong dlen= sizeof(status);
+    long rv;
+
+    if (handle->verbose) fprintf (stderr, "\n# pcscValueBlock reader=%s cmd=%s scard=%ld sec=%d blk=%d op=%d\n", handle->readerName, uid, handle->uuid, secIdx, blkIdx, op);
+
+    if (handle->cardId != ATR_MIFARE_1K && handle->cardId != ATR_MIFARE_4K) {
+        handle->error= "Value block requires MIFARE_CLASSIC smartcard";
+        goto OnErrorExit;
+    }
+
+    if (blkIdx % 4 == 3 || (op == PCSC_VALUE_RESTORE && dstIdx % 4 == 3)) {
+        handle->error= "Value block cannot be a sector trailer";
+        goto OnErrorExit;
+    }
+
+    rv= pcscAuthSCard (handle, uid, secIdx, blkIdx, 16, key, &blkSector, &blkLength);
+    if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+
+    BYTE blk= (BYTE)(secIdx*4 + blkIdx);
+    if (op != PCSC_VALUE_READ && blk < PCSC_RA_SECTORS*4) pcscReadAheadDrop (handle, blk/4);
+    switch (op) {
+        case PCSC_VALUE_FORMAT:
+        case PCSC_VALUE_INCREMENT:
+        case PCSC_VALUE_DECREMENT: {
+            if (op != PCSC_VALUE_FORMAT && *value < 0) {
+                handle->error= "Value block increment/decrement should be positive";
+                goto OnErrorExit;
+            }
+            // value is MSB first, VB_OP: 0=store, 1=increment, 2=decrement
+            u_int32_t vbValue= (u_int32_t)*value;
+            BYTE valueCmd[] = {0xFF, 0xD7, 0x00, blk, 0x05, (BYTE)(op-PCSC_VALUE_FORMAT),
+                (BYTE)(vbValue >> 24), (BYTE)(vbValue >> 16), (BYTE)(vbValue >> 8), (BYTE)vbValue};
+            rv= pcscSendCmd (handle, uid, "value", valueCmd, sizeof(valueCmd), status, &dlen);
+            if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+            break;
+        }
+
+        case PCSC_VALUE_RESTORE: {
+            // source and target should be within the same (authenticated) sector
+            BYTE dst= (BYTE)(secIdx*4 + dstIdx);
+            if (dst/4 != blk/4) {
+                handle->error= "Value block restore target should be in same sector";
+                goto OnErrorExit;
+            }
+            BYTE restoreCmd[] = {0xFF, 0xD7, 0x00, blk, 0x02, 0x03, dst};
+            rv= pcscSendCmd (handle, uid, "value", restoreCmd, sizeof(restoreCmd), status, &dlen);
+            if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+            break;
+        }
+
+        case PCSC_VALUE_READ: {
+            BYTE readCmd[] = {0xFF, 0xB1, 0x00, blk, 0x04};
+            rv= pcscSendCmd (handle, uid, "value", readCmd, sizeof(readCmd), status, &dlen);
+            if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+            if (dlen != 4 + PCSC_MIFARE_STATUS_LEN) {
+                handle->error= "Value block read invalid response (not a value block?)";
+                goto OnErrorExit;
+            }
+            *value= (int32_t)((u_int32_t)status[0] << 24 | (u_int32_t)status[1] << 16 | (u_int32_t)status[2] << 8 | (u_int32_t)status[3]);
+            if (handle->verbose) fprintf (stderr, "value=%d\n", *value);
+            break;
+        }
+
+        default:
+            handle->error= "Value block unknown operation";
+            goto OnErrorExit;
+    }
+    return 0;
+
+OnErrorExit:
+    EXT_DEBUG ("[pcsc-value-fail] cmd=%s action=value err=%s", uid, handle->error);
+    return -1;
+}
+
+static ulong pcscStatsTotal (pcscHandleT *handle) {
+    ulong total=0;
+    for (int idx=0; idx < PCSC_STAT_COUNT; idx++) total += atomic_load_explicit (&handle->stats[idx].count, memory_order_relaxed);
+    return total;
+}
+
+static void pcscDumpPut16 (u_int8_t *buffer, u_int16_t value) {
+    buffer[0]= (u_int8_t)value;
+    buffer[1]= (u_int8_t)(value >> 8);
+}
+
+static u_int16_t pcscDumpGet16 (const u_int8_t *buffer) {
+    return (u_int16_t)(buffer[0] | buffer[1] << 8);
+}
+
+static int pcscDumpWriteHeader (FILE *file, const pcscDumpHeaderT *header) {
+    u_int8_t buffer[PCSC_DUMP_HEADER_LEN];
+
+    memcpy (&buffer[0], header->magic, sizeof(header->magic));
+    buffer[8]= header->family;
+    buffer[9]= header->blkLen;
+    pcscDumpPut16 (&buffer[10], header->sectors);
+    pcscDumpPut16 (&buffer[12], header->blocks);
+    buffer[14]= header->uidLen;
+    memcpy (&buffer[15], header->uid, PCSC_CARD_UID_MAX);
+    return fwrite (buffer, sizeof(buffer), 1, file) == 1 ? 0 : -1;
+}
+
+static int pcscDumpReadHeader (FILE *file, pcscDumpHeaderT *header) {
+    u_int8_t buffer[PCSC_DUMP_HEADER_LEN];
+
+    if (fread (buffer, sizeof(buffer), 1, file) != 1) return -1;
+    memcpy (header->magic, &buffer[0], sizeof(header->magic));
+    header->family= buffer[8];
+    header->blkLen= buffer[9];
+    header->sectors= pcscDumpGet16 (&buffer[10]);
+    header->blocks= pcscDumpGet16 (&buffer[12]);
+    header->uidLen= buffer[14];
+    memcpy (header->uid, &buffer[15], PCSC_CARD_UID_MAX);
+    if (memcmp (header->magic, PCSC_DUMP_MAGIC, sizeof(header->magic)) || header->uidLen > PCSC_CARD_UID_MAX) return -1;
+    return 0;
+}
+
+static int pcscDumpWriteSector (FILE *file, const pcscDumpSectorT *record) {
+    u_int8_t buffer[PCSC_DUMP_SECTOR_LEN];
+
+    pcscDumpPut16 (&buffer[0], record->first);
+    buffer[2]= record->sector;
+    buffer[3]= record->status;
+    buffer[4]= record->key;
+    buffer[5]= record->blocks;
+    return fwrite (buffer, sizeof(buffer), 1, file) == 1 ? 0 : -1;
+}
+
+static int pcscDumpReadSector (FILE *file, pcscDumpSectorT *record) {
+    u_int8_t buffer[PCSC_DUMP_SECTOR_LEN];
+
+    if (fread (buffer, sizeof(buffer), 1, file) != 1) return -1;
+    record->first= pcscDumpGet16 (&buffer[0]);
+    record->sector= buffer[2];
+    record->status= buffer[3];
+    record->key= buffer[4];
+    record->blocks= buffer[5];
+    return 0;
+}
+
+// dumpable card layout: Mifare classic 1K/4K (4K sectors 32-39 hold 16 blocks) or type-2 pages by 4
+static int pcscDumpLayout (pcscHandleT *handle, const char *uid, pcscDumpHeaderT *header) {
+    const pcscT2ModelT *model;
+
+    switch (handle->cardId) {
+        case ATR_MIFARE_1K:
+            header->family= PCSC_DUMP_CLASSIC;
+            header->blkLen= 16;
+            header->sectors= 16;
+            header->blocks= 64;
+            break;
+
+        case ATR_MIFARE_4K:
+            header->family= PCSC_DUMP_CLASSIC;
+            header->blkLen= 16;
+            header->sectors= 40;
+            header->blocks= 256;
+            break;
+
+        case ATR_MIFARE_UL:
+            model= pcscT2Model (handle, uid);
+            header->family= PCSC_DUMP_TYPE2;
+            header->blkLen= PCSC_T2_PAGE_LEN;
+            header->sectors= (u_int16_t)((model->pages + 3) / 4);
+            header->blocks= model->pages;
+            break;
+
+        default:
+            handle->error= "Card dump requires MIFARE_CLASSIC or NFC type-2 smartcard";
+            return -1;
+    }
+
+    if (!handle->uuid) pcscGetCardUuid (handle);
+    header->uidLen= handle->cardUidLen;
+    memcpy (header->uid, handle->cardUid, handle->cardUidLen);
+    return 0;
+}
+
+static void pcscDumpSpan (const pcscDumpHeaderT *header, u_int16_t sector, u_int16_t *first, u_int8_t *count) {
+    if (header->family == PCSC_DUMP_TYPE2) {
+        *first= (u_int16_t)(sector*4);
+        *count= (u_int8_t)(header->blocks - *first < 4 ? header->blocks - *first : 4);
+    } else if (sector < 32) {
+        *first= (u_int16_t)(sector*4);
+        *count= 4;
+    } else {
+        *first= (u_int16_t)(128 + (sector-32)*16);
+        *count= 16;
+    }
+}
+
+// authenticate one Mifare classic sector, keyIdx returns ring index of key which opened it
+static long pcscDumpAuth (pcscHandleT *handle, const char *uid, u_int16_t first, const pcscKeyT *ring, u_int8_t *keyIdx) {
+    ulong blkSector, blkLength;
+    pcscKeyMemoT *memo= NULL;
+    pcscKeyMemoIdT id;
+    long rv;
+
+    *keyIdx= PCSC_DUMP_NOKEY;
+    rv= pcscAuthSCard (handle, uid, 0, (u_int8_t)first, 16, ring, &blkSector, &blkLength);
+    if (rv != SCARD_S_SUCCESS) {
+        // refused authentication halts card, reactivate it for next sector
+        if (handle->errClass == PCSC_ERR_AUTH) pcscBackend->reconnect (handle->hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, SCARD_RESET_CARD, &handle->activeProtocol);
+        return rv;
+    }
+    if (!ring || !ring->ring) {
+        *keyIdx= 0;
+        return rv;
+    }
+
+    // ring authentication memorised key which opened (uuid,sector)
+    memset (&id, 0, sizeof(id));
+    id.uuid= handle->uuid;
+    id.sector= pcscMifareSector (0, (u_int8_t)first);
+    HASH_FIND (hh, handle->keyMemo, &id, sizeof(id), memo);
+    for (int idx=0; memo && idx < ring->rcount; idx++) {
+        if (ring->ring[idx] == memo->key) *keyIdx= (u_int8_t)idx;
+    }
+    return rv;
+}
+
+// read blocks of one authenticated sector, several blocks per command when reader accepts it
+static long pcscDumpReadClassic (pcscHandleT *handle, const char *uid, u_int16_t first, u_int8_t count, u_int8_t *data) {
+    BYTE resp[PCSC_MIFARE_READ_MAX*16 + PCSC_MIFARE_STATUS_LEN];
+    long rv;
+
+    for (u_int8_t idx=0; idx < count;) {
+        u_int8_t nblk= (u_int8_t)(count - idx < handle->mifareReadMax ? count - idx : handle->mifareReadMax);
+        BYTE readCmd[] = {0xFF, 0xB0, 0x00, (BYTE)(first + idx), (BYTE)(nblk*16)};
+        ulong rlen= sizeof(resp);
+
+        rv= pcscSendCmd (handle, uid, "read", readCmd, sizeof(readCmd), resp, &rlen);
+        if (rv == SCARD_S_SUCCESS && rlen < (ulong)nblk*16 + PCSC_MIFARE_STATUS_LEN) {
+            handle->error= "Mifare read short response";
+            handle->errClass= PCSC_ERR_FATAL;
+            rv= -1;
+        }
+        if (rv != SCARD_S_SUCCESS && nblk > 1 && handle->errClass == PCSC_ERR_FATAL) {
+            // reader refused multi-block read, fall back to one block per command
+            if (handle->verbose) fprintf (stderr, " -- reader=%s refused %d blocks read, fall back to single block\n", handle->readerName, nblk);
+            handle->mifareReadMax= 1;
+            if (pcscReAuth (handle, uid) != SCARD_S_SUCCESS) return -1;
+            continue;
+        }
+        if (rv != SCARD_S_SUCCESS) return rv;
+
+        memcpy (&data[idx*16], resp, (size_t)nblk*16);
+        idx= (u_int8_t)(idx + nblk);
+    }
+    return SCARD_S_SUCCESS;
+}
+
+// dump every sector readable with ring keys (NULL=default keyA) to path. Sectors are authenticated
+// once (learned ring key first) and read with multi-block commands, type-2 memory with FAST_READ.
+// Records are streamed as sectors are read. Return readable sectors
+int pcscDumpCard (pcscHandleT *handle, const char *uid, const pcscKeyT *ring, const char *path, pcscDumpStatsT *stats) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    pcscDumpHeaderT header= {.magic=PCSC_DUMP_MAGIC};
+    u_int64_t start= pcscNowUs();
+    ulong apdus= pcscStatsTotal (handle);
+    ulong auths= handle->authStats.attempts;
+    u_int8_t *image= NULL;
+    FILE *file= NULL;
+    int fd;
+
+    memset (stats, 0, sizeof(*stats));
+    if (pcscDumpLayout (handle, uid, &header)) goto OnErrorExit;
+
+    // dump holds card data (and trailers), keep it private to owner
+    fd= open (path, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0600);
+    if (fd < 0 || !(file= fdopen (fd, "w"))) {
+        handle->error= strerror(errno);
+        if (fd >= 0) close (fd);
+        goto OnErrorExit;
+    }
+    if (pcscDumpWriteHeader (file, &header)) goto OnWriteExit;
+
+    // type-2 memory is read at once, protected pages fall back to per sector reads
+    if (header.family == PCSC_DUMP_TYPE2) {
+        image= malloc ((size_t)header.blocks * PCSC_T2_PAGE_LEN);
+        if (image && pcscT2Read (handle, uid, 0, image, (ulong)header.blocks * PCSC_T2_PAGE_LEN) != SCARD_S_SUCCESS) {
+            free (image);
+            image= NULL;
+        }
+    }
+
+    for (u_int16_t sector=0; sector < header.sectors; sector++) {
+        pcscDumpSectorT record= {.sector=(u_int8_t)sector, .status=PCSC_DUMP_OK, .key=PCSC_DUMP_NOKEY};
+        u_int8_t data[16*16];
+        u_int8_t count;
+
+        pcscDumpSpan (&header, sector, &record.first, &count);
+        if (header.family == PCSC_DUMP_TYPE2) {
+            if (image) memcpy (data, &image[record.first * PCSC_T2_PAGE_LEN], (size_t)count * PCSC_T2_PAGE_LEN);
+            else if (pcscT2Read (handle, uid, record.first, data, (ulong)count * PCSC_T2_PAGE_LEN) != SCARD_S_SUCCESS) record.status= PCSC_DUMP_FAILED;
+        } else if (pcscDumpAuth (handle, uid, record.first, ring, &record.key) != SCARD_S_SUCCESS) {
+            record.status= PCSC_DUMP_REFUSED;
+        } else if (pcscDumpReadClassic (handle, uid, record.first, count, data) != SCARD_S_SUCCESS) {
+            record.status= PCSC_DUMP_FAILED;
+        }
+
+        stats->sectors++;
+        switch (record.status) {
+            case PCSC_DUMP_OK:
+                record.blocks= count;
+                stats->readable++;
+                stats->bytes += (ulong)count * header.blkLen;
+                break;
+            case PCSC_DUMP_REFUSED:
+                stats->refused++;
+                break;
+            default:
+                stats->failed++;
+        }
+        if (handle->verbose) fprintf (stderr, " -- dump sector=%d first=%d status=%d key=%d\n", sector, record.first, record.status, record.key);
+        if (pcscDumpWriteSector (file, &record)) goto OnWriteExit;
+        if (record.blocks && fwrite (data, header.blkLen, record.blocks, file) != record.blocks) goto OnWriteExit;
+
+        // remaining sectors are not readable once card left or work was aborted
+        if (record.status != PCSC_DUMP_OK && (handle->errClass == PCSC_ERR_CARD_GONE || handle->errClass == PCSC_ERR_ABORTED)) goto OnErrorExit;
+    }
+
+    if (fclose (file)) {
+        file= NULL;
+        goto OnWriteExit;
+    }
+    free (image);
+    stats->auths= handle->authStats.attempts - auths;
+    stats->apdus= pcscStatsTotal (handle) - apdus;
+    stats->usec= pcscNowUs() - start;
+    return (int)stats->readable;
+
+OnWriteExit:
+    handle->error= "Fail to write dump file";
+OnErrorExit:
+    if (file) fclose (file);
+    free (image);
+    stats->usec= pcscNowUs() - start;
+    EXT_DEBUG ("[pcsc-dump-fail] reader=%s path=%s error=%s", handle->readerName, path, handle->error);
+    return -1;
+}
+
+// write a dump back to current card, only blocks which differ from target are written. Manufacturer
+// block, sector trailers (keys/access bits) and type-2 lock/config pages are never written.
+// Return restored sectors
+int pcscRestoreCard (pcscHandleT *handle, const char *uid, const pcscKeyT *ring, const char *path, pcscDumpStatsT *stats) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    pcscDumpHeaderT header, target= {.magic=PCSC_DUMP_MAGIC};
+    pcscDumpSectorT record;
+    u_int64_t start= pcscNowUs();
+    ulong apdus= pcscStatsTotal (handle);
+    ulong auths= handle->authStats.attempts;
+    FILE *file= NULL;
+
+    memset (stats, 0, sizeof(*stats));
+    file= fopen (path, "r");
+    if (!file) {
+        handle->error= strerror(errno);
+        goto OnErrorExit;
+    }
+    if (pcscDumpReadHeader (file, &header)) {
+        handle->error= "Not a card dump file (or incompatible version)";
+        goto OnErrorExit;
+    }
+    if (pcscDumpLayout (handle, uid, &target)) goto OnErrorExit;
+    if (target.family != header.family || target.blocks != header.blocks || target.sectors != header.sectors || target.blkLen != header.blkLen) {
+        handle->error= "Card dump does not match target card model";
+        goto OnErrorExit;
+    }
+    u_int16_t userEnd= header.family == PCSC_DUMP_TYPE2 ? pcscT2Model (handle, uid)->userEnd : header.blocks;
+
+    while (!pcscDumpReadSector (file, &record)) {
+        u_int8_t image[16*16], current[16*16];
+        u_int16_t first;
+        u_int8_t count, keyIdx;
+        long rv;
+
+        // record span is recomputed from card layout, never trusted from file
+        if (record.sector >= header.sectors) goto OnCorruptExit;
+        pcscDumpSpan (&header, record.sector, &first, &count);
+        if (record.first != first || (record.blocks && record.blocks != count)) goto OnCorruptExit;
+        if (fread (image, header.blkLen, record.blocks, file) != record.blocks) {
+            handle->error= "Truncated card dump file";
+            goto OnErrorExit;
+        }
+        stats->sectors++;
+        if (record.status != PCSC_DUMP_OK || !record.blocks) continue;
+
+        // read target sector, then write blocks which differ
+        if (header.family == PCSC_DUMP_TYPE2) {
+            rv= pcscT2Read (handle, uid, record.first, current, (ulong)record.blocks * PCSC_T2_PAGE_LEN);
+        } else {
+            rv= pcscDumpAuth (handle, uid, record.first, ring, &keyIdx);
+            if (rv != SCARD_S_SUCCESS) {
+                stats->refused++;
+                goto OnSectorExit;
+            }
+            rv= pcscDumpReadClassic (handle, uid, record.first, record.blocks, current);
+        }
+        if (rv != SCARD_S_SUCCESS) goto OnSectorFail;
+
+        for (u_int8_t idx=0; idx < record.blocks; idx++) {
+            u_int16_t block= (u_int16_t)(record.first + idx);
+            const u_int8_t *value= &image[idx * header.blkLen];
+
+            if (header.family == PCSC_DUMP_TYPE2) {
+                if (block < 4 || block >= userEnd) continue;
+            } else if (block == 0 || (block < 128 ? block%4 == 3 : (block-128)%16 == 15)) {
+                continue; // manufacturer block and sector trailers
+            }
+            if (!memcmp (value, &current[idx * header.blkLen], header.blkLen)) {
+                stats->unchanged++;
+                continue;
+            }
+
+            if (header.family == PCSC_DUMP_TYPE2) {
+                rv= pcscT2Write (handle, uid, block, value, PCSC_T2_PAGE_LEN);
+            } else {
+                BYTE writeCmd[5+16] = {0xFF, 0xD6, 0x00, (BYTE)block, 16};
+                BYTE status[16];
+                ulong slen= sizeof(status);
+                memcpy (&writeCmd[5], value, 16);
+                if (block < PCSC_RA_SECTORS*4) pcscReadAheadDrop (handle, (u_int8_t)(block/4));
+                rv= pcscSendCmd (handle, uid, "write", writeCmd, sizeof(writeCmd), status, &slen);
+            }
+            if (rv != SCARD_S_SUCCESS) goto OnSectorFail;
+            stats->writes++;
+            stats->bytes += header.blkLen;
+        }
+        stats->readable++;
+        continue;
+
+    OnSectorFail:
+        stats->failed++;
+    OnSectorExit:
+        if (handle->verbose) fprintf (stderr, " -- restore sector=%d error=%s\n", record.sector, handle->error);
+        if (handle->errClass == PCSC_ERR_CARD_GONE || handle->errClass == PCSC_ERR_ABORTED) goto OnErrorExit;
+    }
+
+    fclose (file);
+    stats->auths= handle->authStats.attempts - auths;
+    stats->apdus= pcscStatsTotal (handle) - apdus;
+    stats->usec= pcscNowUs() - start;
+    return (int)stats->readable;
+
+OnCorruptExit:
+    handle->error= "Corrupted card dump file (sector record does not match card layout)";
+OnErrorExit:
+    if (file) fclose (file);
+    stats->usec= pcscNowUs() - start;
+    EXT_DEBUG ("[pcsc-restore-fail] reader=%s path=%s error=%s", handle->readerName, path, handle->error);
+    return -1;
+}
+
+const pcscStoreT *pcscNewStore (const char *uid, u_int8_t sector, u_int8_t count, const char **fields, int nfield, const pcscKeyT *key, const pcscKeyT *wkey) {
+    pcscStoreT *store;
+
+    // sector 0 holds manufacturer block, 4K sectors 32-39 hold 16 blocks
+    if (!sector || !count || sector + count > 32 || count > PCSC_STORE_SECTORS_MAX) return NULL;
+    if (nfield <= 0 || nfield > PCSC_STORE_FIELDS_MAX) return NULL;
+
+    store= calloc (1, sizeof(pcscStoreT));
+    store->uid= uid;
+    store->sector= sector;
+    store->count= count;
+    store->blocks= count*3;
+    store->mapLen= (store->blocks + 7) / 8;
+    store->dirBlocks= (PCSC_STORE_HEADER_LEN + store->mapLen + 2*nfield + 15) / 16;
+    store->fields= fields;
+    store->nfield= nfield;
+    store->key= key;
+    store->wkey= wkey;
+    if (store->dirBlocks >= store->blocks) {
+        free (store);
+        return NULL;
+    }
+    return store;
+}
+
+// fields array was handed over by pcscNewStore, field names are not owned
+void pcscFreeStore (const pcscStoreT *store) {
+    if (!store) return;
+    free ((void*)store->fields);
+    free ((pcscStoreT*)store);
+}
+
+// return field directory index or -1
+int pcscStoreField (const pcscStoreT *store, const char *field) {
+    for (int idx=0; idx < store->nfield; idx++) {
+        if (!strcasecmp (store->fields[idx], field)) return idx;
+    }
+    return -1;
+}
+
+static void pcscStoreAddr (const pcscStoreT *store, int block, u_int8_t *secIdx, u_int8_t *blkIdx) {
+    *secIdx= (u_int8_t)(store->sector + block/3);
+    *blkIdx= (u_int8_t)(block%3);
+}
+
+static int pcscStoreBlocks (ulong len) {
+    return (int)((len + 15) / 16);
+}
+
+// data written to card by any command, store cache is only trusted when it did not move
+static ulong pcscStoreWrites (pcscHandleT *handle) {
+    return atomic_load_explicit (&handle->stats[PCSC_STAT_WRITE].count, memory_order_relaxed)
+         + atomic_load_explicit (&handle->stats[PCSC_STAT_VALUE].count, memory_order_relaxed);
+}
+
+static void pcscStoreFlush (pcscHandleT *handle) {
+    handle->store= NULL;
+    handle->stValid= 0;
+}
+
+// read masked store blocks missing from session cache, one read per run of blocks within a sector
+static int pcscStoreFetch (pcscHandleT *handle, const char *uid, const pcscStoreT *store, u_int64_t mask) {
+    for (int block=0; block < store->blocks;) {
+        u_int8_t data[3*16 + PCSC_MIFARE_STATUS_LEN];
+        u_int8_t secIdx, blkIdx;
+        int last;
+
+        if (!(mask & (1ULL << block))) {
+            block++;
+            continue;
+        }
+        if (handle->stValid & (1ULL << block)) {
+            handle->stStats.hits++;
+            block++;
+            continue;
+        }
+
+        for (last=block+1; last < store->blocks && last%3 && (mask & ~handle->stValid & (1ULL << last)); last++);
+        pcscStoreAddr (store, block, &secIdx, &blkIdx);
+        if (pcscReadBlock (handle, uid, secIdx, blkIdx, data, (ulong)(last-block)*16 + PCSC_MIFARE_STATUS_LEN, store->key)) return -1;
+
+        memcpy (handle->stBlocks[block], data, (size_t)(last-block)*16);
+        for (int idx=block; idx < last; idx++) handle->stValid |= 1ULL << idx;
+        handle->stStats.reads += (ulong)(last-block);
+        block= last;
+    }
+    return 0;
+}
+
+// write masked blocks from image, one write per run of blocks within a sector
+static int pcscStorePush (pcscHandleT *handle, const char *uid, const pcscStoreT *store, u_int8_t image[][16], u_int64_t mask) {
+    for (int block=0; block < store->blocks;) {
+        u_int8_t data[3*16];
+        u_int8_t secIdx, blkIdx;
+        int last;
+
+        if (!(mask & (1ULL << block))) {
+            block++;
+            continue;
+        }
+
+        for (last=block+1; last < store->blocks && last%3 && (mask & (1ULL << last)); last++);
+        pcscStoreAddr (store, block, &secIdx, &blkIdx);
+        memcpy (data, image[block], (size_t)(last-block)*16); // write clobbers its buffer
+        if (pcsWriteBlock (handle, uid, secIdx, blkIdx, data, (ulong)(last-block)*16, store->wkey)) return -1;
+
+        memcpy (handle->stBlocks[block], image[block], (size_t)(last-block)*16);
+        for (int idx=block; idx < last; idx++) handle->stValid |= 1ULL << idx;
+        handle->stStats.writes += (ulong)(last-block);
+        block= last;
+    }
+    handle->stWrites= pcscStoreWrites (handle);
+    return 0;
+}
+
+// bind session cache to store and current card, directory is read once per tap
+static int pcscStoreLoad (pcscHandleT *handle, const char *uid, const pcscStoreT *store, int directory) {
+    u_int64_t dirMask= (1ULL << store->dirBlocks) - 1;
+    const u_int8_t *dir= (const u_int8_t *)handle->stBlocks;
+
+    if (handle->cardId != ATR_MIFARE_1K && handle->cardId != ATR_MIFARE_4K) {
+        handle->error= "Record store requires MIFARE_CLASSIC smartcard";
+        return -1;
+    }
+    if (handle->cardId == ATR_MIFARE_1K && store->sector + store->count > 16) {
+        handle->error= "Record store exceeds MIFARE_CLASSIC 1K sectors";
+        return -1;
+    }
+    if (handle->store != store || handle->stWrites != pcscStoreWrites (handle)) {
+        handle->store= store;
+        handle->stValid= 0;
+        handle->stWrites= pcscStoreWrites (handle);
+    }
+    if (!directory) return 0;
+
+    if ((handle->stValid & dirMask) != dirMask) handle->stStats.loads++;
+    if (pcscStoreFetch (handle, uid, store, dirMask)) return -1;
 
-        default:
-            handle->error="Unsupported smartcard model";
-            goto OnErrorExit;
+    if (dir[0] != 'P' || dir[1] != 'S' || dir[2] != PCSC_STORE_VERSION || dir[3] != store->nfield) {
+        handle->error= "Record store not formatted (or fields changed)";
+        return -1;
     }
-    return SCARD_S_SUCCESS;
+    // records stay within store, never overlap and free map holds exactly directory and record blocks
+    u_int64_t used= dirMask, map=0;
+    for (int idx=0; idx < store->nfield; idx++) {
+        const u_int8_t *entry= &dir[PCSC_STORE_HEADER_LEN + store->mapLen + 2*idx];
+        int count= pcscStoreBlocks (entry[1]);
+        u_int64_t mask;
+
+        if (!count) continue;
+        if (entry[0] < store->dirBlocks || entry[0] + count > store->blocks) goto OnCorruptExit;
+        mask= ((1ULL << count) - 1) << entry[0];
+        if (used & mask) goto OnCorruptExit;
+        used |= mask;
+    }
+    for (int block=0; block < store->mapLen*8; block++) {
+        if (dir[PCSC_STORE_HEADER_LEN + block/8] & (1 << block%8)) map |= 1ULL << block;
+    }
+    if (map != used) goto OnCorruptExit;
+    return 0;
 
-OnErrorExit:
+OnCorruptExit:
+    handle->error= "Record store directory corrupted";
     return -1;
 }
 
-// try to read data bloc
-int pcscReadBlock (pcscHandleT *handle, const char *uid,  u_int8_t secIdx, u_int8_t blkIdx, u_int8_t *data, ulong dataLen, const pcscKeyT *key)
-{
+// write an empty directory, record blocks are left as they are
+int pcscStoreFormat (pcscHandleT *handle, const char *uid, const pcscStoreT *store) {
     assert (handle->magic == PCSC_HANDLE_MAGIC);
-    long rv=0;
-    ulong blkSector, blkLength;
-    ulong dlen;
+    u_int8_t image[3][16];
+    u_int8_t *dir= (u_int8_t *)image;
 
-    if (handle->verbose) fprintf (stderr, "\n# pcscReadBlock reader=%s cmd=%s scard=%ld sec=%d blk=%d dlen=%ld", handle->readerName, uid, handle->uuid, secIdx, blkIdx, dataLen);
+    if (pcscStoreLoad (handle, uid, store, 0)) goto OnErrorExit;
 
-    rv= pcscAuthSCard (handle, uid, secIdx, blkIdx, dataLen-PCSC_MIFARE_STATUS_LEN, key, &blkSector, &blkLength);
-    if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+    memset (image, 0, sizeof(image));
+    dir[0]= 'P';
+    dir[1]= 'S';
+    dir[2]= PCSC_STORE_VERSION;
+    dir[3]= (u_int8_t)store->nfield;
+    for (int block=0; block < store->dirBlocks; block++) dir[PCSC_STORE_HEADER_LEN + block/8] |= (u_int8_t)(1 << block%8);
 
-    // try to read bloc
-    ulong dataIdx=0;
-    for (ulong idx=blkIdx%blkSector; (idx<blkSector && dataIdx < dataLen-PCSC_MIFARE_STATUS_LEN); idx++) {
-        mifareSecBlkT sIdx;
-        sIdx.u16= (u_int16_t)(secIdx*4 + blkIdx + idx);
+    if (pcscStorePush (handle, uid, store, image, (1ULL << store->dirBlocks) - 1)) goto OnErrorExit;
+    return 0;
 
-        dlen = blkLength + PCSC_MIFARE_STATUS_LEN;  // add cmd status to buffer size
-        u_int8_t readBlk[] = {0xFF, 0xB0, sIdx.u8[1], sIdx.u8[0], (u_int8_t)blkLength};
-        rv= pcscSendCmd (handle, uid, "read", readBlk, sizeof(readBlk), &data[dataIdx], &dlen);
-        if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+OnErrorExit:
+    EXT_DEBUG ("[pcsc-store-fail] cmd=%s store=%s action=format err=%s", uid, store->uid, handle->error);
+    return -1;
+}
 
-        // move to new block if any
-        dataIdx += blkLength;
+// read one field, only directory (once per tap) and record blocks are read. dataLen is buffer
+// size, returns record length. Data is zero terminated when buffer is larger than record
+int pcscStoreGet (pcscHandleT *handle, const char *uid, const pcscStoreT *store, const char *field, u_int8_t *data, ulong *dataLen) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    const u_int8_t *dir= (const u_int8_t *)handle->stBlocks;
+    int fidx= pcscStoreField (store, field);
+    u_int8_t start;
+    ulong len;
+
+    if (fidx < 0) {
+        handle->error= "Record store unknown field";
+        goto OnErrorExit;
     }
-    if (handle->verbose) {
-        fprintf(stderr, "recieved=%ld data:[", dataIdx);
-        for (int idx=0; idx< dataIdx; idx++) {
-            if (!data[idx]) break;
-            if (data[idx] >= ' ' && data[idx] <= '~') {
-                fwrite(&data[idx], sizeof(char), 1, stderr);
-            }
-        }
-        fprintf (stderr, "]\n");
+    if (pcscStoreLoad (handle, uid, store, 1)) goto OnErrorExit;
+
+    start= dir[PCSC_STORE_HEADER_LEN + store->mapLen + 2*fidx];
+    len= dir[PCSC_STORE_HEADER_LEN + store->mapLen + 2*fidx + 1];
+    if (len > *dataLen) {
+        handle->error= "Record store field larger than buffer";
+        goto OnErrorExit;
     }
+    if (len && pcscStoreFetch (handle, uid, store, ((1ULL << pcscStoreBlocks (len)) - 1) << start)) goto OnErrorExit;
 
+    memcpy (data, handle->stBlocks[start], len);
+    if (len < *dataLen) data[len]= '\0';
+    *dataLen= len;
     return 0;
 
 OnErrorExit:
-    if (handle->verbose) fprintf (stderr, " error=%s\n", handle->error);
-    EXT_DEBUG ("[pcsc-readblk-fail] cmd=%s action:read err=%s", uid, handle->error);
+    EXT_DEBUG ("[pcsc-store-fail] cmd=%s store=%s field=%s err=%s", uid, store->uid, field, handle->error);
     return -1;
 }
 
-
-// try to read data bloc
-int pcsWriteBlock (pcscHandleT *handle, const char *uid,  u_int8_t secIdx, u_int8_t blkIdx, u_int8_t *dataBuf, ulong dataLen, const pcscKeyT *key)
-{
+// update one field (dataLen=0 clears it). Record stays in place when it fits, else it moves to
+// first free run of blocks. Only blocks which differ from card are written, record blocks before
+// directory, so an interrupted move keeps previous value
+int pcscStoreSet (pcscHandleT *handle, const char *uid, const pcscStoreT *store, const char *field, const u_int8_t *data, ulong dataLen) {
     assert (handle->magic == PCSC_HANDLE_MAGIC);
-    long rv=0;
-    ulong blkSector, blkLength;
-
-    if (handle->verbose) fprintf (stderr, "\n# pcsWriteBlock reader=%s cmd=%s scard=%ld sec=%d blk=%d dlen=%ld\n", handle->readerName, uid, handle->uuid, secIdx, blkIdx, dataLen);
-    rv= pcscAuthSCard (handle, uid, secIdx, blkIdx, dataLen, key, &blkSector, &blkLength);
-    if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
-
-    // Write is done by block within one sector
-    ulong dataIdx=0;
-    for (ulong idx=blkIdx%blkSector; (idx<blkSector && dataIdx < dataLen); idx++) {
+    u_int8_t image[PCSC_STORE_BLOCKS][16];
+    u_int64_t dirMask= (1ULL << store->dirBlocks) - 1;
+    u_int64_t used=0, oldMask=0, newMask=0, dirty=0;
+    int fidx= pcscStoreField (store, field);
+    int count= pcscStoreBlocks (dataLen);
+    int start=0, oldStart, oldCount;
+    u_int8_t *dir= (u_int8_t *)image;
+    u_int8_t *entry;
+
+    if (fidx < 0) {
+        handle->error= "Record store unknown field";
+        goto OnErrorExit;
+    }
+    if (dataLen > PCSC_STORE_RECORD_MAX) {
+        handle->error= "Record store field too long";
+        goto OnErrorExit;
+    }
+    if (pcscStoreLoad (handle, uid, store, 1)) goto OnErrorExit;
 
-        mifareSecBlkT sIdx;
-        sIdx.u16= (u_int16_t)(secIdx*4 + idx);
+    memcpy (dir, handle->stBlocks[0], (size_t)store->dirBlocks*16);
+    entry= &dir[PCSC_STORE_HEADER_LEN + store->mapLen + 2*fidx];
+    for (int block=0; block < store->blocks; block++) {
+        if (dir[PCSC_STORE_HEADER_LEN + block/8] & (1 << block%8)) used |= 1ULL << block;
+    }
+    oldStart= entry[0];
+    oldCount= pcscStoreBlocks (entry[1]);
+    if (oldCount) oldMask= ((1ULL << oldCount) - 1) << oldStart;
+    used= (used | dirMask) & ~oldMask;
+
+    if (count) {
+        u_int64_t run= (1ULL << count) - 1;
+        if (!oldCount || oldStart + count > store->blocks || (used & (run << oldStart))) {
+            // moved record avoids its previous blocks unless store is too full
+            for (start=store->dirBlocks; start + count <= store->blocks && ((used | oldMask) & (run << start)); start++);
+            if (start + count > store->blocks) {
+                for (start=store->dirBlocks; start + count <= store->blocks && (used & (run << start)); start++);
+            }
+            if (start + count > store->blocks) {
+                handle->error= "Record store full";
+                goto OnErrorExit;
+            }
+        } else {
+            start= oldStart;
+        }
+        newMask= run << start;
+    }
 
-        BYTE writeCmd[] = {0xFF, 0xD6, sIdx.u8[1], sIdx.u8[0], (u_int8_t)blkLength};
-        BYTE bufferRqt[blkLength+sizeof(writeCmd)];
-        memcpy (&bufferRqt[0], writeCmd, sizeof(writeCmd));
-        memcpy (&bufferRqt[sizeof(writeCmd)], &dataBuf[dataIdx], blkLength);
-        ulong length= blkLength+sizeof(writeCmd);
+    // previous record blocks are compared with card, newly allocated blocks are written
+    if (pcscStoreFetch (handle, uid, store, newMask & oldMask)) goto OnErrorExit;
+    for (int idx=0; idx < count; idx++) {
+        int block= start + idx;
+        ulong offset= (ulong)idx*16;
 
-        rv= pcscSendCmd (handle, uid, "write", bufferRqt, sizeof(bufferRqt), dataBuf, &length);
-        if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+        memset (image[block], 0, 16);
+        memcpy (image[block], &data[offset], dataLen - offset < 16 ? dataLen - offset : 16);
+        if ((handle->stValid & (1ULL << block)) && !memcmp (image[block], handle->stBlocks[block], 16)) handle->stStats.unchanged++;
+        else dirty |= 1ULL << block;
+    }
 
-        // move to new block if any
-        dataIdx += blkLength;
+    used |= newMask;
+    memset (&dir[PCSC_STORE_HEADER_LEN], 0, (size_t)store->mapLen);
+    for (int block=0; block < store->blocks; block++) {
+        if (used & (1ULL << block)) dir[PCSC_STORE_HEADER_LEN + block/8] |= (u_int8_t)(1 << block%8);
+    }
+    entry[0]= (u_int8_t)start;
+    entry[1]= (u_int8_t)dataLen;
+    for (int block=0; block < store->dirBlocks; block++) {
+        if (memcmp (image[block], handle->stBlocks[block], 16)) dirty |= 1ULL << block;
     }
 
+    if (pcscStorePush (handle, uid, store, image, dirty & ~dirMask)) goto OnErrorExit;
+    if (pcscStorePush (handle, uid, store, image, dirty & dirMask)) goto OnErrorExit;
     return 0;
 
 OnErrorExit:
-    EXT_DEBUG("[pcsc-writeblk-fail] cmd=%s action=write err=%s", uid, handle->error);
+    EXT_DEBUG ("[pcsc-store-fail] cmd=%s store=%s field=%s err=%s", uid, store->uid, field, handle->error);
     return -1;
 }
 
+int pcscStoreStats (pcscHandleT *handle, pcscStoreStatsT *stats) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    *stats= handle->stStats;
+    return 0;
+}
+
 int pcscCardCheckAtr(pcscHandleT *handle)
 {
     assert (handle->magic == PCSC_HANDLE_MAGIC);
@@ -417,13 +3240,25 @@ int pcscCardCheckAtr(pcscHandleT *handle)
     }
 
     // use status to retrieve smart cart ATR
-    rv = SCardStatus(handle->hCard, readerName, &readerLen, &readerState, &handle->activeProtocol, atrData, &atrLen);
+    rv = pcscBackend->status(handle->hCard, readerName, &readerLen, &readerState, &handle->activeProtocol, atrData, &atrLen);
     if (rv != SCARD_S_SUCCESS) {
         handle->error= pcsc_stringify_error(rv);
         goto OnErrorExit;
     }
 
     handle->cardId = isoAtrParseCard (handle, atrData, atrLen);
+    PCSC_PROBE (atr__parse, handle->readerName, handle->cardId, atrLen);
+    pcscDivKeyFlush (handle);
+    pcscReadAheadFlush (handle);
+    pcscStoreFlush (handle);
+    handle->authActive= 0;
+    handle->t2Model= NULL;
+    handle->apduShort= 0;
+    handle->felicaIdm[0]= 0;
+    handle->bitrate= 0;
+    handle->bitrateErrors= 0;
+    handle->felicaReadMax= PCSC_FELICA_READ_MAX;
+    handle->felicaWriteMax= PCSC_FELICA_WRITE_MAX;
     if (handle->cardId == ATR_UNKNOWN) goto OnErrorExit;
 
     return 0;
@@ -439,7 +3274,7 @@ int pcscReaderCheck (pcscHandleT *handle, int ticks)
     assert (handle->magic == PCSC_HANDLE_MAGIC);
     long rv;
 
-	rv = SCardConnect(handle->hContext, handle->readerName, SCARD_SHARE_SHARED,
+	rv = pcscBackend->connect(handle->hContext, handle->readerName, SCARD_SHARE_SHARED,
 		SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &handle->hCard, &handle->activeProtocol);
 
     if (rv ==  SCARD_E_NO_SMARTCARD) {
@@ -449,23 +3284,26 @@ int pcscReaderCheck (pcscHandleT *handle, int ticks)
 
         if (handle->verbose) fprintf(stderr, "Please Insert a smartcard in reader=%s\n", handle->readerName);
         for (int idx=0; idx < ticks; idx++) {
-            // wait for card to be inserted
-            // wait timeout second for card to be inserted
-            rv = SCardGetStatusChange(handle->hContext, 10000, &rgReaderStates, 1);
+            // wait one tick for card to be inserted
+            rv = pcscBackend->getStatusChange(handle->hContext, PCSC_CHECK_TICK_MS, &rgReaderStates, 1);
             if (rv != SCARD_S_SUCCESS)  goto OnErrorExit;
 
             if (rgReaderStates.dwCurrentState != rgReaderStates.dwEventState) {
                 rgReaderStates.dwCurrentState = rgReaderStates.dwEventState;
 
                 // card is present
-                if (rgReaderStates.dwEventState & SCARD_STATE_PRESENT) break;
+                if (rgReaderStates.dwEventState & SCARD_STATE_PRESENT) {
+                    PCSC_PROBE (card__insert, handle->readerName, rgReaderStates.dwEventState);
+                    break;
+                }
                 if (handle->verbose) fprintf (stderr, ".");
             }
         }
         if (handle->verbose) fprintf (stderr, "\n");
-   	    rv = SCardConnect(handle->hContext, handle->readerName, SCARD_SHARE_SHARED,
+   	    rv = pcscBackend->connect(handle->hContext, handle->readerName, SCARD_SHARE_SHARED,
 		SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &handle->hCard, &handle->activeProtocol);
     }
+    PCSC_PROBE (card__connect, handle->readerName, rv, handle->activeProtocol);
 
     if (rv != SCARD_S_SUCCESS)  goto OnErrorExit;
 
@@ -492,6 +3330,284 @@ OnErrorExit:
 }
 
 // thread monitoring reader status change
+static int pcscSysfsRead (const char *dir, const char *attr, char *value, size_t len) {
+    char path[512];
+    FILE *file;
+
+    snprintf (path, sizeof(path), "/sys/bus/usb/devices/%s/%s", dir, attr);
+    file= fopen (path, "r");
+    if (!file) return -1;
+    if (!fgets (value, (int)len, file)) {
+        fclose (file);
+        return -1;
+    }
+    fclose (file);
+    value[strcspn (value, "\n")]= '\0';
+    return 0;
+}
+
+// map reader name to usbfs device through sysfs product model (first word). Identical readers
+// share their product string, an ambiguous match is refused rather than resetting a wrong device
+int pcscReaderUsbDev (pcscHandleT *handle, char *path, ulong len) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    char product[128], busnum[16], devnum[16];
+    struct dirent *entry;
+    int count=0;
+    DIR *dir;
+
+    dir= opendir ("/sys/bus/usb/devices");
+    if (!dir) goto OnErrorExit;
+
+    while ((entry= readdir (dir))) {
+        if (entry->d_name[0] == '.' || strchr (entry->d_name, ':')) continue; // skip interfaces
+        if (pcscSysfsRead (entry->d_name, "product", product, sizeof(product))) continue;
+        product[strcspn (product, " ")]= '\0';
+        if (strlen (product) < 4 || !strcasestr (handle->readerName, product)) continue;
+        if (pcscSysfsRead (entry->d_name, "busnum", busnum, sizeof(busnum)) || pcscSysfsRead (entry->d_name, "devnum", devnum, sizeof(devnum))) continue;
+
+        if (!count++) snprintf (path, len, "/dev/bus/usb/%03d/%03d", atoi (busnum), atoi (devnum));
+    }
+    closedir (dir);
+    if (count == 1) return 0;
+    if (count > 1) {
+        handle->error= "Ambiguous reader usb device (identical readers), usb reset skipped";
+        return -1;
+    }
+
+OnErrorExit:
+    handle->error= "Fail to map reader to usb device (check /sys/bus/usb/devices)";
+    return -1;
+}
+
+int pcscUsbReset (const char *usbdev) {
+    int fd, rc;
+
+    fd= open (usbdev, O_WRONLY);
+    if (fd < 0) goto OnErrorExit;
+
+    rc= ioctl (fd, USBDEVFS_RESET, 0);
+    close (fd);
+    if (rc < 0) goto OnErrorExit;
+    return 0;
+
+OnErrorExit:
+    EXT_ERROR ("[pcsc-usb-reset] dev=%s err=%s", usbdev, strerror(errno));
+    return -1;
+}
+
+// reader is back once it answers a non blocking status query
+static int pcscReaderAlive (pcscHandleT *handle) {
+    SCARD_READERSTATE state= {.szReader= handle->readerName, .dwCurrentState= SCARD_STATE_UNAWARE};
+    long rv;
+
+    rv= pcscBackend->getStatusChange (handle->hContext, 0, &state, 1);
+    if (rv != SCARD_S_SUCCESS && rv != SCARD_E_TIMEOUT) return 0;
+    if (state.dwEventState & (SCARD_STATE_UNKNOWN | SCARD_STATE_UNAVAILABLE)) return 0;
+    return 1;
+}
+
+// after usb re-enumeration pcscd may change reader trailing index " XX YY", exact name is
+// searched first (another identical reader may hold a close name), then without index
+static int pcscReaderFind (pcscHandleT *handle) {
+    DWORD listLen= SCARD_AUTOALLOCATE;
+    LPSTR listStr= NULL;
+    size_t nameLen= strlen (handle->readerName);
+    char *match= NULL;
+
+    if (nameLen > 6) nameLen -= 6;
+    if (pcscBackend->listReaders (handle->hContext, NULL, (LPSTR)&listStr, &listLen) != SCARD_S_SUCCESS) return 0;
+    for (char *ptr= listStr; *ptr != '\0'; ptr += strlen(ptr)+1) {
+        if (!strcmp (ptr, handle->readerName)) {
+            pcscBackend->freeMemory (handle->hContext, listStr);
+            return 1;
+        }
+        if (!match && !strncmp (ptr, handle->readerName, nameLen)) match= ptr;
+    }
+    if (match) {
+        free (handle->wdgReaderName);
+        handle->wdgReaderName= strdup (match);
+        handle->readerName= handle->wdgReaderName;
+    }
+    pcscBackend->freeMemory (handle->hContext, listStr);
+    return match != NULL;
+}
+
+// reconnect card if one is present within the reader
+static long pcscWatchdogRebind (pcscHandleT *handle) {
+    SCARD_READERSTATE state= {.szReader= handle->readerName, .dwCurrentState= SCARD_STATE_UNAWARE};
+    long rv;
+
+    rv= pcscBackend->getStatusChange (handle->hContext, 0, &state, 1);
+    if (rv != SCARD_S_SUCCESS || !(state.dwEventState & SCARD_STATE_PRESENT)) return SCARD_S_SUCCESS;
+
+    rv = pcscBackend->connect(handle->hContext, handle->readerName, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &handle->hCard, &handle->activeProtocol);
+    if (rv != SCARD_S_SUCCESS) return rv;
+    handle->pioSendPci= (handle->activeProtocol == SCARD_PROTOCOL_T0) ? SCARD_PCI_T0 : SCARD_PCI_T1;
+    return SCARD_S_SUCCESS;
+}
+
+static int pcscWatchdogStep (pcscHandleT *handle, pcscWatchdogStepE step, int rebind) {
+    char usbdev[64];
+    long rv;
+
+    switch (step) {
+        case PCSC_WDG_RECONNECT:
+            rv= pcscBackend->reconnect (handle->hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, SCARD_RESET_CARD, &handle->activeProtocol);
+            if (rv != SCARD_S_SUCCESS && rv != SCARD_E_NO_SMARTCARD && rv != SCARD_W_REMOVED_CARD) goto OnErrorExit;
+            break;
+
+        case PCSC_WDG_USBRESET:
+            if (pcscReaderUsbDev (handle, usbdev, sizeof(usbdev))) {
+                if (!handle->wdgSimulate) goto OnErrorExit;
+                snprintf (usbdev, sizeof(usbdev), "unmapped");
+            }
+            if (handle->wdgSimulate) {
+                EXT_NOTICE ("[pcsc-watchdog] reader=%s simulated usb reset dev=%s", handle->readerName, usbdev);
+            } else if (pcscUsbReset (usbdev)) {
+                handle->error= "Fail to reset reader usb device";
+                goto OnErrorExit;
+            }
+            // fallthrough: reader re-enumerates, pcscd context is rebuilt
+
+        case PCSC_WDG_CONTEXT:
+            pcscBackend->releaseContext (handle->hContext);
+            rv = pcscBackend->establishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &handle->hContext);
+            if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+
+            for (int wait=0; !pcscReaderFind (handle); wait += PCSC_WDG_POLL_MS) {
+                if (wait >= PCSC_WDG_WAIT_MS) {
+                    handle->error= "Reader did not reappear after reset";
+                    goto OnErrorExit;
+                }
+                usleep (PCSC_WDG_POLL_MS*1000);
+            }
+            if (rebind) {
+                rv= pcscWatchdogRebind (handle);
+                if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+            }
+            break;
+
+        default:
+            goto OnErrorExit;
+    }
+
+    // simulation forces escalation up to requested step
+    if (handle->wdgSimulate > step) {
+        handle->error= "Simulated reader failure";
+        return -1;
+    }
+    if (!pcscReaderAlive (handle)) {
+        handle->error= "Reader still not responding";
+        return -1;
+    }
+    return 0;
+
+OnErrorExit:
+    if (!handle->error) handle->error= pcsc_stringify_error(rv);
+    return -1;
+}
+
+// escalate recovery steps until reader answers, return recovering step or -1
+static int pcscWatchdogRun (pcscHandleT *handle, int rebind) {
+    u_int64_t start= pcscNowMs();
+    int err;
+
+    handle->wdgPending= 0;
+    for (pcscWatchdogStepE step= PCSC_WDG_RECONNECT; step <= PCSC_WDG_USBRESET; step++) {
+        handle->error= NULL;
+        err= pcscWatchdogStep (handle, step, rebind);
+        EXT_NOTICE ("[pcsc-watchdog] reader=%s step=%s %s after %ldms%s%s", handle->readerName, pcscWdgStepLabels[step], err ? "failed" : "recovered", (long)(pcscNowMs()-start), err ? " err=" : "", err ? handle->error : "");
+        if (handle->verbose) fprintf (stderr, " -- watchdog: reader=%s step=%s %s (%ldms)\n", handle->readerName, pcscWdgStepLabels[step], err ? "failed" : "recovered", (long)(pcscNowMs()-start));
+        if (!err) {
+            handle->wdgErrors= 0;
+            handle->authActive= 0;
+            handle->bitrate= 0;
+            return step;
+        }
+    }
+    EXT_ERROR ("[pcsc-watchdog] reader=%s unrecoverable after %ldms", handle->readerName, (long)(pcscNowMs()-start));
+    return -1;
+}
+
+// synchronous recovery, with a running monitor thread recovery is done by the monitor
+int pcscWatchdogRecover (pcscHandleT *handle) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    return pcscWatchdogRun (handle, !handle->tid);
+}
+
+// forget current card (removed or replaced during a bounce)
+static void pcscMonitorForget (pcscHandleT *handle) {
+    handle->uuid=0;
+    handle->cardUidLen=0;
+    handle->authActive=0;
+    pcscDivKeyFlush (handle);
+    handle->cardId=ATR_UNKNOWN;
+    handle->model= NULL;
+    handle->t2Model= NULL;
+    handle->apduShort= 0;
+    handle->felicaIdm[0]= 0;
+    handle->bitrate= 0;
+    handle->bitrateErrors= 0;
+    pcscReadAheadFlush (handle);
+    pcscStoreFlush (handle);
+}
+
+// wait until reader state stays unchanged for debounce window, intermediate states are coalesced.
+// A continuous bounce storm is settled after PCSC_DEBOUNCE_SPAN windows
+static long pcscMonitorSettle (pcscHandleT *handle, SCARD_READERSTATE *state, int *emptied) {
+    u_int64_t now= pcscNowMs();
+    u_int64_t limit= now + handle->debounce*PCSC_DEBOUNCE_SPAN;
+    u_int64_t stable= now + handle->debounce;
+    long rv;
+
+    while (now < stable) {
+        rv= pcscBackend->getStatusChange (handle->hContext, (DWORD)(stable-now), state, 1);
+        if (rv == SCARD_E_TIMEOUT) break;
+        if (rv != SCARD_S_SUCCESS) return rv;
+        now= pcscNowMs();
+        if (state->dwCurrentState != state->dwEventState) {
+            state->dwCurrentState= state->dwEventState;
+            handle->monStats.events++;
+            handle->monStats.coalesced++;
+            if (state->dwEventState & SCARD_STATE_EMPTY) *emptied= 1;
+            stable= now + handle->debounce;
+            if (stable > limit) stable= limit;
+        }
+    }
+    return SCARD_S_SUCCESS;
+}
+
+// card seen within duplicate tap window
+static int pcscMonitorTapRecent (pcscHandleT *handle, u_int64_t uuid) {
+    u_int64_t now= pcscNowMs();
+
+    for (int idx=0; idx < PCSC_TAP_MAX; idx++) {
+        if (handle->taps[idx].uuid == uuid) return (now - handle->taps[idx].seenMs) < handle->dupTap;
+    }
+    return 0;
+}
+
+// remember card removal time, oldest entry is replaced
+static void pcscMonitorTapSeen (pcscHandleT *handle, u_int64_t uuid) {
+    int slot=0;
+
+    for (int idx=0; idx < PCSC_TAP_MAX; idx++) {
+        if (handle->taps[idx].uuid == uuid) {
+            slot= idx;
+            break;
+        }
+        if (handle->taps[idx].seenMs < handle->taps[slot].seenMs) slot= idx;
+    }
+    handle->taps[slot].uuid= uuid;
+    handle->taps[slot].seenMs= pcscNowMs();
+}
+
+int pcscMonitorStats (pcscHandleT *handle, pcscMonitorStatsT *stats) {
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    *stats= handle->monStats;
+    return 0;
+}
+
 static void *pcscMonitorThread (void *ptr) {
     pcscThreadT *threadCtx = (pcscThreadT*) ptr;
     pcscHandleT *handle = threadCtx->pcsc;
@@ -506,11 +3622,26 @@ static void *pcscMonitorThread (void *ptr) {
 
     // loop forever until reader is disconnected
     while (1) {
+            if (handle->killed) goto OnCancelExit;
+
+            // watchdog request from transmit path (callback runs within this thread). Context and
+            // card handles are rebuilt while holding reader, other threads transmit under scheduler
+            if (handle->wdgPending) {
+                pcscSchedAcquire (handle, PCSC_PRIO_INTERACTIVE, 0);
+                err= pcscWatchdogRun (handle, 0);
+                pcscSchedRelease (handle);
+                if (err < 0) goto OnErrorExit;
+                rgReaderStates.szReader = handle->readerName;
+                rgReaderStates.dwCurrentState = SCARD_STATE_UNAWARE; // card is reported again
+                handle->monReported= -1;
+            }
+
             // wait timeout second for card to be inserted
-            rv = SCardGetStatusChange(handle->hContext, handle->timeout*1000, &rgReaderStates, 1);
+            rv = pcscBackend->getStatusChange(handle->hContext, handle->timeout ? handle->timeout : INFINITE, &rgReaderStates, 1);
 
             switch (rv) {
                 case SCARD_E_CANCELLED:
+                    if (handle->wdgPending && !handle->killed) continue;
                     goto OnCancelExit;
 
                 case SCARD_E_TIMEOUT:
@@ -522,13 +3653,45 @@ static void *pcscMonitorThread (void *ptr) {
 
                         // update pcsc handle status change
                         rgReaderStates.dwCurrentState = rgReaderStates.dwEventState;
+                        handle->monStats.events++;
+                        int emptied= (rgReaderStates.dwEventState & SCARD_STATE_EMPTY) != 0;
+
+                        // flaky contact: only the state which stays stable for debounce window is handled
+                        if (handle->debounce) {
+                            rv= pcscMonitorSettle (handle, &rgReaderStates, &emptied);
+                            if (rv == SCARD_E_CANCELLED) {
+                                if (handle->wdgPending && !handle->killed) continue;
+                                goto OnCancelExit;
+                            }
+                            if (rv != SCARD_S_SUCCESS) {
+                                handle->wdgPending= 1;
+                                continue;
+                            }
+                        }
+
+                        // removal and insertion coalesced, previous card is forgotten as if removed
+                        int present= (rgReaderStates.dwEventState & SCARD_STATE_PRESENT) != 0;
+                        int bounced= present && emptied && handle->monReported == 1;
+                        u_int64_t prevUuid= handle->uuid;
+                        if (handle->debounce && !present && handle->monReported == 0) continue; // bounce ended empty, nothing to report
+                        int suppress= 0;
+
+                        // card state is updated ahead of queued requests, callback runs unscheduled
+                        pcscSchedAcquire (handle, PCSC_PRIO_INTERACTIVE, 0);
+                        if (bounced) pcscMonitorForget (handle);
 
                         // card was inserted retreive uuid/atr
-                        if (rgReaderStates.dwEventState & SCARD_STATE_PRESENT) {
+                        if (present) {
 
-                            rv = SCardConnect(handle->hContext, handle->readerName, SCARD_SHARE_SHARED,
+                            PCSC_PROBE (card__insert, handle->readerName, rgReaderStates.dwEventState);
+                            rv = pcscBackend->connect(handle->hContext, handle->readerName, SCARD_SHARE_SHARED,
                                 SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &handle->hCard, &handle->activeProtocol);
-                            if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+                            PCSC_PROBE (card__connect, handle->readerName, rv, handle->activeProtocol);
+                            if (rv != SCARD_S_SUCCESS) {
+                                if (rv != SCARD_W_REMOVED_CARD && rv != SCARD_E_NO_SMARTCARD) handle->wdgPending= 1; // else card already left
+                                pcscSchedRelease (handle);
+                                continue;
+                            }
 
                             // set up the io request
                             switch(handle->activeProtocol) {
@@ -541,22 +3704,52 @@ static void *pcscMonitorThread (void *ptr) {
                                     break;
                                 default:
                                     EXT_CRITICAL("[pcsc-sccard-check] SCARD_PCI Unknown protocol (SCardConnect)");
+                                    pcscSchedRelease (handle);
                                     goto OnErrorExit;
                             }
+
+                            // same card back within duplicate tap window (or after a bounce) is not reported again
+                            if (handle->dupTap || (bounced && prevUuid)) {
+                                u_int64_t uuid= pcscGetCardUuid (handle);
+                                if (uuid && bounced) suppress= (uuid == prevUuid);
+                                else if (uuid) suppress= pcscMonitorTapRecent (handle, uuid);
+                                if (suppress && !bounced) handle->monSuppressed= 1; // its removal is not reported either
+                            }
                         }
 
                         // card was removed cleanup UUID/ATR
                         if (rgReaderStates.dwEventState & SCARD_STATE_EMPTY) {
-                            handle->uuid=0;
-                            handle->cardId=ATR_UNKNOWN;
+                            PCSC_PROBE (card__remove, handle->readerName, handle->uuid);
+                            if (handle->dupTap && handle->uuid) pcscMonitorTapSeen (handle, handle->uuid);
+                            pcscMonitorForget (handle);
+                            suppress= handle->monSuppressed;
+                            handle->monSuppressed= 0;
+                        }
+                        pcscSchedRelease (handle);
+
+                        if (suppress) {
+                            handle->monStats.suppressed++;
+                            handle->monReported= present;
+                            continue;
                         }
+                        handle->monReported= present;
                     }
 
-                    if (handle->verbose) fprintf (stderr, "\n -- async: reader=%s status=0x%lx\n", handle->readerName, rgReaderStates.dwEventState);
+                    pcscTraceRecord (handle, PCSC_TRACE_STATUS, "status", 0, rgReaderStates.dwEventState, NULL, 0, NULL);
+                    handle->monStats.delivered++;
                     err= threadCtx->callback (handle, rgReaderStates.dwEventState, threadCtx->userData);
                     if (err < 0) goto OnErrorExit;
                     if (err > 0) goto OnRequestExit;
                     break;
+                case SCARD_E_NO_SERVICE:
+                case SCARD_E_SERVICE_STOPPED:
+                case SCARD_E_READER_UNAVAILABLE:
+                case SCARD_E_UNKNOWN_READER:
+                case SCARD_E_INVALID_HANDLE:
+                    // reader or pcscd lost, let watchdog rebuild context before giving up
+                    handle->wdgPending= 1;
+                    break;
+
                 default:
                     goto OnErrorExit;
         }
@@ -566,12 +3759,14 @@ OnRequestExit:
     EXT_DEBUG ("[pcsc-thread-monitor] card-remove exit tid=0x%lx", pthread_self());
     free (threadCtx);
     handle->tid=0;
+    handle->killed= 0;
     return NULL;
 
 OnCancelExit:
     EXT_DEBUG ("[pcsc-thread-monitor] session-cancel exit tid=0x%lx", pthread_self());
     free(threadCtx);
     handle->tid=0;
+    handle->killed= 0;
     return NULL;
 
 OnErrorExit:
@@ -579,6 +3774,7 @@ OnErrorExit:
     EXT_ERROR ("[pcsc-thread-monitor] Reader not avaliable tid=0x%lx exited err=%s", pthread_self(), handle->error);
     free(threadCtx);
     handle->tid=0;
+    handle->killed= 0;
     return NULL;
 }
 
@@ -596,6 +3792,8 @@ ulong pcscMonitorReader (pcscHandleT *handle, pcscStatusCbT callback, void *user
     threadCtx->userData= userData;
     threadCtx->pcsc= handle;
     threadCtx->callback=callback;
+    handle->monReported= -1;
+    handle->monSuppressed= 0;
 
     err= pthread_create (&threadCtx->tid, NULL, pcscMonitorThread, (void*) threadCtx);
     if (err) {
@@ -622,7 +3820,17 @@ int pcscMonitorWait (pcscHandleT *handle, pcscMonitorActionE action, ulong tid)
 
         case PCSC_MONITOR_CANCEL:
             EXT_DEBUG ("[pcsc-thread-cancel] tid=0x%lx (pcscMonitorWait)", tid);
-            SCardCancel (handle->hContext);
+            pcscBackend->cancel (handle->hContext);
+            break;
+
+        // abort callback work before next command, stop monitor and wait for it
+        case PCSC_MONITOR_KILL:
+            EXT_DEBUG ("[pcsc-thread-kill] tid=0x%lx (pcscMonitorWait)", tid);
+            handle->killed= 1;
+            pcscBackend->cancel (handle->hContext);
+            if (tid && (pthread_t)tid == pthread_self()) break; // from callback, monitor clears killed on exit
+            if (tid) pthread_join ((pthread_t)tid, NULL);
+            handle->killed= 0;
             break;
 
         default:
@@ -643,12 +3851,19 @@ int pcscDisconnect (pcscHandleT *handle) {
     long rv;
 
     // abandon any pending operation
-    SCardCancel (handle->hContext);
+    pcscBackend->cancel (handle->hContext);
 
     // disconnect reader
-  	rv = SCardReleaseContext(handle->hContext);
+  	rv = pcscBackend->releaseContext(handle->hContext);
 	if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
 
+    pcscDivKeyFlush (handle);
+    pcscKeyMemoFlush (handle);
+    free (handle->wdgReaderName);
+    free (handle->trace);
+    free (handle->tracePath);
+    pthread_cond_destroy (&handle->schedCond);
+    pthread_mutex_destroy (&handle->schedLock);
     handle->magic=0;
     free (handle);
     return 0;
@@ -661,12 +3876,22 @@ OnErrorExit:
 pcscHandleT *pcscList(const char** readerList, ulong *readerMax) {
 
     pcscHandleT *handle= calloc (1, sizeof(pcscHandleT));
-    handle->timeout= PCSC_DFLT_TIMEOUT;
+    handle->timeout= PCSC_DFLT_TIMEOUT*1000;
+    handle->retryMax= PCSC_RETRY_DFLT;
+    handle->mifareReadMax= PCSC_MIFARE_READ_MAX;
   	handle->activeProtocol= -1;
+    pcscTraceAlloc (handle, PCSC_TRACE_DFLT);
+
+    pthread_condattr_t condAttr;
+    pthread_condattr_init (&condAttr);
+    pthread_condattr_setclock (&condAttr, CLOCK_MONOTONIC);
+    pthread_cond_init (&handle->schedCond, &condAttr);
+    pthread_condattr_destroy (&condAttr);
+    pthread_mutex_init (&handle->schedLock, NULL);
     long rv;
 
     // connect to pcscd as system user
-	rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &handle->hContext);
+	rv = pcscBackend->establishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &handle->hContext);
 	if (rv != SCARD_S_SUCCESS) {
         EXT_CRITICAL ("[pcsc-init-fail] to found pcscd ressource manager [check pcscd -d]. (SCardEstablisscardCtx=%s)", pcsc_stringify_error(rv));
         goto OnErrorExit;
@@ -675,7 +3900,7 @@ pcscHandleT *pcscList(const char** readerList, ulong *readerMax) {
     // get reader list (hoops!!! a string with token split by '\0')
     DWORD readerLiStatusLen=SCARD_AUTOALLOCATE;
     LPSTR readerListStr= NULL;
-  	rv = SCardListReaders(handle->hContext, NULL, (LPSTR)&readerListStr, &readerLiStatusLen);
+  	rv = pcscBackend->listReaders(handle->hContext, NULL, (LPSTR)&readerListStr, &readerLiStatusLen);
   	if (rv != SCARD_S_SUCCESS) {
         EXT_CRITICAL ("[pcsc-reader-scan] Fail to list pcscd reader [check pcsc-ccid supported reader]. (SCardListReaders=%s)", pcsc_stringify_error(rv));
         goto OnErrorExit;
@@ -739,19 +3964,159 @@ OnErrorExit:
     return NULL;
 }
 
+// send a reader escape command through SCardControl. When no card is connected
+// reader is opened in direct mode for the time of the exchange.
+int pcscReaderControl (pcscHandleT *handle, const u_int8_t *cmd, ulong cmdLen, u_int8_t *resp, ulong *respLen)
+{
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    SCARDHANDLE hCtrl= handle->hCard;
+    DWORD protocol, rlen=0;
+    long rv=SCARD_E_INVALID_HANDLE;
+
+    if (hCtrl) {
+        rv= pcscBackend->control (hCtrl, PCSC_IOCTL_CCID_ESCAPE, cmd, cmdLen, resp, *respLen, &rlen);
+    }
+
+    // no card or card was removed, use a direct connection
+    if (rv != SCARD_S_SUCCESS) {
+        rv= pcscBackend->connect (handle->hContext, handle->readerName, SCARD_SHARE_DIRECT, SCARD_PROTOCOL_UNDEFINED, &hCtrl, &protocol);
+        if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+        rv= pcscBackend->control (hCtrl, PCSC_IOCTL_CCID_ESCAPE, cmd, cmdLen, resp, *respLen, &rlen);
+        pcscBackend->disconnect (hCtrl, SCARD_LEAVE_CARD);
+        if (rv != SCARD_S_SUCCESS) goto OnErrorExit;
+    }
+
+    if (handle->verbose) fprintf (stderr, " -- control reader=%s cmd=0x%02X%02X%02X len=%ld resp=%ld\n", handle->readerName,
+        cmdLen > 0 ? cmd[0] : 0, cmdLen > 1 ? cmd[1] : 0, cmdLen > 2 ? cmd[2] : 0, cmdLen, (long)rlen);
+    *respLen= rlen;
+    return 0;
+
+OnErrorExit:
+    handle->error= pcsc_stringify_error(rv);
+    EXT_DEBUG ("[pcsc-control-fail] reader=%s err=%s (pcscReaderControl)", handle->readerName, handle->error);
+    return -1;
+}
+
+// ACR122U pseudo apdu escape, reader answers 90 <value>
+static int pcscAcrEscape (pcscHandleT *handle, const char *action, BYTE *cmd, ulong cmdLen, BYTE *value) {
+    BYTE resp[16];
+    ulong rlen= sizeof(resp);
+    int err;
+
+    err= pcscReaderControl (handle, cmd, cmdLen, resp, &rlen);
+    if (err) goto OnErrorExit;
+    if (rlen < 2 || resp[rlen-2] != 0x90) {
+        handle->error= "Reader escape command refused";
+        goto OnErrorExit;
+    }
+    if (value) *value= resp[rlen-1];
+    return 0;
+
+OnErrorExit:
+    EXT_NOTICE ("[pcsc-control-refused] reader=%s action=%s err=%s", handle->readerName, action, handle->error);
+    return -1;
+}
+
+// apply first profile matching reader name, return -1 when one setting was refused
+int pcscReaderSetup (pcscHandleT *handle, const pcscCtrlProfileT *profiles, int count)
+{
+    assert (handle->magic == PCSC_HANDLE_MAGIC);
+    const pcscCtrlProfileT *profile=NULL;
+    int status=0;
+
+    for (int idx=0; idx < count; idx++) {
+        if (!profiles[idx].reader || strcasestr (handle->readerName, profiles[idx].reader)) {
+            profile= &profiles[idx];
+            break;
+        }
+    }
+    if (!profile) return 0;
+
+    if (profile->timeout >= 0) {
+        // timeout unit is 5s, 0xFF means wait forever (longer timeouts are clamped to it)
+        int units= profile->timeout ? (profile->timeout+4)/5 : 0;
+        BYTE timeout= (BYTE)(units > 0xFF ? 0xFF : units);
+        BYTE cmd[]= {0xFF, 0x00, 0x41, timeout, 0x00};
+        if (pcscAcrEscape (handle, "timeout", cmd, sizeof(cmd), NULL)) status=-1;
+    }
+
+    if (profile->polling >= 0 || profile->interval >= 0) {
+        // read/modify/write PICC operating parameter (bit7=auto polling, bit5=250ms interval)
+        BYTE param, getCmd[]= {0xFF, 0x00, 0x50, 0x00, 0x00};
+        if (pcscAcrEscape (handle, "picc-get", getCmd, sizeof(getCmd), &param)) {
+            status=-1;
+        } else {
+            if (profile->polling >= 0) param= (BYTE)(profile->polling ? param|0x80 : param&~0x80);
+            if (profile->interval >= 0) param= (BYTE)(profile->interval <= 250 ? param|0x20 : param&~0x20);
+            BYTE setCmd[]= {0xFF, 0x00, 0x51, param, 0x00};
+            if (pcscAcrEscape (handle, "picc-set", setCmd, sizeof(setCmd), NULL)) status=-1;
+        }
+    }
+
+    if (profile->buzzer >= 0) {
+        BYTE cmd[]= {0xFF, 0x00, 0x52, (BYTE)(profile->buzzer ? 0xFF : 0x00), 0x00};
+        if (pcscAcrEscape (handle, "buzzer", cmd, sizeof(cmd), NULL)) status=-1;
+    }
+
+    if (profile->led >= 0) {
+        BYTE cmd[]= {0xFF, 0x00, 0x40, (BYTE)profile->led, 0x04, 0x00, 0x00, 0x00, 0x00};
+        if (pcscAcrEscape (handle, "led", cmd, sizeof(cmd), NULL)) status=-1;
+    }
+
+    for (int idx=0; idx < profile->ecount; idx++) {
+        BYTE resp[256];
+        ulong rlen= sizeof(resp);
+        if (pcscReaderControl (handle, profile->escapes[idx], profile->elens[idx], resp, &rlen)) status=-1;
+    }
+
+    if (handle->verbose) fprintf (stderr, " -- control reader=%s profile=%s status=%d\n", handle->readerName, profile->reader ? profile->reader : "any", status);
+    return status;
+}
+
 // setter for reader options
 int pcscSetOpt (pcscHandleT *handle, pcscOptsE option, ulong value) {
     assert (handle->magic == PCSC_HANDLE_MAGIC);
 
+    // retry budget 0 disables retries
+    if (option == PCSC_OPT_RETRY) {
+        handle->retryMax= value;
+        return 0;
+    }
+
     // if no value keep defaults
     if (value) {
         switch (option) {
         case PCSC_OPT_TIMEOUT:
+            handle->timeout= value*1000;
+            break;
+        case PCSC_OPT_TIMEOUT_MS:
             handle->timeout= value;
             break;
         case PCSC_OPT_VERBOSE:
             handle->verbose= value;
             break;
+        case PCSC_OPT_BITRATE:
+            if (pcscBitrateIndex ((int)value) < 0) goto OnErrorExit;
+            handle->bitrateMax= value;
+            break;
+#ifdef PCSC_WATCHDOG_SIM
+        case PCSC_OPT_WATCHDOG_SIM:
+            handle->wdgSimulate= value;
+            break;
+#endif
+        case PCSC_OPT_TRACE:
+            if (pcscTraceAlloc (handle, value)) goto OnErrorExit;
+            break;
+        case PCSC_OPT_DEBOUNCE:
+            handle->debounce= value;
+            break;
+        case PCSC_OPT_DUPTAP:
+            handle->dupTap= value;
+            break;
+        case PCSC_OPT_READAHEAD:
+            handle->raDepth= value;
+            handle->raEnabled= 1;
+            break;
 
         default:
             goto OnErrorExit;
@@ -760,7 +4125,7 @@ int pcscSetOpt (pcscHandleT *handle, pcscOptsE option, ulong value) {
     return 0;
 
 OnErrorExit:
-    EXT_ERROR ("[pcsc-opt-unknown] Invalid option (pcscSetOpt)");
+    EXT_ERROR ("[pcsc-opt-unknown] Invalid option or value option=%d value=%ld (pcscSetOpt)", option, value);
     return -1;
 }
 
@@ -784,10 +4149,11 @@ OnErrorExit:
 }
 
 // Create access control bit trailer https://www.nxp.com/docs/en/data-sheet/MF1S70YYX_V1.pdf
-static size_t pcscMifareTrailer (pcscHandleT *handle, const pcscTrailerT *trailer, u_int8_t *dataBuf, size_t dataLen)
+static size_t pcscMifareTrailer (pcscHandleT *handle, const char *uid, const pcscTrailerT *trailer, u_int8_t sector, u_int8_t *dataBuf, size_t dataLen)
 {
     static size_t dlen= 2*PCSC_MIFARE_KEY_LEN + PCSC_MIFARE_ACL_LEN;
     u_int8_t dfltAcls[]={0xFF,0x07,0x80,0x69};
+    const u_int8_t *keyA, *keyB=NULL;
 
     if (trailer->keyA->klen != PCSC_MIFARE_KEY_LEN || (trailer->keyB && trailer->keyB->klen != PCSC_MIFARE_KEY_LEN)) {
         handle->error= "Mifare Keylen should equal PCSC_MIFARE_KEY_LEN(len:6)";
@@ -804,14 +4170,19 @@ static size_t pcscMifareTrailer (pcscHandleT *handle, const pcscTrailerT *traile
         goto OnErrorExit;
     }
 
+    // diversified keys are written as computed for this card/sector
+    keyA= trailer->keyA->master ? pcscDivKeyGet (handle, uid, trailer->keyA, sector) : trailer->keyA->kval;
+    if (trailer->keyB) keyB= trailer->keyB->master ? pcscDivKeyGet (handle, uid, trailer->keyB, sector) : trailer->keyB->kval;
+    if (!keyA || (trailer->keyB && !keyB)) goto OnErrorExit;
+
     // default reset data to NULL and write KEYA
     memset (dataBuf,0, dlen);
-    memcpy (&dataBuf[0], trailer->keyA->kval, PCSC_MIFARE_KEY_LEN);
+    memcpy (&dataBuf[0], keyA, PCSC_MIFARE_KEY_LEN);
 
     if (trailer->acls) memcpy (&dataBuf[PCSC_MIFARE_KEY_LEN], trailer->acls, PCSC_MIFARE_ACL_LEN);
     else memcpy (&dataBuf[PCSC_MIFARE_KEY_LEN], dfltAcls, PCSC_MIFARE_ACL_LEN);
 
-    if (trailer->keyB) memcpy (&dataBuf[PCSC_MIFARE_KEY_LEN+PCSC_MIFARE_ACL_LEN], trailer->keyB->kval, PCSC_MIFARE_KEY_LEN);
+    if (keyB) memcpy (&dataBuf[PCSC_MIFARE_KEY_LEN+PCSC_MIFARE_ACL_LEN], keyB, PCSC_MIFARE_KEY_LEN);
 
     return dlen;
 
@@ -855,7 +4226,7 @@ int pcsWriteTrailer (pcscHandleT *handle, const char *uid, u_int8_t secIdx, u_in
                 goto OnErrorExit;
             }
 
-            size_t dlen= pcscMifareTrailer (handle, trailer, data, sizeof(data));
+            size_t dlen= pcscMifareTrailer (handle, uid, trailer, pcscMifareSector (secIdx, blkIdx), data, sizeof(data));
             if (dlen == 0) goto OnErrorExit;
 
             err= pcsWriteBlock (handle, uid, secIdx, blkIdx, data, dlen, key);
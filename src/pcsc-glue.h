@@ -17,6 +17,7 @@
 #pragma once
 
 #include <sys/types.h>
+#include <stdio.h>
 
 #define PCSC_HANDLE_MAGIC 852963147
 #define PCSC_DFLT_TIMEOUT 60 // default reader change status in seconds
@@ -24,6 +25,20 @@
 #define PCSC_MIFARE_STATUS_LEN 2 // number of byte added to read buffer for Mifare status
 #define PCSC_MIFARE_KEY_LEN 6 // keyA/B len (byte)
 #define PCSC_MIFARE_ACL_LEN 3+1 // Access Control Bits len (3 bytes + 1 byte userdata)
+#define PCSC_APDU_SW_OK 0x9000 // ISO7816-4 normal processing status
+#define PCSC_APDU_HEADER_MAX 9 // extended apdu header+lc+le overhead
+#define PCSC_DIVERSIFY_MASTER_LEN 16 // AES-128 diversification master key len (byte)
+#define PCSC_RETRY_DFLT 2 // default retry budget per command
+#define PCSC_WDG_ERR_MAX 5 // consecutive reader failures/stalls before watchdog recovery
+#define PCSC_WDG_SLOW_MS 2000 // exchange slower than this is a stall
+#define PCSC_STATS_BUCKETS 24 // log2 latency buckets (usec), bucket n holds [2^(n-1), 2^n[
+#define PCSC_KEY_RING_MAX 8 // max keys within a key ring
+#define PCSC_DIVERSIFY_SYSID_MAX 19 // AN10922 input is max 31 bytes (1+uid(10)+sector+sysid)
+#define PCSC_TRACE_DFLT 256 // default binary trace ring size (events)
+#define PCSC_TRACE_MAX 65536
+#define PCSC_STORE_FIELDS_MAX 16 // record store directory entries
+#define PCSC_STORE_SECTORS_MAX 21 // record store sectors (3 blocks each, 64 bits free map)
+#define PCSC_STORE_RECORD_MAX 255 // record store field max length (byte)
 
 // redefine debug/log to avoid conflict
 #ifndef EXT_EMERGENCY
@@ -42,8 +57,38 @@ typedef enum {
     PCSC_OPT_UNKNOWN=0,
     PCSC_OPT_TIMEOUT,
     PCSC_OPT_VERBOSE,
+    PCSC_OPT_BITRATE,  // ISO14443-4 max bitrate in kbit/s (106|212|424|848)
+    PCSC_OPT_RETRY,    // transient error retry budget per command (default PCSC_RETRY_DFLT)
+    PCSC_OPT_WATCHDOG_SIM, // simulated reader failure, recovery only succeeds at given pcscWatchdogStepE (build option PCSC_WATCHDOG_SIM)
+    PCSC_OPT_TRACE,    // binary trace ring size in events, rounded to power of 2 (default PCSC_TRACE_DFLT)
+    PCSC_OPT_DEBOUNCE, // monitor reports a reader state once stable for given ms (default off)
+    PCSC_OPT_DUPTAP,   // monitor does not report a card removed less than given ms ago (default off)
+    PCSC_OPT_TIMEOUT_MS, // same as PCSC_OPT_TIMEOUT in milliseconds
+    PCSC_OPT_READAHEAD, // Mifare classic learned successor sectors queued for prefetch after a read (default off)
 } pcscOptsE;
 
+typedef enum {
+    PCSC_WDG_NONE=0,
+    PCSC_WDG_RECONNECT,  // reactivate card (SCardReconnect)
+    PCSC_WDG_CONTEXT,    // re-establish pcscd context and wait for reader
+    PCSC_WDG_USBRESET,   // USBDEVFS_RESET reader then re-establish context
+} pcscWatchdogStepE;
+
+typedef enum {
+    PCSC_ERR_NONE=0,
+    PCSC_ERR_TRANSIENT,  // RF/transport glitch, command may succeed when resent
+    PCSC_ERR_AUTH,       // authentication refused or lost
+    PCSC_ERR_CARD_GONE,  // card left the field
+    PCSC_ERR_FATAL,      // reader/service failure or command refused
+    PCSC_ERR_ABORTED,    // deadline expired or cancelled before sending command
+} pcscErrClassE;
+
+typedef enum {
+    PCSC_DEADLINE_GROUP=0, // set by group/request owner
+    PCSC_DEADLINE_CMD,     // set per command (config command 'timeout')
+    PCSC_DEADLINE_COUNT  // trailer
+} pcscDeadlineE;
+
 typedef enum {
     ATR_UNKNOWN=0,
     ATR_MIFARE_1K,
@@ -55,6 +100,25 @@ typedef enum {
     ATR_BANK_FR,
 } atrCardidEnumT;
 
+typedef enum {
+    PCSC_CAP_AUTH   = 1<<0, // Mifare classic sector authentication
+    PCSC_CAP_VALUE  = 1<<1, // Mifare classic value blocks
+    PCSC_CAP_TYPE2  = 1<<2, // NFC type-2 pages (Ultralight/NTAG)
+    PCSC_CAP_FELICA = 1<<3, // FeliCa without encryption
+    PCSC_CAP_APDU   = 1<<4, // ISO7816-4 apdu
+} pcscCardCapsE;
+
+typedef struct {
+    const char *label;     // model label from ATR database
+    const char *info;      // ATR database description
+    atrCardidEnumT cardId; // card family used by commands
+    int sectors;           // sector count (0 when not applicable)
+    int blocks;            // blocks per sector
+    int blkLen;            // block size in bytes
+    int size;              // memory size in bytes (0 when detected from card)
+    ulong caps;            // pcscCardCapsE mask
+} pcscCardModelT;
+
 typedef enum {
     PCSC_MONITOR_UNKNOWN=0,
     PCSC_MONITOR_WAIT,
@@ -62,13 +126,134 @@ typedef enum {
     PCSC_MONITOR_KILL,
 } pcscMonitorActionE;
 
-typedef struct {
+typedef enum {
+    PCSC_VALUE_UNKNOWN=0,
+    PCSC_VALUE_FORMAT,    // store value and format block as value block
+    PCSC_VALUE_INCREMENT,
+    PCSC_VALUE_DECREMENT,
+    PCSC_VALUE_RESTORE,   // copy value block to dst block (restore+transfer)
+    PCSC_VALUE_READ,
+} pcscValueOpE;
+
+typedef struct pcscKeyS {
     const char *uid;
     u_int8_t *kval;
     u_int8_t klen;
     u_int8_t kidx;
+    u_int8_t *master;  // AES-128 master key, when set key value is diversified per card/sector
+    u_int8_t *sysid;   // optional system identifier appended to diversification input
+    u_int8_t slen;
+    const struct pcscKeyS **ring; // key ring: keys tried in order, learned key first
+    u_int8_t rcount;
 } pcscKeyT;
 
+typedef struct {
+    ulong attempts;  // authentications sent to card
+    ulong failures;  // authentications refused by card
+    ulong saved;     // attempts avoided by learned ring keys
+    ulong learned;   // (uuid,sector) ring keys learned
+} pcscAuthStatsT;
+
+// per action transmit statistics (always on, read with pcscGetStats)
+typedef enum {
+    PCSC_STAT_KEY=0,
+    PCSC_STAT_AUTH,
+    PCSC_STAT_READ,
+    PCSC_STAT_WRITE,
+    PCSC_STAT_UUID,
+    PCSC_STAT_VALUE,
+    PCSC_STAT_APDU,
+    PCSC_STAT_OTHER,
+    PCSC_STAT_COUNT  // trailer
+} pcscStatActionE;
+
+typedef struct {
+    ulong count;
+    ulong errors;
+    ulong bytesOut;  // command bytes sent
+    ulong bytesIn;   // response bytes received
+    ulong usecTotal;
+    ulong usecMax;
+    ulong hist[PCSC_STATS_BUCKETS];
+} pcscActionStatsT;
+
+typedef struct {
+    pcscActionStatsT actions[PCSC_STAT_COUNT];
+} pcscStatsT;
+
+// reader scheduler priority classes, lower class is served first
+typedef enum {
+    PCSC_PRIO_INTERACTIVE=0, // access checks, card events
+    PCSC_PRIO_NORMAL,
+    PCSC_PRIO_BULK,          // provisioning, yields at command (sector) boundaries
+    PCSC_PRIO_COUNT  // trailer
+} pcscPrioE;
+
+typedef struct {
+    ulong depth;      // requests currently queued
+    ulong depthMax;
+    ulong granted;
+    ulong expired;    // deadline reached while queued
+    ulong preempted;  // holder of this class yielded to a higher class
+    ulong waitUsec;   // total queue time of granted requests
+    ulong waitMax;
+} pcscSchedClassT;
+
+typedef struct {
+    pcscSchedClassT classes[PCSC_PRIO_COUNT];
+} pcscSchedStatsT;
+
+typedef struct {
+    ulong events;     // reader state changes seen by monitor
+    ulong coalesced;  // intermediate states merged within debounce window
+    ulong delivered;  // callbacks
+    ulong suppressed; // callbacks skipped for a card back within duplicate tap window
+} pcscMonitorStatsT;
+
+typedef struct {
+    ulong queued;     // sectors proposed by hints or learned sequences
+    ulong prefetched; // sectors read ahead into session cache
+    ulong apdus;      // commands sent for prefetch (key, authent, read)
+    ulong hits;       // reads served from session cache
+    ulong misses;     // reads sent to card
+    ulong wasted;     // prefetch commands of sectors never read
+} pcscReadAheadStatsT;
+
+typedef enum {
+    PCSC_DUMP_OK=0,
+    PCSC_DUMP_REFUSED,  // no ring key authenticates sector
+    PCSC_DUMP_FAILED,   // read failed
+} pcscDumpStatusE;
+
+typedef struct {
+    ulong sectors;
+    ulong readable;   // dump: sectors read, restore: sectors restored
+    ulong refused;
+    ulong failed;
+    ulong auths;      // authentications sent (ring keys included)
+    ulong apdus;      // commands sent
+    ulong writes;     // restore: blocks written
+    ulong unchanged;  // restore: blocks already matching dump
+    ulong bytes;      // data bytes read (dump) or written (restore)
+    ulong usec;
+} pcscDumpStatsT;
+
+typedef struct {
+    ulong loads;      // directories read from card (once per tap)
+    ulong reads;      // record store blocks read from card
+    ulong hits;       // blocks served from session cache
+    ulong writes;     // blocks written
+    ulong unchanged;  // blocks matching card, not written
+} pcscStoreStatsT;
+
+typedef struct {
+    ulong retries;    // commands resent after a transient/auth error
+    ulong recovered;  // commands which succeeded after retry
+    ulong reauths;    // re-authentications after card reactivation
+    ulong exhausted;  // commands failing after retry budget
+    ulong errors[PCSC_ERR_ABORTED+1]; // failed transmits per error class
+} pcscRetryStatsT;
+
 typedef struct {
     u_int8_t *acls;
     u_int8_t alen;
@@ -76,23 +261,96 @@ typedef struct {
     pcscKeyT *keyB;
 } pcscTrailerT;
 
+// reader control profile, named settings use ACR122U escape commands, other
+// readers may rely on raw escape commands. -1 keeps reader default.
+typedef struct {
+    const char *reader;        // reader name match (NULL=any reader)
+    int buzzer;                // buzzer on card detection 0=off 1=on
+    int polling;               // auto PICC polling 0=off 1=on
+    int interval;              // polling interval in ms (250|500)
+    int led;                   // LED state control byte
+    int timeout;               // reader timeout in seconds (5s steps, 0=none)
+    const u_int8_t **escapes;  // raw escape commands sent as is
+    const ulong *elens;
+    int ecount;
+} pcscCtrlProfileT;
+
 typedef struct pcscHandleS pcscHandleT; // opaque handle for client apps
+typedef struct pcscTokenS pcscTokenT;   // cancellation token
+typedef struct pcscStoreS pcscStoreT;   // card record store layout
 typedef int (*pcscStatusCbT) (pcscHandleT *handle, ulong state, void*ctx);
 
 pcscHandleT *pcscConnect (const char *uid, const char *readerName);
 int pcscDisconnect (pcscHandleT *handle);
 int pcscSetOpt (pcscHandleT *handle, pcscOptsE opt, ulong value);
+int pcscBitrate (pcscHandleT *handle);
 const char* pcscReaderName (pcscHandleT *handle);
 const char* pcscErrorMsg (pcscHandleT *handle);
 u_int64_t pcscGetCardUuid (pcscHandleT *handle);
 
 int pcscReaderCheck (pcscHandleT *handle, int ticks);
+int pcscReaderControl (pcscHandleT *handle, const u_int8_t *cmd, ulong cmdLen, u_int8_t *resp, ulong *respLen);
+int pcscReaderSetup (pcscHandleT *handle, const pcscCtrlProfileT *profiles, int count);
+const pcscCardModelT *pcscCardModel (pcscHandleT *handle);
+const pcscCardModelT *pcscAtrLookup (const u_int8_t *atr, ulong atrLen);
 ulong pcscMonitorReader (pcscHandleT *handle, pcscStatusCbT callback, void *ctx);
 int pcscMonitorWait (pcscHandleT *handle, pcscMonitorActionE action, ulong tid);
+int pcscMonitorStats (pcscHandleT *handle, pcscMonitorStatsT *stats);
+int pcscReadAheadHint (pcscHandleT *handle, const u_int8_t *sectors, int count, const pcscKeyT *key);
+int pcscReadAhead (pcscHandleT *handle, const char *uid, int max);
+int pcscReadAheadStats (pcscHandleT *handle, pcscReadAheadStatsT *stats);
+int pcscDumpCard (pcscHandleT *handle, const char *uid, const pcscKeyT *ring, const char *path, pcscDumpStatsT *stats);
+int pcscRestoreCard (pcscHandleT *handle, const char *uid, const pcscKeyT *ring, const char *path, pcscDumpStatsT *stats);
+const pcscStoreT *pcscNewStore (const char *uid, u_int8_t sector, u_int8_t count, const char **fields, int nfield, const pcscKeyT *key, const pcscKeyT *wkey);
+void pcscFreeStore (const pcscStoreT *store);
+int pcscStoreField (const pcscStoreT *store, const char *field);
+int pcscStoreFormat (pcscHandleT *handle, const char *uid, const pcscStoreT *store);
+int pcscStoreGet (pcscHandleT *handle, const char *uid, const pcscStoreT *store, const char *field, u_int8_t *data, ulong *dataLen);
+int pcscStoreSet (pcscHandleT *handle, const char *uid, const pcscStoreT *store, const char *field, const u_int8_t *data, ulong dataLen);
+int pcscStoreStats (pcscHandleT *handle, pcscStoreStatsT *stats);
 pcscHandleT *pcscList(const char** readerList, ulong *readerMax);
 
 const pcscKeyT *pcscNewKey (const char *uid, u_int8_t *value, size_t len);
+const pcscKeyT *pcscNewKeyRing (const char *uid, const pcscKeyT **keys, int count);
+void pcscFreeKeyRing (const pcscKeyT *ring);
+int pcscAuthStats (pcscHandleT *handle, pcscAuthStatsT *stats);
+int pcscRetryStats (pcscHandleT *handle, pcscRetryStatsT *stats);
+pcscErrClassE pcscErrorClass (pcscHandleT *handle);
+int pcscWatchdogRecover (pcscHandleT *handle);
+int pcscGetStats (pcscHandleT *handle, pcscStatsT *stats);
+const char *pcscStatLabel (pcscStatActionE action);
+ulong pcscStatsPercentile (const pcscActionStatsT *action, double percent);
+int pcscReaderUsbDev (pcscHandleT *handle, char *path, ulong len);
+int pcscUsbReset (const char *usbdev);
+int pcscTraceSave (pcscHandleT *handle, const char *path);
+int pcscTraceFile (pcscHandleT *handle, const char *path);
+int pcscTracePrint (pcscHandleT *handle, FILE *out);
+int pcscTraceDecode (const char *path, FILE *out);
+int pcscSessionRecord (const char *path);
+int pcscSessionReplay (const char *path, int fast);
+long pcscSessionClose (ulong *records);
+const char *pcscErrorClassLabel (pcscErrClassE errClass);
+int pcscSetDeadline (pcscHandleT *handle, pcscDeadlineE scope, ulong ms);
+pcscTokenT *pcscTokenCreate (void);
+void pcscTokenCancel (pcscTokenT *token);
+int pcscTokenCancelled (pcscTokenT *token);
+void pcscTokenFree (pcscTokenT *token);
+int pcscSetToken (pcscHandleT *handle, pcscTokenT *token);
+int pcscSchedAcquire (pcscHandleT *handle, pcscPrioE prio, ulong deadline);
+int pcscSchedYield (pcscHandleT *handle);
+int pcscSchedRelease (pcscHandleT *handle);
+int pcscSchedStats (pcscHandleT *handle, pcscSchedStatsT *stats);
+const char *pcscPrioLabel (pcscPrioE prio);
+int pcscKeyDiversify (const pcscKeyT *key, const u_int8_t *cardUid, ulong uidLen, u_int8_t sector, u_int8_t *kval, ulong klen);
 int pcscReadUuid (pcscHandleT *handle, const char *uid, u_int8_t *data, ulong *dlen);
 int pcsWriteTrailer (pcscHandleT *handle, const char *uid, u_int8_t secIdx, u_int8_t blkIdx, const pcscKeyT *key, const pcscTrailerT *trailer);
 int pcsWriteBlock (pcscHandleT *handle, const char *uid, u_int8_t secIdx, u_int8_t blkIdx, u_int8_t *dataBuf, ulong dataLen, const pcscKeyT *key);
 int pcscReadBlock (pcscHandleT *handle, const char *uid, u_int8_t secIdx, u_int8_t blkIdx, u_int8_t *data, ulong dataLen, const pcscKeyT *key);
+int pcscValueBlock (pcscHandleT *handle, const char *uid, u_int8_t secIdx, u_int8_t blkIdx, pcscValueOpE op, int32_t *value, u_int8_t dstIdx, const pcscKeyT *key);
+int pcscFelicaRead (pcscHandleT *handle, const char *uid, const u_int16_t *svcs, int nsvc, u_int16_t blkIdx, u_int8_t *data, ulong dataLen);
+int pcscFelicaWrite (pcscHandleT *handle, const char *uid, const u_int16_t *svcs, int nsvc, u_int16_t blkIdx, const u_int8_t *data, ulong dataLen);
+
+// ISO7816-4 apdu (T=1/ISO14443-4 cards)
+long pcscApduBuild (u_int8_t *apdu, ulong size, u_int8_t cla, u_int8_t ins, u_int8_t p1, u_int8_t p2, const u_int8_t *data, ulong dataLen, ulong le);
+int pcscSendApdu (pcscHandleT *handle, const char *uid, const u_int8_t *apdu, ulong apduLen, u_int8_t *data, ulong *dataLen, u_int16_t *sw);
+int pcscIsoReadBinary (pcscHandleT *handle, const char *uid, u_int16_t offset, u_int8_t *data, ulong *dataLen, u_int16_t *sw);
@@ -0,0 +1,584 @@
+/*
+ * Copyright (C) 2015-2022 IoT.bzh Company
+ * Author: Fulup Ar Foll <fulup@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * session record/replay: pcsc-lite exchanges (status changes, connect, APDUs, escapes) are
+ * recorded with inter-arrival time into a compact file, replay feeds them back to pcsc-glue
+ * without reader at recorded speed or as fast as possible.
+ *  - file: header then records (pcscSessionRecT + command bytes + response bytes)
+ *  - replay is sequential, one reader per session. A command which does not match next
+ *    record (type, apdu header, length) skips up to PCSC_REPLAY_RESYNC records, skipped
+ *    records are counted as divergences (returned by pcscSessionClose)
+ *  - load key values and Mifare trailer keys are zeroed when recording
+ */
+#define _GNU_SOURCE
+
+#include "pcsc-glue.h"
+#include "pcsc-backend.h"
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pcsclite.h>
+
+#define PCSC_SESSION_MAGIC "PCSCSES1"
+#define PCSC_REPLAY_RESYNC 16 // records searched forward when replay diverges
+#define PCSC_SESSION_MASK_MAX (5+256+2) // masked commands/responses are short pseudo apdus (load key, block read/write)
+
+typedef enum {
+    PCSC_SESSION_READERS=1, // list readers (response: multi-string)
+    PCSC_SESSION_CHANGE,    // status change (response: per reader u32 state, u8 atrLen, atr)
+    PCSC_SESSION_CONNECT,   // proto: active protocol
+    PCSC_SESSION_RECONNECT,
+    PCSC_SESSION_STATUS,    // card status (command: reader name, response: atr, state, proto)
+    PCSC_SESSION_TRANSMIT,
+    PCSC_SESSION_CONTROL,   // state: control code
+} pcscSessionTypeE;
+
+typedef struct {
+    u_int32_t delta;   // usec since previous record
+    int32_t rv;        // pcsc-lite return code
+    u_int32_t state;
+    u_int32_t proto;
+    u_int16_t slen;    // command bytes following record
+    u_int16_t rlen;    // response bytes following command
+    u_int8_t type;     // pcscSessionTypeE
+    u_int8_t pad[3];
+} pcscSessionRecT;
+
+typedef struct {
+    char magic[8];
+    u_int32_t recSize;  // sizeof(pcscSessionRecT), checked at replay
+    u_int32_t pad;
+} pcscSessionHeaderT;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    FILE *file;          // record
+    u_int8_t *buffer;    // replay: whole session is loaded
+    size_t size;
+    size_t offset;
+    int fast;            // replay without recorded delays
+    ulong cancel;        // cancel generation, wakes up replayed status change
+    u_int64_t last;      // previous record/replay time
+    ulong records;
+    ulong diverged;
+} pcscSession = {.lock= PTHREAD_MUTEX_INITIALIZER, .cond= PTHREAD_COND_INITIALIZER};
+
+static u_int64_t pcscSessionNow (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (u_int64_t)now.tv_sec*1000000 + (u_int64_t)now.tv_nsec/1000;
+}
+
+// return buffer or a masked copy when it holds key bytes
+static const BYTE *pcscSessionMask (const BYTE *cmd, ulong cmdLen, const BYTE *buffer, ulong len, int response, BYTE *copy) {
+    if (cmdLen < 5 || cmd[0] != 0xFF || len > PCSC_SESSION_MASK_MAX) return buffer;
+
+    if (!response && cmd[1] == 0x82) {
+        memcpy (copy, buffer, len);
+        memset (&copy[5], 0, len-5);
+        return copy;
+    }
+
+    // Mifare classic block read (response) or write (command), multi-block commands may span
+    // several trailers: keyA and keyB of each one are masked
+    if (cmd[2] || (response ? cmd[1] != 0xB0 : cmd[1] != 0xD6)) return buffer;
+    ulong first= cmd[3], count= (cmd[4] ? cmd[4] : 256) / 16, base= response ? 0 : 5;
+    const BYTE *masked= buffer;
+    for (ulong block=first; block < first+count; block++) {
+        ulong offset= base + (block-first)*16;
+        if (block < 128 ? block % 4 != 3 : (block-128) % 16 != 15) continue;
+        if (offset + 16 > len) break;
+        if (masked == buffer) masked= memcpy (copy, buffer, len);
+        memset (&copy[offset], 0, PCSC_MIFARE_KEY_LEN);
+        memset (&copy[offset+10], 0, PCSC_MIFARE_KEY_LEN);
+    }
+    return masked;
+}
+
+static void pcscSessionWrite (pcscSessionTypeE type, LONG rv, ulong state, ulong proto, const BYTE *cmd, ulong cmdLen, const BYTE *resp, ulong respLen) {
+    u_int64_t now= pcscSessionNow();
+    BYTE cmdCopy[PCSC_SESSION_MASK_MAX], respCopy[PCSC_SESSION_MASK_MAX];
+    const BYTE *cmdRec= pcscSessionMask (cmd, cmdLen, cmd, cmdLen, 0, cmdCopy);
+    const BYTE *respRec= pcscSessionMask (cmd, cmdLen, resp, respLen, 1, respCopy);
+
+    pthread_mutex_lock (&pcscSession.lock);
+    if (!pcscSession.file) goto OnExit;
+
+    u_int64_t delta= pcscSession.last ? now - pcscSession.last : 0;
+    pcscSessionRecT rec= {
+        .delta= delta > UINT32_MAX ? UINT32_MAX : (u_int32_t)delta,
+        .rv= (int32_t)rv,
+        .state= (u_int32_t)state,
+        .proto= (u_int32_t)proto,
+        .slen= (u_int16_t)cmdLen,
+        .rlen= (u_int16_t)respLen,
+        .type= (u_int8_t)type,
+    };
+    fwrite (&rec, sizeof(rec), 1, pcscSession.file);
+    if (cmdLen) fwrite (cmdRec, 1, cmdLen, pcscSession.file);
+    if (respLen) fwrite (respRec, 1, respLen, pcscSession.file);
+    // status changes are rare, keep session usable when process is killed
+    if (type == PCSC_SESSION_CHANGE) fflush (pcscSession.file);
+    pcscSession.last= now;
+    pcscSession.records++;
+
+OnExit:
+    pthread_mutex_unlock (&pcscSession.lock);
+}
+
+static LONG pcscRecEstablishContext (DWORD scope, LPCVOID reserved1, LPCVOID reserved2, SCARDCONTEXT *context) {
+    return pcscHwBackend.establishContext (scope, reserved1, reserved2, context);
+}
+
+static LONG pcscRecReleaseContext (SCARDCONTEXT context) {
+    return pcscHwBackend.releaseContext (context);
+}
+
+static LONG pcscRecListReaders (SCARDCONTEXT context, LPCSTR groups, LPSTR readers, DWORD *readersLen) {
+    int autoAlloc= (*readersLen == SCARD_AUTOALLOCATE);
+    LONG rv= pcscHwBackend.listReaders (context, groups, readers, readersLen);
+    const char *list= autoAlloc ? *(char**)readers : readers;
+    ulong len=0;
+
+    // multi-string: names split by '\0', closed by an empty name
+    if (rv == SCARD_S_SUCCESS && list) {
+        while (list[len]) len += strlen (&list[len]) + 1;
+        len++;
+    }
+    pcscSessionWrite (PCSC_SESSION_READERS, rv, 0, 0, NULL, 0, (const BYTE*)list, len);
+    return rv;
+}
+
+static LONG pcscRecFreeMemory (SCARDCONTEXT context, LPCVOID memory) {
+    return pcscHwBackend.freeMemory (context, memory);
+}
+
+static LONG pcscRecGetStatusChange (SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count) {
+    LONG rv= pcscHwBackend.getStatusChange (context, timeout, states, count);
+    BYTE resp[count * (sizeof(u_int32_t) + 1 + MAX_ATR_SIZE)];
+    ulong rlen=0;
+
+    for (DWORD idx=0; idx < count; idx++) {
+        u_int32_t state= (u_int32_t)states[idx].dwEventState;
+        u_int8_t atrLen= states[idx].cbAtr > MAX_ATR_SIZE ? MAX_ATR_SIZE : (u_int8_t)states[idx].cbAtr;
+        memcpy (&resp[rlen], &state, sizeof(state));
+        rlen += sizeof(state);
+        resp[rlen++]= atrLen;
+        memcpy (&resp[rlen], states[idx].rgbAtr, atrLen);
+        rlen += atrLen;
+    }
+    pcscSessionWrite (PCSC_SESSION_CHANGE, rv, count, 0, NULL, 0, resp, rlen);
+    return rv;
+}
+
+static LONG pcscRecCancel (SCARDCONTEXT context) {
+    return pcscHwBackend.cancel (context);
+}
+
+static LONG pcscRecConnect (SCARDCONTEXT context, LPCSTR reader, DWORD share, DWORD protocols, SCARDHANDLE *card, DWORD *active) {
+    LONG rv= pcscHwBackend.connect (context, reader, share, protocols, card, active);
+    pcscSessionWrite (PCSC_SESSION_CONNECT, rv, share, rv == SCARD_S_SUCCESS ? *active : 0, NULL, 0, NULL, 0);
+    return rv;
+}
+
+static LONG pcscRecReconnect (SCARDHANDLE card, DWORD share, DWORD protocols, DWORD init, DWORD *active) {
+    LONG rv= pcscHwBackend.reconnect (card, share, protocols, init, active);
+    pcscSessionWrite (PCSC_SESSION_RECONNECT, rv, init, rv == SCARD_S_SUCCESS ? *active : 0, NULL, 0, NULL, 0);
+    return rv;
+}
+
+static LONG pcscRecDisconnect (SCARDHANDLE card, DWORD disposition) {
+    return pcscHwBackend.disconnect (card, disposition);
+}
+
+static LONG pcscRecStatus (SCARDHANDLE card, LPSTR names, DWORD *namesLen, DWORD *state, DWORD *protocol, BYTE *atr, DWORD *atrLen) {
+    LONG rv= pcscHwBackend.status (card, names, namesLen, state, protocol, atr, atrLen);
+    int done= (rv == SCARD_S_SUCCESS);
+
+    pcscSessionWrite (PCSC_SESSION_STATUS, rv, done ? *state : 0, done ? *protocol : 0, (const BYTE*)names, (done && names) ? *namesLen : 0, atr, (done && atr) ? *atrLen : 0);
+    return rv;
+}
+
+static LONG pcscRecTransmit (SCARDHANDLE card, const SCARD_IO_REQUEST *sendPci, const BYTE *send, DWORD sendLen, SCARD_IO_REQUEST *recvPci, BYTE *recv, DWORD *recvLen) {
+    LONG rv= pcscHwBackend.transmit (card, sendPci, send, sendLen, recvPci, recv, recvLen);
+    pcscSessionWrite (PCSC_SESSION_TRANSMIT, rv, 0, 0, send, sendLen, recv, rv == SCARD_S_SUCCESS ? *recvLen : 0);
+    return rv;
+}
+
+static LONG pcscRecControl (SCARDHANDLE card, DWORD code, LPCVOID send, DWORD sendLen, LPVOID recv, DWORD recvLen, DWORD *returned) {
+    LONG rv= pcscHwBackend.control (card, code, send, sendLen, recv, recvLen, returned);
+    pcscSessionWrite (PCSC_SESSION_CONTROL, rv, code, 0, send, sendLen, recv, rv == SCARD_S_SUCCESS ? *returned : 0);
+    return rv;
+}
+
+static const pcscBackendT pcscRecordBackend = {
+    .label= "record",
+    .establishContext= pcscRecEstablishContext,
+    .releaseContext= pcscRecReleaseContext,
+    .listReaders= pcscRecListReaders,
+    .freeMemory= pcscRecFreeMemory,
+    .getStatusChange= pcscRecGetStatusChange,
+    .cancel= pcscRecCancel,
+    .connect= pcscRecConnect,
+    .reconnect= pcscRecReconnect,
+    .disconnect= pcscRecDisconnect,
+    .status= pcscRecStatus,
+    .transmit= pcscRecTransmit,
+    .control= pcscRecControl,
+};
+
+// record matches requested exchange: same type, same control code, same apdu header and length
+static int pcscReplayMatch (const pcscSessionRecT *rec, const BYTE *data, pcscSessionTypeE type, ulong state, const BYTE *cmd, ulong cmdLen) {
+    if (rec->type != type) return 0;
+    if (type == PCSC_SESSION_CONTROL && rec->state != state) return 0;
+    if (type != PCSC_SESSION_TRANSMIT && type != PCSC_SESSION_CONTROL) return 1;
+    if (rec->slen != cmdLen) return 0;
+    return !memcmp (data, cmd, cmdLen < 4 ? cmdLen : 4);
+}
+
+// consume next matching record, wait for its recorded delay unless replay is fast. Status change
+// wait is aborted by cancel (record is kept). Record header is copied into rec (file buffer has
+// no alignment), return record data (command then response bytes) or NULL with rv set
+static const BYTE *pcscReplayTake (pcscSessionTypeE type, ulong state, const BYTE *cmd, ulong cmdLen, pcscSessionRecT *rec, LONG *rv) {
+    const BYTE *data=NULL;
+    size_t offset;
+    int skipped=0;
+
+    pthread_mutex_lock (&pcscSession.lock);
+    ulong cancel= pcscSession.cancel;
+
+    for (offset= pcscSession.offset; offset + sizeof(pcscSessionRecT) <= pcscSession.size; skipped++) {
+        if (skipped > PCSC_REPLAY_RESYNC) break;
+        memcpy (rec, &pcscSession.buffer[offset], sizeof(pcscSessionRecT));
+        if (offset + sizeof(pcscSessionRecT) + rec->slen + rec->rlen > pcscSession.size) {
+            // truncated record (recording interrupted), session ends here
+            EXT_WARNING ("[pcsc-replay-truncated] record at offset=%zu exceeds session size=%zu", offset, pcscSession.size);
+            pcscSession.size= offset;
+            break;
+        }
+        if (pcscReplayMatch (rec, &pcscSession.buffer[offset + sizeof(pcscSessionRecT)], type, state, cmd, cmdLen)) {
+            data= &pcscSession.buffer[offset + sizeof(pcscSessionRecT)];
+            break;
+        }
+        offset += sizeof(pcscSessionRecT) + rec->slen + rec->rlen;
+    }
+    if (!data) {
+        if (pcscSession.offset >= pcscSession.size) {
+            // session is over, monitor exits as on cancel and commands fail as card left
+            *rv= (type == PCSC_SESSION_CHANGE) ? SCARD_E_CANCELLED : SCARD_E_NO_SMARTCARD;
+        } else {
+            EXT_WARNING ("[pcsc-replay-diverge] no record type=%d within %d records", type, PCSC_REPLAY_RESYNC);
+            pcscSession.diverged++;
+            *rv= SCARD_F_INTERNAL_ERROR;
+        }
+        goto OnErrorExit;
+    }
+    if (skipped) {
+        EXT_DEBUG ("[pcsc-replay-resync] type=%d skipped=%d records", type, skipped);
+        pcscSession.diverged += (ulong)skipped;
+    }
+
+    // replay at recorded speed, lagging replay does not try to catch up
+    if (!pcscSession.fast) {
+        u_int64_t target= pcscSession.last + rec->delta;
+        while (pcscSessionNow() < target) {
+            if (type != PCSC_SESSION_CHANGE) {
+                pthread_mutex_unlock (&pcscSession.lock);
+                usleep ((useconds_t)(target - pcscSessionNow()));
+                pthread_mutex_lock (&pcscSession.lock);
+                continue;
+            }
+            struct timespec deadline;
+            u_int64_t wait= target - pcscSessionNow();
+            clock_gettime (CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += (time_t)(wait / 1000000);
+            deadline.tv_nsec += (long)(wait % 1000000) * 1000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait (&pcscSession.cond, &pcscSession.lock, &deadline);
+            if (pcscSession.cancel != cancel) {
+                *rv= SCARD_E_CANCELLED;
+                goto OnErrorExit;
+            }
+        }
+    }
+    pcscSession.offset= offset + sizeof(pcscSessionRecT) + rec->slen + rec->rlen;
+    pcscSession.last= pcscSessionNow();
+    pcscSession.records++;
+    *rv= rec->rv;
+    pthread_mutex_unlock (&pcscSession.lock);
+    return data;
+
+OnErrorExit:
+    pthread_mutex_unlock (&pcscSession.lock);
+    return NULL;
+}
+
+static LONG pcscReplayEstablishContext (DWORD scope, LPCVOID reserved1, LPCVOID reserved2, SCARDCONTEXT *context) {
+    *context= 1;
+    return SCARD_S_SUCCESS;
+}
+
+static LONG pcscReplayReleaseContext (SCARDCONTEXT context) {
+    return SCARD_S_SUCCESS;
+}
+
+static LONG pcscReplayListReaders (SCARDCONTEXT context, LPCSTR groups, LPSTR readers, DWORD *readersLen) {
+    pcscSessionRecT rec;
+    LONG rv;
+    const BYTE *data= pcscReplayTake (PCSC_SESSION_READERS, 0, NULL, 0, &rec, &rv);
+    if (!data || rv != SCARD_S_SUCCESS) return rv;
+    const BYTE *list= data + rec.slen;
+
+    // multi-string list ends with an empty string, pcscList walks it up to there
+    if (!rec.rlen || list[rec.rlen-1] || (rec.rlen > 1 && list[rec.rlen-2])) {
+        EXT_WARNING ("[pcsc-replay-corrupt] readers record len=%d without list terminator", rec.rlen);
+        return SCARD_F_INTERNAL_ERROR;
+    }
+
+    if (*readersLen == SCARD_AUTOALLOCATE) {
+        char *copy= malloc (rec.rlen);
+        if (!copy) return SCARD_E_NO_MEMORY;
+        memcpy (copy, list, rec.rlen);
+        *(char**)readers= copy;
+    } else if (readers) {
+        if (*readersLen < rec.rlen) return SCARD_E_INSUFFICIENT_BUFFER;
+        memcpy (readers, list, rec.rlen);
+    }
+    *readersLen= rec.rlen;
+    return rv;
+}
+
+static LONG pcscReplayFreeMemory (SCARDCONTEXT context, LPCVOID memory) {
+    free ((void*)memory);
+    return SCARD_S_SUCCESS;
+}
+
+static LONG pcscReplayGetStatusChange (SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count) {
+    pcscSessionRecT rec;
+    LONG rv;
+    const BYTE *data= pcscReplayTake (PCSC_SESSION_CHANGE, 0, NULL, 0, &rec, &rv);
+    if (!data) return rv;
+    const BYTE *resp= data + rec.slen;
+    ulong rlen=0;
+
+    // per reader: u32 state, u8 atr length, atr. Lengths come from file, check them against record
+    for (DWORD idx=0; idx < count && idx < rec.state && rlen < rec.rlen; idx++) {
+        u_int32_t state;
+        u_int8_t atrLen;
+        if (rlen + sizeof(state) + 1 > rec.rlen) goto OnCorruptExit;
+        memcpy (&state, &resp[rlen], sizeof(state));
+        rlen += sizeof(state);
+        atrLen= resp[rlen++];
+        if (atrLen > MAX_ATR_SIZE || rlen + atrLen > rec.rlen) goto OnCorruptExit;
+        states[idx].dwEventState= state;
+        states[idx].cbAtr= atrLen;
+        memcpy (states[idx].rgbAtr, &resp[rlen], atrLen);
+        rlen += atrLen;
+    }
+    return rv;
+
+OnCorruptExit:
+    EXT_WARNING ("[pcsc-replay-corrupt] status change record len=%d overflows at offset=%lu", rec.rlen, rlen);
+    return SCARD_F_INTERNAL_ERROR;
+}
+
+static LONG pcscReplayCancel (SCARDCONTEXT context) {
+    pthread_mutex_lock (&pcscSession.lock);
+    pcscSession.cancel++;
+    pthread_cond_broadcast (&pcscSession.cond);
+    pthread_mutex_unlock (&pcscSession.lock);
+    return SCARD_S_SUCCESS;
+}
+
+static LONG pcscReplayConnect (SCARDCONTEXT context, LPCSTR reader, DWORD share, DWORD protocols, SCARDHANDLE *card, DWORD *active) {
+    pcscSessionRecT rec;
+    LONG rv;
+    if (!pcscReplayTake (PCSC_SESSION_CONNECT, 0, NULL, 0, &rec, &rv)) return rv;
+    *card= 1;
+    *active= rec.proto;
+    return rv;
+}
+
+static LONG pcscReplayReconnect (SCARDHANDLE card, DWORD share, DWORD protocols, DWORD init, DWORD *active) {
+    pcscSessionRecT rec;
+    LONG rv;
+    if (!pcscReplayTake (PCSC_SESSION_RECONNECT, 0, NULL, 0, &rec, &rv)) return rv;
+    *active= rec.proto;
+    return rv;
+}
+
+static LONG pcscReplayDisconnect (SCARDHANDLE card, DWORD disposition) {
+    return SCARD_S_SUCCESS;
+}
+
+static LONG pcscReplayStatus (SCARDHANDLE card, LPSTR names, DWORD *namesLen, DWORD *state, DWORD *protocol, BYTE *atr, DWORD *atrLen) {
+    pcscSessionRecT rec;
+    LONG rv;
+    const BYTE *data= pcscReplayTake (PCSC_SESSION_STATUS, 0, NULL, 0, &rec, &rv);
+    if (!data || rv != SCARD_S_SUCCESS) return rv;
+
+    if (names && *namesLen >= rec.slen) memcpy (names, data, rec.slen);
+    if (atr && *atrLen >= rec.rlen) memcpy (atr, data + rec.slen, rec.rlen);
+    *namesLen= rec.slen;
+    *atrLen= rec.rlen;
+    *state= rec.state;
+    *protocol= rec.proto;
+    return rv;
+}
+
+static LONG pcscReplayTransmit (SCARDHANDLE card, const SCARD_IO_REQUEST *sendPci, const BYTE *send, DWORD sendLen, SCARD_IO_REQUEST *recvPci, BYTE *recv, DWORD *recvLen) {
+    pcscSessionRecT rec;
+    LONG rv;
+    const BYTE *data= pcscReplayTake (PCSC_SESSION_TRANSMIT, 0, send, sendLen, &rec, &rv);
+    if (!data || rv != SCARD_S_SUCCESS) return rv;
+
+    if (*recvLen < rec.rlen) return SCARD_E_INSUFFICIENT_BUFFER;
+    memcpy (recv, data + rec.slen, rec.rlen);
+    *recvLen= rec.rlen;
+    return rv;
+}
+
+static LONG pcscReplayControl (SCARDHANDLE card, DWORD code, LPCVOID send, DWORD sendLen, LPVOID recv, DWORD recvLen, DWORD *returned) {
+    pcscSessionRecT rec;
+    LONG rv;
+    const BYTE *data= pcscReplayTake (PCSC_SESSION_CONTROL, code, send, sendLen, &rec, &rv);
+    if (!data || rv != SCARD_S_SUCCESS) return rv;
+
+    if (recvLen < rec.rlen) return SCARD_E_INSUFFICIENT_BUFFER;
+    memcpy (recv, data + rec.slen, rec.rlen);
+    *returned= rec.rlen;
+    return rv;
+}
+
+static const pcscBackendT pcscReplayBackend = {
+    .label= "replay",
+    .establishContext= pcscReplayEstablishContext,
+    .releaseContext= pcscReplayReleaseContext,
+    .listReaders= pcscReplayListReaders,
+    .freeMemory= pcscReplayFreeMemory,
+    .getStatusChange= pcscReplayGetStatusChange,
+    .cancel= pcscReplayCancel,
+    .connect= pcscReplayConnect,
+    .reconnect= pcscReplayReconnect,
+    .disconnect= pcscReplayDisconnect,
+    .status= pcscReplayStatus,
+    .transmit= pcscReplayTransmit,
+    .control= pcscReplayControl,
+};
+
+// record every pcsc-lite exchange into path, call before pcscList/pcscConnect
+int pcscSessionRecord (const char *path) {
+    pcscSessionHeaderT header= {.magic=PCSC_SESSION_MAGIC, .recSize=sizeof(pcscSessionRecT)};
+
+    if (pcscBackend != &pcscHwBackend) {
+        EXT_ERROR ("[pcsc-session-busy] session already active backend=%s", pcscBackend->label);
+        goto OnErrorExit;
+    }
+    pcscSession.file= fopen (path, "w");
+    if (!pcscSession.file) {
+        EXT_ERROR ("[pcsc-session-record] fail to create path=%s error=%s", path, strerror(errno));
+        goto OnErrorExit;
+    }
+    if (fwrite (&header, sizeof(header), 1, pcscSession.file) != 1) {
+        EXT_ERROR ("[pcsc-session-record] fail to write path=%s error=%s", path, strerror(errno));
+        fclose (pcscSession.file);
+        pcscSession.file= NULL;
+        goto OnErrorExit;
+    }
+    pcscSession.last= 0;
+    pcscSession.records= 0;
+    pcscBackend= &pcscRecordBackend;
+    return 0;
+
+OnErrorExit:
+    return -1;
+}
+
+// replay a recorded session instead of pcscd, fast=1 ignores recorded delays
+int pcscSessionReplay (const char *path, int fast) {
+    pcscSessionHeaderT *header;
+    FILE *file= NULL;
+    long size;
+
+    if (pcscBackend != &pcscHwBackend) {
+        EXT_ERROR ("[pcsc-session-busy] session already active backend=%s", pcscBackend->label);
+        goto OnErrorExit;
+    }
+    file= fopen (path, "r");
+    if (!file || fseek (file, 0, SEEK_END) || (size= ftell (file)) < (long)sizeof(pcscSessionHeaderT)) {
+        EXT_ERROR ("[pcsc-session-replay] fail to open path=%s error=%s", path, file ? "truncated file" : strerror(errno));
+        goto OnErrorExit;
+    }
+    rewind (file);
+    pcscSession.buffer= malloc ((size_t)size);
+    if (!pcscSession.buffer || fread (pcscSession.buffer, 1, (size_t)size, file) != (size_t)size) {
+        EXT_ERROR ("[pcsc-session-replay] fail to load path=%s", path);
+        goto OnErrorExit;
+    }
+    fclose (file);
+    file= NULL;
+
+    header= (pcscSessionHeaderT*)pcscSession.buffer;
+    if (memcmp (header->magic, PCSC_SESSION_MAGIC, sizeof(header->magic)) || header->recSize != sizeof(pcscSessionRecT)) {
+        EXT_ERROR ("[pcsc-session-replay] path=%s not a pcsc session (or incompatible version)", path);
+        goto OnErrorExit;
+    }
+    pcscSession.size= (size_t)size;
+    pcscSession.offset= sizeof(pcscSessionHeaderT);
+    pcscSession.fast= fast;
+    pcscSession.last= pcscSessionNow();
+    pcscSession.records= 0;
+    pcscSession.diverged= 0;
+    pcscBackend= &pcscReplayBackend;
+    return 0;
+
+OnErrorExit:
+    if (file) fclose (file);
+    free (pcscSession.buffer);
+    pcscSession.buffer= NULL;
+    return -1;
+}
+
+// stop record/replay and restore pcscd backend, return replay divergences (skipped records)
+long pcscSessionClose (ulong *records) {
+    long diverged;
+
+    pthread_mutex_lock (&pcscSession.lock);
+    diverged= (long)pcscSession.diverged;
+    if (pcscSession.file) fclose (pcscSession.file);
+    pcscSession.file= NULL;
+    free (pcscSession.buffer);
+    pcscSession.buffer= NULL;
+    pcscSession.size= 0;
+    pcscSession.offset= 0;
+    pcscSession.diverged= 0;
+    if (records) *records= pcscSession.records;
+    pcscBackend= &pcscHwBackend;
+    pthread_mutex_unlock (&pcscSession.lock);
+    return diverged;
+}